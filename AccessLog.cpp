@@ -0,0 +1,44 @@
+#include "AccessLog.h"
+
+#include <boost/thread/locks.hpp>
+#include "Clock.h"
+
+AccessLog::~AccessLog()
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	this->flush(Clock::now());
+}
+
+bool AccessLog::open(const std::string& path)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	this->file.open(path.c_str(), std::ios::out | std::ios::app);
+	return this->file.is_open();
+}
+
+void AccessLog::write(const std::string& line)
+{
+	const boost::uint64_t now = Clock::now();
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	this->queued += line;
+	this->queued += '\n';
+	this->charge.resize(this->queued.size());
+
+	if(now - this->flushed >= FLUSH_INTERVAL || this->queued.size() >= MAX_QUEUED || Memory::pressure() >= Memory::SHRINK)
+	{
+		this->flush(now);
+	}
+}
+
+void AccessLog::flush(boost::uint64_t now)
+{
+	this->file.write(this->queued.data(), this->queued.size());
+	this->file.flush();
+	this->flushed = now;
+
+	this->queued.clear();
+	this->charge.resize(0);
+}
@@ -0,0 +1,40 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#pragma once
+
+#include <string>
+#include <fstream>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include "Memory.h"
+
+// One line per request appended to a file, safe to call from any thread
+// Lines are queued and written about once per FLUSH_INTERVAL while requests come in,
+// earlier if MAX_QUEUED bytes piled up or memory runs short.
+class AccessLog
+{
+public:
+
+	static const boost::uint64_t FLUSH_INTERVAL = 1000000U; // microseconds
+	static const size_t MAX_QUEUED = 64U * 1024U;           // bytes
+
+	AccessLog() : flushed(0), charge(Memory::LOGGING) { }
+	~AccessLog();
+
+	bool open(const std::string& path);
+	void write(const std::string& line);
+
+private:
+
+	std::ofstream file;
+	std::string queued;
+	boost::uint64_t flushed; // Clock::now()
+	Memory::Charge charge;   // for queued
+	boost::mutex guard;
+
+	// lock held
+	void flush(boost::uint64_t now);
+};
+
+#endif
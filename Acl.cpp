@@ -0,0 +1,421 @@
+#include "Acl.h"
+
+#include <fstream>
+#include <map>
+#include <deque>
+#include <algorithm>
+#include <cctype>
+#include "Message.h"
+
+namespace
+{
+	std::string trim_lower(const std::string& s)
+	{
+		size_t begin = 0;
+		size_t end = s.size();
+		while(begin < end && std::isspace((unsigned char)s[begin]))
+			begin++;
+		while(end > begin && std::isspace((unsigned char)s[end - 1]))
+			end--;
+
+		std::string result = s.substr(begin, end - begin);
+		for(size_t i = 0; i < result.size(); i++)
+		{
+			result[i] = (char)std::tolower((unsigned char)result[i]);
+		}
+		return result;
+	}
+
+	bool host_char(char c)
+	{
+		return std::isalnum((unsigned char)c) || c == '-' || c == '_';
+	}
+
+	// size of the label starting at pos in a '\0' separated key
+	size_t label_size(const std::string& key, size_t pos)
+	{
+		const size_t end = key.find('\0', pos);
+		return (end == std::string::npos ? key.size() : end) - pos;
+	}
+}
+
+AclRules::AclRules() : host_count(0), url_count(0)
+{
+}
+
+bool AclRules::add(const std::string& rule)
+{
+	std::string value = trim_lower(rule);
+
+	if(value.compare(0, 4, "url ") == 0)
+	{
+		const std::string pattern = trim_lower(value.substr(4));
+		if(pattern.empty())
+			return false;
+		this->pending_urls.push_back(pattern);
+		this->url_count++;
+		return true;
+	}
+
+	boost::uint8_t flags = EXACT;
+	if(value.compare(0, 2, "*.") == 0)
+	{
+		flags = SUBDOMAINS;
+		value.erase(0, 2);
+	}
+	else if(!value.empty() && value[0] == '.')
+	{
+		flags = EXACT | SUBDOMAINS;
+		value.erase(0, 1);
+	}
+	if(!value.empty() && value[value.size() - 1] == '.')
+	{
+		value.erase(value.size() - 1); // fully qualified
+	}
+
+	// labels right to left, "www.example.com" -> "com\0example\0www"
+	std::string key;
+	size_t end = value.size();
+	while(end > 0)
+	{
+		const size_t dot = value.rfind('.', end - 1);
+		const size_t begin = dot == std::string::npos ? 0 : dot + 1;
+		if(begin == end || end - begin > 63)
+			return false;
+		for(size_t i = begin; i < end; i++)
+		{
+			if(!host_char(value[i]))
+				return false;
+		}
+
+		if(!key.empty())
+			key += '\0';
+		key.append(value, begin, end - begin);
+		end = dot == std::string::npos ? 0 : dot;
+	}
+	if(key.empty())
+		return false;
+
+	this->pending_hosts.push_back(std::make_pair(key, flags));
+	this->host_count++;
+	return true;
+}
+
+void AclRules::compile()
+{
+	this->compile_hosts();
+	this->compile_urls();
+}
+
+void AclRules::compile_hosts()
+{
+	// sorted, a node's rules are a contiguous range and its children's labels come out in order
+	std::sort(this->pending_hosts.begin(), this->pending_hosts.end());
+
+	this->hosts.clear();
+	this->labels.clear();
+
+	HostNode root = { 0, 0, 0, 0, 0 };
+	this->hosts.push_back(root);
+	if(!this->pending_hosts.empty())
+	{
+		// common labels ("com", "www") are stored once
+		std::map<std::string, boost::uint32_t> interned;
+		this->build_host_node(0, 0, this->pending_hosts.size(), 0, interned);
+	}
+
+	std::vector<std::pair<std::string, boost::uint8_t> >().swap(this->pending_hosts);
+}
+
+void AclRules::build_host_node(boost::uint32_t node, size_t first, size_t last, size_t depth, std::map<std::string, boost::uint32_t>& interned)
+{
+	// rules ending at this node come first, they sort before their subdomains
+	while(first < last && this->pending_hosts[first].first.size() <= depth)
+	{
+		this->hosts[node].flags |= this->pending_hosts[first].second;
+		first++;
+	}
+	if(first == last)
+		return;
+
+	// a child per distinct label, allocated as one block
+	const size_t label_start = depth == 0 ? 0 : depth + 1;
+	std::vector<size_t> groups;
+	for(size_t i = first; i < last; i++)
+	{
+		const std::string& key = this->pending_hosts[i].first;
+		if(i == first)
+		{
+			groups.push_back(i);
+			continue;
+		}
+		const std::string& previous = this->pending_hosts[i - 1].first;
+		const size_t size = label_size(key, label_start);
+		if(size != label_size(previous, label_start) || key.compare(label_start, size, previous, label_start, size) != 0)
+		{
+			groups.push_back(i);
+		}
+	}
+	groups.push_back(last);
+
+	const boost::uint32_t first_child = (boost::uint32_t)this->hosts.size();
+	this->hosts[node].first_child = first_child;
+	this->hosts[node].children = (boost::uint32_t)(groups.size() - 1);
+
+	for(size_t g = 0; g + 1 < groups.size(); g++)
+	{
+		const std::string& key = this->pending_hosts[groups[g]].first;
+		const std::string label = key.substr(label_start, label_size(key, label_start));
+
+		std::map<std::string, boost::uint32_t>::iterator it = interned.find(label);
+		if(it == interned.end())
+		{
+			it = interned.insert(std::make_pair(label, (boost::uint32_t)this->labels.size())).first;
+			this->labels += label;
+		}
+
+		HostNode child = { it->second, (boost::uint16_t)label.size(), 0, 0, 0 };
+		this->hosts.push_back(child);
+	}
+
+	for(size_t g = 0; g + 1 < groups.size(); g++)
+	{
+		const std::string& key = this->pending_hosts[groups[g]].first;
+		const size_t next_depth = label_start + label_size(key, label_start);
+		this->build_host_node(first_child + (boost::uint32_t)g, groups[g], groups[g + 1], next_depth, interned);
+	}
+}
+
+void AclRules::compile_urls()
+{
+	this->states.clear();
+	this->edges.clear();
+
+	// the trie of all patterns first
+	std::vector<std::map<unsigned char, boost::uint32_t> > trie(1);
+	std::vector<bool> match(1, false);
+	for(size_t p = 0; p < this->pending_urls.size(); p++)
+	{
+		const std::string& pattern = this->pending_urls[p];
+		boost::uint32_t state = 0;
+		for(size_t i = 0; i < pattern.size(); i++)
+		{
+			const unsigned char byte = (unsigned char)pattern[i];
+			std::map<unsigned char, boost::uint32_t>::const_iterator it = trie[state].find(byte);
+			if(it == trie[state].end())
+			{
+				trie[state][byte] = (boost::uint32_t)trie.size();
+				state = (boost::uint32_t)trie.size();
+				trie.push_back(std::map<unsigned char, boost::uint32_t>());
+				match.push_back(false);
+			}
+			else
+			{
+				state = it->second;
+			}
+		}
+		match[state] = true;
+	}
+	std::vector<std::string>().swap(this->pending_urls);
+
+	// flattened, edges of a state in byte order
+	this->states.resize(trie.size());
+	for(size_t s = 0; s < trie.size(); s++)
+	{
+		this->states[s].first_edge = (boost::uint32_t)this->edges.size();
+		this->states[s].edges = (boost::uint32_t)trie[s].size();
+		this->states[s].fail = 0;
+		this->states[s].match = match[s];
+		for(std::map<unsigned char, boost::uint32_t>::const_iterator it = trie[s].begin(); it != trie[s].end(); ++it)
+		{
+			UrlEdge edge = { it->first, it->second };
+			this->edges.push_back(edge);
+		}
+	}
+
+	// failure links breadth first, a state's is the longest proper suffix that's also in the trie
+	std::deque<boost::uint32_t> queue;
+	for(boost::uint32_t e = 0; e < this->states[0].edges; e++)
+	{
+		queue.push_back(this->edges[e].target);
+	}
+	while(!queue.empty())
+	{
+		const boost::uint32_t state = queue.front();
+		queue.pop_front();
+
+		const UrlState& current = this->states[state];
+		for(boost::uint32_t e = current.first_edge; e < current.first_edge + current.edges; e++)
+		{
+			const UrlEdge& edge = this->edges[e];
+
+			boost::uint32_t fail = current.fail;
+			boost::uint32_t next = this->step(fail, edge.byte);
+			while(next == 0 && fail != 0)
+			{
+				fail = this->states[fail].fail;
+				next = this->step(fail, edge.byte);
+			}
+
+			this->states[edge.target].fail = next;
+			this->states[edge.target].match = this->states[edge.target].match || this->states[next].match;
+			queue.push_back(edge.target);
+		}
+	}
+}
+
+const AclRules::HostNode* AclRules::find_child(const HostNode& node, const char* label, size_t size) const
+{
+	// binary search among the siblings
+	size_t low = node.first_child;
+	size_t high = node.first_child + node.children;
+	while(low < high)
+	{
+		const size_t middle = low + (high - low) / 2;
+		const HostNode& child = this->hosts[middle];
+		const int order = this->labels.compare(child.label, child.label_size, label, size);
+		if(order == 0)
+			return &child;
+		if(order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return NULL;
+}
+
+boost::uint32_t AclRules::step(boost::uint32_t state, unsigned char byte) const
+{
+	const UrlState& current = this->states[state];
+	size_t low = current.first_edge;
+	size_t high = current.first_edge + current.edges;
+	while(low < high)
+	{
+		const size_t middle = low + (high - low) / 2;
+		if(this->edges[middle].byte == byte)
+			return this->edges[middle].target;
+		if(this->edges[middle].byte < byte)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return 0;
+}
+
+bool AclRules::matches_host(const std::string& host) const
+{
+	if(this->hosts.empty())
+		return false;
+
+	const HostNode* node = &this->hosts[0];
+	size_t end = host.size();
+	if(end > 0 && host[end - 1] == '.')
+		end--;
+
+	while(end > 0)
+	{
+		if(node->flags & SUBDOMAINS)
+			return true; // and there's more to the host
+
+		const size_t dot = host.rfind('.', end - 1);
+		const size_t begin = dot == std::string::npos ? 0 : dot + 1;
+		node = this->find_child(*node, host.data() + begin, end - begin);
+		if(!node)
+			return false;
+
+		end = dot == std::string::npos ? 0 : dot;
+	}
+
+	return (node->flags & EXACT) != 0;
+}
+
+bool AclRules::matches_url(const std::string& url) const
+{
+	if(this->states.size() < 2)
+		return false;
+
+	boost::uint32_t state = 0;
+	for(size_t i = 0; i < url.size(); i++)
+	{
+		const unsigned char byte = (unsigned char)std::tolower((unsigned char)url[i]);
+		boost::uint32_t next = this->step(state, byte);
+		while(next == 0 && state != 0)
+		{
+			state = this->states[state].fail;
+			next = this->step(state, byte);
+		}
+		state = next;
+
+		if(this->states[state].match)
+			return true;
+	}
+	return false;
+}
+
+bool Acl::load(const std::string& path)
+{
+	std::ifstream file(path.c_str());
+	if(!file)
+	{
+		Message::error() << "can't open ACL " << path << '\n';
+		return false;
+	}
+
+	boost::shared_ptr<AclRules> compiled(new AclRules);
+
+	std::string line;
+	size_t number = 0;
+	while(std::getline(file, line))
+	{
+		number++;
+		const std::string rule = line.substr(0, line.find('#'));
+		if(rule.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+
+		if(!compiled->add(rule))
+		{
+			Message::warning() << path << ':' << number << ": skipping malformed rule" << '\n';
+		}
+	}
+
+	compiled->compile();
+	this->set(compiled);
+
+	Message::info() << "ACL " << path << ": " << compiled->host_rules() << " host rules, " << compiled->url_rules() << " URL rules" << '\n';
+	return true;
+}
+
+void Acl::set(const boost::shared_ptr<const AclRules>& rules)
+{
+	// requests holding the old list finish with it, the last one frees it
+	boost::atomic_store(&this->rules, rules);
+}
+
+bool Acl::enabled() const
+{
+	return boost::atomic_load(&this->rules) != NULL;
+}
+
+bool Acl::denies(const std::string& host, const std::string& url) const
+{
+	boost::shared_ptr<const AclRules> current = boost::atomic_load(&this->rules);
+	if(!current)
+		return false;
+
+	// "name[:port]" or "[v6][:port]"
+	std::string name = host;
+	if(!name.empty() && name[0] == '[')
+	{
+		name = name.substr(1, name.find(']') - 1);
+	}
+	else if(name.find(':') == name.rfind(':') && name.find(':') != std::string::npos)
+	{
+		name.erase(name.find(':'));
+	}
+	for(size_t i = 0; i < name.size(); i++)
+	{
+		name[i] = (char)std::tolower((unsigned char)name[i]);
+	}
+
+	return current->matches_host(name) || current->matches_url(url);
+}
@@ -0,0 +1,115 @@
+#ifndef ACL_H
+#define ACL_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+
+// Compiled blocklist, immutable once compile() returned
+// Hosts go into a trie of their labels, right to left, URL patterns into an
+// Aho-Corasick automaton, so a lookup costs O(length) however many rules there are.
+//
+// Rules, one per line:
+//   example.com     that host
+//   *.example.com   every subdomain of it
+//   .example.com    both
+//   url /ads/       URLs containing "/ads/", case-insensitive
+class AclRules
+{
+public:
+
+	AclRules();
+
+	// false if the rule is malformed, it's skipped then
+	bool add(const std::string& rule);
+	// call once after the last add()
+	void compile();
+
+	// lowercase host without a port
+	bool matches_host(const std::string& host) const;
+	bool matches_url(const std::string& url) const;
+
+	size_t host_rules() const { return this->host_count; }
+	size_t url_rules() const { return this->url_count; }
+
+private:
+
+	enum HostFlags
+	{
+		EXACT = 1 << 0,     // the host itself
+		SUBDOMAINS = 1 << 1 // anything below it
+	};
+
+	// children of a node are contiguous and sorted by label
+	struct HostNode
+	{
+		boost::uint32_t label;       // offset into labels
+		boost::uint16_t label_size;
+		boost::uint8_t flags;
+		boost::uint32_t first_child;
+		boost::uint32_t children;
+	};
+
+	// edges of a state are contiguous and sorted by byte
+	struct UrlState
+	{
+		boost::uint32_t first_edge;
+		boost::uint32_t edges;
+		boost::uint32_t fail;
+		bool match; // a pattern ends here, or at a state down the fail chain
+	};
+
+	struct UrlEdge
+	{
+		unsigned char byte;
+		boost::uint32_t target;
+	};
+
+	size_t host_count;
+	size_t url_count;
+
+	// collected by add(), released by compile()
+	std::vector<std::pair<std::string, boost::uint8_t> > pending_hosts; // labels right to left, '\0' separated
+	std::vector<std::string> pending_urls;
+
+	std::vector<HostNode> hosts; // [0] is the root
+	std::string labels;
+	std::vector<UrlState> states; // [0] is the root
+	std::vector<UrlEdge> edges;
+
+	void compile_hosts();
+	void compile_urls();
+	void build_host_node(boost::uint32_t node, size_t first, size_t last, size_t depth, std::map<std::string, boost::uint32_t>& interned);
+	// NULL if there is none
+	const HostNode* find_child(const HostNode& node, const char* label, size_t size) const;
+	// state past byte, 0 if there's no edge
+	boost::uint32_t step(boost::uint32_t state, unsigned char byte) const;
+};
+
+// The rules in use, replaced read-copy-update style: new lists are compiled
+// off to the side and swapped in, requests keep the list they started with
+class Acl
+{
+public:
+
+	Acl() { }
+
+	// the current rules stay if the file can't be read
+	bool load(const std::string& path);
+	void set(const boost::shared_ptr<const AclRules>& rules);
+
+	bool enabled() const;
+	// host as in the request (port and case don't matter), url absolute
+	bool denies(const std::string& host, const std::string& url) const;
+
+private:
+
+	boost::shared_ptr<const AclRules> rules; // atomic_load()/atomic_store() only
+};
+
+#endif
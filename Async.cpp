@@ -0,0 +1,466 @@
+#include "Async.h"
+
+#ifdef HAVE_COROUTINES
+
+#include <cassert>
+#include <cerrno>
+#include <vector>
+#include "Clock.h"
+#include "Message.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+namespace
+{
+	bool would_block()
+	{
+#ifdef _WIN32
+		return ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+	}
+
+	bool in_progress()
+	{
+#ifdef _WIN32
+		return ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		return errno == EINPROGRESS;
+#endif
+	}
+}
+
+struct Reactor::Root
+{
+	struct promise_type
+	{
+		Reactor& reactor;
+
+		// with the coroutine's arguments
+		promise_type(Task<void>&, Reactor& reactor) : reactor(reactor) { }
+		// done or destroyed along with the reactor
+		~promise_type()
+		{
+			this->reactor.roots.erase(std::coroutine_handle<promise_type>::from_promise(*this).address());
+			this->reactor.tasks--;
+		}
+
+		Root get_return_object()
+		{
+			// before the body runs, it may finish right away
+			this->reactor.roots.insert(std::coroutine_handle<promise_type>::from_promise(*this).address());
+			this->reactor.tasks++;
+			return Root();
+		}
+		std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+		std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+		void return_void() { }
+		void unhandled_exception() { }
+	};
+};
+
+Deadline deadline_after(long milliseconds)
+{
+	return Clock::now() + (boost::uint64_t)milliseconds * 1000;
+}
+
+void Cancellation::cancel()
+{
+	this->cancelled = true;
+	if(this->waiting)
+	{
+		this->reactor->wake(*(Reactor::Waiter*)this->waiting, Reactor::CANCELLED);
+	}
+}
+
+Reactor::Awaiter::Awaiter(Reactor& reactor, Socket::socket_t socket, bool write, Deadline deadline, Cancellation* cancellation) :
+	reactor(reactor), early(false)
+{
+	this->waiter.socket = socket;
+	this->waiter.write = write;
+	this->waiter.deadline = deadline;
+	this->waiter.cancellation = cancellation;
+	this->waiter.status = READY;
+
+	if(cancellation && cancellation->is_cancelled())
+	{
+		this->waiter.status = CANCELLED;
+		this->early = true;
+	}
+	else if(deadline != NO_DEADLINE && deadline <= Clock::now())
+	{
+		this->waiter.status = TIMED_OUT;
+		this->early = true;
+	}
+}
+
+void Reactor::Awaiter::await_suspend(std::coroutine_handle<> handle)
+{
+	this->waiter.handle = handle;
+	this->reactor.suspend(this->waiter);
+}
+
+Reactor::Reactor() : tasks(0), stopping(false)
+{
+#ifdef __linux__
+	this->epoll = ::epoll_create1(EPOLL_CLOEXEC);
+#endif
+}
+
+Reactor::~Reactor()
+{
+	// whatever still waits never gets resumed, destroying the outermost frames unwinds the rest
+	this->ready.clear();
+	this->interests.clear();
+	this->timers.clear();
+
+	const std::set<void*> remaining = this->roots;
+	for(std::set<void*>::const_iterator it = remaining.begin(); it != remaining.end(); ++it)
+	{
+		std::coroutine_handle<>::from_address(*it).destroy();
+	}
+
+#ifdef __linux__
+	if(this->epoll >= 0)
+		::close(this->epoll);
+#endif
+}
+
+bool Reactor::valid() const
+{
+#ifdef __linux__
+	return this->epoll >= 0;
+#else
+	return true;
+#endif
+}
+
+void Reactor::spawn(Task<void> task)
+{
+	run_root(std::move(task), *this);
+}
+
+Reactor::Root Reactor::run_root(Task<void> task, Reactor& reactor)
+{
+	(void)reactor; // only for Root's promise, which registers the frame with it
+
+	try
+	{
+		co_await task;
+	}
+	catch(const std::exception& e)
+	{
+		Message::error() << "coroutine failed: " << e.what() << '\n';
+	}
+}
+
+void Reactor::run()
+{
+	this->stopping = false;
+	while(!this->stopping)
+	{
+		while(!this->ready.empty() && !this->stopping)
+		{
+			std::coroutine_handle<> handle = this->ready.front();
+			this->ready.pop_front();
+			handle.resume();
+		}
+
+		if(this->tasks == 0 || this->stopping)
+			break;
+
+		// sleep until a socket is ready or the nearest deadline, rounded up so it has passed
+		int timeout = -1;
+		if(!this->timers.empty())
+		{
+			const boost::uint64_t now = Clock::now();
+			const Deadline nearest = this->timers.begin()->first;
+			timeout = nearest <= now ? 0 : (int)((nearest - now + 999) / 1000);
+		}
+
+		this->poll(timeout);
+		this->expire();
+	}
+}
+
+Reactor::Awaiter Reactor::readable(const Socket& socket, Deadline deadline, Cancellation* cancellation)
+{
+	return Awaiter(*this, socket.get(), false, deadline, cancellation);
+}
+
+Reactor::Awaiter Reactor::writable(const Socket& socket, Deadline deadline, Cancellation* cancellation)
+{
+	return Awaiter(*this, socket.get(), true, deadline, cancellation);
+}
+
+Reactor::Awaiter Reactor::sleep(Deadline until, Cancellation* cancellation)
+{
+	return Awaiter(*this, INVALID_SOCKET, false, until, cancellation);
+}
+
+void Reactor::suspend(Waiter& waiter)
+{
+	if(waiter.socket != INVALID_SOCKET)
+	{
+		Interest& interest = this->interests[waiter.socket];
+		Waiter*& slot = waiter.write ? interest.writer : interest.reader;
+		assert(slot == NULL); // one reader and one writer per socket
+		slot = &waiter;
+		this->update(waiter.socket, interest);
+	}
+
+	waiter.timer = waiter.deadline != NO_DEADLINE ? this->timers.insert(std::make_pair(waiter.deadline, &waiter)) : this->timers.end();
+
+	if(waiter.cancellation)
+	{
+		waiter.cancellation->reactor = this;
+		waiter.cancellation->waiting = &waiter;
+	}
+}
+
+void Reactor::wake(Waiter& waiter, Status status)
+{
+	if(waiter.socket != INVALID_SOCKET)
+	{
+		std::map<Socket::socket_t, Interest>::iterator it = this->interests.find(waiter.socket);
+		if(it != this->interests.end())
+		{
+			(waiter.write ? it->second.writer : it->second.reader) = NULL;
+			this->update(waiter.socket, it->second);
+			if(!it->second.reader && !it->second.writer)
+				this->interests.erase(it);
+		}
+	}
+
+	if(waiter.timer != this->timers.end())
+	{
+		this->timers.erase(waiter.timer);
+		waiter.timer = this->timers.end();
+	}
+
+	if(waiter.cancellation)
+	{
+		waiter.cancellation->waiting = NULL;
+	}
+
+	waiter.status = status;
+	this->ready.push_back(waiter.handle);
+}
+
+void Reactor::update(Socket::socket_t socket, Interest& interest)
+{
+#ifdef __linux__
+	epoll_event event;
+	event.events = (interest.reader ? (boost::uint32_t)EPOLLIN : 0U) | (interest.writer ? (boost::uint32_t)EPOLLOUT : 0U);
+	event.data.fd = socket;
+
+	if(event.events == 0)
+	{
+		if(interest.registered)
+			::epoll_ctl(this->epoll, EPOLL_CTL_DEL, socket, &event);
+		interest.registered = false;
+	}
+	else
+	{
+		::epoll_ctl(this->epoll, interest.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, socket, &event);
+		interest.registered = true;
+	}
+#else
+	(void)socket;
+	interest.registered = interest.reader || interest.writer; // poll() picks it up next time round
+#endif
+}
+
+void Reactor::poll(int milliseconds)
+{
+	// a socket that's both readable and writable wakes both of its waiters
+	std::vector<std::pair<Socket::socket_t, bool> > woken; // socket, write
+
+#ifdef __linux__
+	const int MAX_EVENTS = 64;
+	epoll_event events[MAX_EVENTS];
+	const int count = ::epoll_wait(this->epoll, events, MAX_EVENTS, milliseconds);
+	for(int i = 0; i < count; i++)
+	{
+		// errors and hangups wake everybody, their next call reports them
+		const boost::uint32_t flags = events[i].events;
+		if(flags & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			woken.push_back(std::make_pair((Socket::socket_t)events[i].data.fd, false));
+		if(flags & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+			woken.push_back(std::make_pair((Socket::socket_t)events[i].data.fd, true));
+	}
+#else
+#ifdef _WIN32
+	std::vector<WSAPOLLFD> fds;
+#else
+	std::vector<pollfd> fds;
+#endif
+	for(std::map<Socket::socket_t, Interest>::const_iterator it = this->interests.begin(); it != this->interests.end(); ++it)
+	{
+#ifdef _WIN32
+		WSAPOLLFD fd;
+#else
+		pollfd fd;
+#endif
+		fd.fd = it->first;
+		fd.events = (it->second.reader ? POLLIN : 0) | (it->second.writer ? POLLOUT : 0);
+		fd.revents = 0;
+		fds.push_back(fd);
+	}
+
+	if(fds.empty())
+	{
+		// nothing but timers, poll() without descriptors doesn't sleep everywhere
+		if(milliseconds > 0)
+		{
+			timeval time;
+			time.tv_sec = milliseconds / 1000;
+			time.tv_usec = (milliseconds % 1000) * 1000;
+			::select(0, NULL, NULL, NULL, &time);
+		}
+		return;
+	}
+
+#ifdef _WIN32
+	const int count = ::WSAPoll(&fds[0], (ULONG)fds.size(), milliseconds);
+#else
+	const int count = ::poll(&fds[0], fds.size(), milliseconds);
+#endif
+	for(size_t i = 0; count > 0 && i < fds.size(); i++)
+	{
+		if(fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+			woken.push_back(std::make_pair((Socket::socket_t)fds[i].fd, false));
+		if(fds[i].revents & (POLLOUT | POLLERR | POLLHUP))
+			woken.push_back(std::make_pair((Socket::socket_t)fds[i].fd, true));
+	}
+#endif
+
+	for(size_t i = 0; i < woken.size(); i++)
+	{
+		std::map<Socket::socket_t, Interest>::iterator it = this->interests.find(woken[i].first);
+		if(it == this->interests.end())
+			continue;
+
+		Waiter* waiter = woken[i].second ? it->second.writer : it->second.reader;
+		if(waiter)
+			this->wake(*waiter, READY);
+	}
+}
+
+void Reactor::expire()
+{
+	const boost::uint64_t now = Clock::now();
+	while(!this->timers.empty() && this->timers.begin()->first <= now)
+	{
+		Waiter& waiter = *this->timers.begin()->second;
+		// sleeps end as planned, everything else ran out of time
+		this->wake(waiter, waiter.socket == INVALID_SOCKET ? READY : TIMED_OUT);
+	}
+}
+
+AsyncSocket::AsyncSocket(Reactor& reactor, Socket socket) : reactor(reactor), socket(socket), status(Reactor::READY)
+{
+	assert(!socket.has_layer());
+	this->socket.set_nonblocking(true);
+}
+
+Task<int> AsyncSocket::recv(char* buf, size_t size, Deadline deadline, Cancellation* cancellation)
+{
+	for(;;)
+	{
+		const int read = this->socket.recv(buf, size);
+		if(read >= 0 || !would_block())
+		{
+			this->status = read >= 0 ? Reactor::READY : Reactor::FAILED;
+			co_return read;
+		}
+
+		this->status = co_await this->reactor.readable(this->socket, deadline, cancellation);
+		if(this->status != Reactor::READY)
+		{
+			co_return -1;
+		}
+	}
+}
+
+Task<size_t> AsyncSocket::send(const char* buf, size_t size, Deadline deadline, Cancellation* cancellation)
+{
+	size_t total = 0;
+	while(total < size)
+	{
+		total += this->socket.send(buf + total, size - total);
+		if(total == size)
+			break;
+
+		if(!would_block())
+		{
+			this->status = Reactor::FAILED;
+			co_return total;
+		}
+
+		this->status = co_await this->reactor.writable(this->socket, deadline, cancellation);
+		if(this->status != Reactor::READY)
+		{
+			co_return total;
+		}
+	}
+
+	this->status = Reactor::READY;
+	co_return total;
+}
+
+Task<Socket> AsyncSocket::accept(SocketAddress* addr, Deadline deadline, Cancellation* cancellation)
+{
+	for(;;)
+	{
+		Socket accepted = this->socket.accept(addr, Socket::CLOEXEC);
+		if(accepted.valid() || !would_block())
+		{
+			this->status = accepted.valid() ? Reactor::READY : Reactor::FAILED;
+			co_return accepted;
+		}
+
+		this->status = co_await this->reactor.readable(this->socket, deadline, cancellation);
+		if(this->status != Reactor::READY)
+		{
+			co_return Socket();
+		}
+	}
+}
+
+Task<Socket::ConnectStatus> AsyncSocket::connect(SocketAddress addr, Deadline deadline, Cancellation* cancellation)
+{
+	if(this->socket.connect(addr))
+	{
+		this->status = Reactor::READY;
+		co_return Socket::CONNECTED;
+	}
+	if(!in_progress())
+	{
+		this->status = Reactor::FAILED;
+		co_return Socket::REFUSED;
+	}
+
+	this->status = co_await this->reactor.writable(this->socket, deadline, cancellation);
+	if(this->status != Reactor::READY)
+	{
+		co_return this->status == Reactor::TIMED_OUT ? Socket::TIMED_OUT : Socket::REFUSED;
+	}
+
+	// the outcome is in SO_ERROR
+	int error = 0;
+	socklen_t length = sizeof(error);
+	if(::getsockopt(this->socket.get(), SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0)
+	{
+		this->status = Reactor::FAILED;
+		co_return Socket::REFUSED;
+	}
+	co_return Socket::CONNECTED;
+}
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#pragma once
+
+// Coroutine flavour of Socket, for a connection per coroutine instead of a thread
+// Needs a C++20 compiler and HAVE_COROUTINES defined, the rest of the proxy doesn't use it yet.
+#ifdef HAVE_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <deque>
+#include <map>
+#include <set>
+#include <boost/cstdint.hpp>
+#include "Socket.h"
+
+class Reactor;
+
+// Absolute Clock::now() time an operation gives up at, NO_DEADLINE waits forever
+typedef boost::uint64_t Deadline;
+const Deadline NO_DEADLINE = 0;
+
+Deadline deadline_after(long milliseconds);
+
+// Lazily started coroutine, runs once awaited (or spawned on a Reactor)
+// and hands its result to whoever awaited it
+template<class T = void>
+class Task;
+
+namespace detail
+{
+	struct PromiseBase
+	{
+		std::coroutine_handle<> continuation;
+		std::exception_ptr error;
+
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+
+		// back to the awaiting coroutine without growing the stack
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept { return false; }
+			template<class Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+			{
+				std::coroutine_handle<> next = handle.promise().continuation;
+				return next ? next : std::noop_coroutine();
+			}
+			void await_resume() noexcept { }
+		};
+
+		FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+		void unhandled_exception() { this->error = std::current_exception(); }
+	};
+
+	template<class T>
+	struct Promise : PromiseBase
+	{
+		T value;
+
+		Task<T> get_return_object();
+		void return_value(T value) { this->value = std::move(value); }
+		T result() { if(this->error) std::rethrow_exception(this->error); return std::move(this->value); }
+	};
+
+	template<>
+	struct Promise<void> : PromiseBase
+	{
+		Task<void> get_return_object();
+		void return_void() { }
+		void result() { if(this->error) std::rethrow_exception(this->error); }
+	};
+}
+
+template<class T>
+class Task
+{
+public:
+
+	typedef detail::Promise<T> promise_type;
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	Task() { }
+	explicit Task(Handle handle) : handle(handle) { }
+	Task(Task&& other) noexcept : handle(other.handle) { other.handle = Handle(); }
+	Task& operator=(Task&& other) noexcept { std::swap(this->handle, other.handle); return *this; }
+	~Task() { if(this->handle) this->handle.destroy(); }
+
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	bool valid() const { return (bool)this->handle; }
+
+	bool await_ready() const noexcept { return !this->handle || this->handle.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+	{
+		this->handle.promise().continuation = awaiting;
+		return this->handle;
+	}
+	T await_resume() { return this->handle.promise().result(); }
+
+private:
+
+	Handle handle;
+};
+
+namespace detail
+{
+	template<class T>
+	Task<T> Promise<T>::get_return_object() { return Task<T>(std::coroutine_handle<Promise<T> >::from_promise(*this)); }
+
+	inline Task<void> Promise<void>::get_return_object() { return Task<void>(std::coroutine_handle<Promise<void> >::from_promise(*this)); }
+}
+
+// Stops the operation a coroutine is suspended in, and every later one it starts with it
+// Only for use on the Reactor's thread, like everything else here.
+class Cancellation
+{
+public:
+
+	Cancellation() : cancelled(false), reactor(NULL), waiting(NULL) { }
+
+	void cancel();
+	bool is_cancelled() const { return this->cancelled; }
+
+private:
+
+	friend class Reactor;
+
+	bool cancelled;
+	Reactor* reactor;
+	void* waiting; // Reactor::Waiter of the operation suspended under it
+};
+
+// Single threaded readiness loop, epoll on Linux and (WSA)poll elsewhere
+// Coroutines suspend on a socket becoming readable/writable, a deadline or a
+// cancellation, whichever comes first. Run one per thread to use more cores.
+class Reactor
+{
+public:
+
+	enum Status
+	{
+		READY,
+		TIMED_OUT,
+		CANCELLED,
+		FAILED
+	};
+
+	struct Waiter
+	{
+		Socket::socket_t socket; // INVALID_SOCKET for sleeps
+		bool write;
+		Deadline deadline;
+		Cancellation* cancellation;
+		std::coroutine_handle<> handle;
+		Status status;
+		std::multimap<Deadline, Waiter*>::iterator timer;
+	};
+
+	// co_await reactor.readable(socket), resumes with a Status
+	class Awaiter
+	{
+	public:
+		Awaiter(Reactor& reactor, Socket::socket_t socket, bool write, Deadline deadline, Cancellation* cancellation);
+
+		bool await_ready() const noexcept { return this->early; }
+		void await_suspend(std::coroutine_handle<> handle);
+		Status await_resume() const noexcept { return this->waiter.status; }
+
+	private:
+		Reactor& reactor;
+		Waiter waiter;
+		bool early; // cancelled or expired before suspending
+	};
+
+	Reactor();
+	~Reactor(); // coroutines still suspended are destroyed, their Cancellations mustn't be used anymore
+
+	bool valid() const;
+
+	// starts the coroutine right away, it runs until its first suspension
+	void spawn(Task<void> task);
+	// until every spawned coroutine finished or stop() was called
+	void run();
+	void stop() { this->stopping = true; }
+
+	Awaiter readable(const Socket& socket, Deadline deadline = NO_DEADLINE, Cancellation* cancellation = NULL);
+	Awaiter writable(const Socket& socket, Deadline deadline = NO_DEADLINE, Cancellation* cancellation = NULL);
+	Awaiter sleep(Deadline until, Cancellation* cancellation = NULL);
+
+	size_t get_tasks() const { return this->tasks; }
+
+private:
+
+	friend class Cancellation;
+
+	// the coroutine frame a spawned task runs in, it frees itself once done
+	struct Root;
+
+	// per socket, one reader and one writer at a time
+	struct Interest
+	{
+		Waiter* reader;
+		Waiter* writer;
+		bool registered;
+	};
+
+	size_t tasks;
+	bool stopping;
+	std::set<void*> roots; // frames of spawned coroutines
+
+	std::deque<std::coroutine_handle<> > ready;
+	std::map<Socket::socket_t, Interest> interests;
+	std::multimap<Deadline, Waiter*> timers;
+
+#ifdef __linux__
+	int epoll;
+#endif
+
+	static Root run_root(Task<void> task, Reactor& reactor);
+
+	void suspend(Waiter& waiter);
+	void wake(Waiter& waiter, Status status);
+	void update(Socket::socket_t socket, Interest& interest);
+	// milliseconds < 0 waits until a socket is ready
+	void poll(int milliseconds);
+	void expire();
+};
+
+// A non-blocking Socket driven by a Reactor, every operation takes a deadline and a cancellation
+// The result of the last operation (READY, TIMED_OUT...) is kept in get_status().
+// TLS layers aren't supported, their reads don't map onto socket readiness.
+class AsyncSocket
+{
+public:
+
+	AsyncSocket(Reactor& reactor, Socket socket);
+
+	Socket& get() { return this->socket; }
+	Reactor::Status get_status() const { return this->status; }
+
+	// bytes read, 0 on EOF, < 0 on error, timeout or cancellation
+	Task<int> recv(char* buf, size_t size, Deadline deadline = NO_DEADLINE, Cancellation* cancellation = NULL);
+	// bytes sent, less than size if it gave up
+	Task<size_t> send(const char* buf, size_t size, Deadline deadline = NO_DEADLINE, Cancellation* cancellation = NULL);
+	// the accepted socket is blocking, wrap it in an AsyncSocket of its own
+	Task<Socket> accept(SocketAddress* addr = NULL, Deadline deadline = NO_DEADLINE, Cancellation* cancellation = NULL);
+	Task<Socket::ConnectStatus> connect(SocketAddress addr, Deadline deadline = NO_DEADLINE, Cancellation* cancellation = NULL);
+
+	void close() { this->socket.close(); }
+
+private:
+
+	Reactor& reactor;
+	Socket socket;
+	Reactor::Status status;
+};
+
+#endif
+
+#endif
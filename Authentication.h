@@ -14,6 +14,8 @@ public:
 
 	bool operator==(const Authentication& other) const;
 
+	const std::string& get_name() const { return this->name; }
+
 private:
 
 	std::string name;
@@ -0,0 +1,294 @@
+#include "Backend.h"
+
+#include <cmath>
+#include <algorithm>
+#include <boost/thread/locks.hpp>
+#include "Clock.h"
+#include "Stats.h"
+
+const double BackendPool::LOAD_FACTOR = 1.25;
+const double BackendPool::DECAY_TIME = 10000000.0; // 10s
+const double BackendPool::OUTLIER_FACTOR = 3.0;
+const double BackendPool::RTT_WEIGHT = 0.25;
+const double BackendPool::AVERAGE_WEIGHT = 0.05;
+
+Backend::Backend(const std::string& address, BackendPool* pool) :
+	inflight(0), failures(0), ejections(0), ejected_until(0)
+{
+	this->address = address;
+	this->pool = pool;
+	this->latency = 0.0;
+	this->average = 0.0;
+	this->updated = Clock::now();
+	this->samples = 0;
+	this->rtt = 0.0;
+}
+
+void Backend::acquire()
+{
+	this->inflight.fetch_add(1, boost::memory_order_relaxed);
+	this->pool->inflight.fetch_add(1, boost::memory_order_relaxed);
+}
+
+void Backend::release()
+{
+	this->inflight.fetch_sub(1, boost::memory_order_relaxed);
+	this->pool->inflight.fetch_sub(1, boost::memory_order_relaxed);
+}
+
+void Backend::report_success(boost::uint64_t sample)
+{
+	const boost::uint64_t now = Clock::now();
+
+	this->failures.store(0, boost::memory_order_relaxed);
+
+	double average;
+	unsigned int samples;
+	{
+		boost::unique_lock<boost::mutex> lock(this->latency_guard);
+
+		// peak EWMA: jump up to slow samples at once, decay by time elapsed otherwise
+		if(sample > this->latency)
+		{
+			this->latency = (double)sample;
+		}
+		else
+		{
+			const double weight = std::exp(-(double)(now - this->updated) / BackendPool::DECAY_TIME);
+			this->latency = this->latency * weight + sample * (1.0 - weight);
+		}
+		this->updated = now;
+		this->samples++;
+
+		// the peak follows a single slow sample, outliers are judged by the average
+		// a plain mean until the EWMA takes over, so a slow first sample doesn't linger
+		const double weight = std::max(1.0 / this->samples, BackendPool::AVERAGE_WEIGHT);
+		this->average = this->average * (1.0 - weight) + sample * weight;
+
+		average = this->average;
+		samples = this->samples;
+	}
+
+	const double pool_latency = this->pool->observe((double)sample);
+
+	if(samples >= BackendPool::MIN_SAMPLES && average > pool_latency * BackendPool::OUTLIER_FACTOR)
+	{
+		this->eject(now);
+	}
+	else if(!this->ejected(now))
+	{
+		this->ejections.store(0, boost::memory_order_relaxed);
+	}
+}
+
+void Backend::report_failure()
+{
+	if(this->failures.fetch_add(1, boost::memory_order_relaxed) + 1 >= BackendPool::MAX_FAILURES)
+	{
+		this->eject(Clock::now());
+	}
+}
+
+void Backend::report_rtt(boost::uint32_t sample)
+{
+	boost::unique_lock<boost::mutex> lock(this->latency_guard);
+
+	this->rtt = this->rtt > 0.0 ? this->rtt * (1.0 - BackendPool::RTT_WEIGHT) + sample * BackendPool::RTT_WEIGHT : (double)sample;
+}
+
+double Backend::get_latency(boost::uint64_t now)
+{
+	boost::unique_lock<boost::mutex> lock(this->latency_guard);
+
+	// without new samples the peak fades out, so a recovered backend gets another chance,
+	// but no response can be faster than the network round trip
+	const double weight = std::exp(-(double)(now - this->updated) / BackendPool::DECAY_TIME);
+	const double latency = this->latency * weight;
+	return latency > this->rtt ? latency : this->rtt;
+}
+
+double Backend::get_cost(boost::uint64_t now)
+{
+	return (this->get_latency(now) + 1.0) * (this->get_inflight() + 1);
+}
+
+bool Backend::readmit(boost::uint64_t now)
+{
+	boost::uint64_t until = this->ejected_until.load(boost::memory_order_relaxed);
+	return until != 0 && until <= now && this->ejected_until.compare_exchange_strong(until, 0);
+}
+
+void Backend::eject(boost::uint64_t now)
+{
+	if(this->ejected(now))
+		return;
+
+	// never eject more than half the pool, a struggling pool is better than no pool
+	const size_t size = this->pool->get_members()->backends.size();
+	if((size_t)(this->pool->ejected.load(boost::memory_order_relaxed) + 1) * 2 > size)
+		return;
+
+	unsigned int shift = this->ejections.fetch_add(1, boost::memory_order_relaxed);
+	if(shift > BackendPool::MAX_EJECTION_SHIFT)
+		shift = BackendPool::MAX_EJECTION_SHIFT;
+
+	// +-50% jitter, so ejected backends don't all come back at once
+	const boost::uint64_t base = BackendPool::EJECTION_TIME << shift;
+	const boost::uint64_t duration = base / 2 + BackendPool::random() % base;
+
+	this->ejected_until.store(now + duration, boost::memory_order_relaxed);
+	this->failures.store(0, boost::memory_order_relaxed);
+
+	this->pool->ejected.fetch_add(1, boost::memory_order_relaxed);
+	Stats::increment(Stats::BACKEND_EJECTIONS);
+}
+
+BackendPool::BackendPool(const std::string& name, Policy policy) : inflight(0), ejected(0)
+{
+	this->name = name;
+	this->policy = policy;
+	this->members.reset(new Members(std::vector<std::string>()));
+	this->latency = 0.0;
+}
+
+void BackendPool::set_backends(const std::vector<std::string>& addresses)
+{
+	boost::shared_ptr<const Members> old_members = this->get_members();
+
+	// building the table takes a while, do it before taking the lock again
+	boost::shared_ptr<Members> new_members(new Members(addresses));
+	for(size_t i = 0; i < addresses.size(); i++)
+	{
+		BackendPtr backend;
+		for(size_t j = 0; j < old_members->backends.size(); j++)
+		{
+			if(old_members->backends[j]->get_address() == addresses[i])
+			{
+				backend = old_members->backends[j];
+				break;
+			}
+		}
+
+		if(!backend)
+		{
+			backend.reset(new Backend(addresses[i], this));
+		}
+		new_members->backends.push_back(backend);
+	}
+
+	boost::unique_lock<boost::mutex> lock(this->members_guard);
+	this->members = new_members;
+
+	// removed backends take their ejections with them
+	const boost::uint64_t now = Clock::now();
+	int ejected = 0;
+	for(size_t i = 0; i < new_members->backends.size(); i++)
+	{
+		if(new_members->backends[i]->ejected(now))
+			ejected++;
+	}
+	this->ejected.store(ejected, boost::memory_order_relaxed);
+}
+
+BackendPtr BackendPool::select(const std::string& key, const BackendPtr& exclude) const
+{
+	boost::shared_ptr<const Members> current = this->get_members();
+
+	if(current->backends.empty())
+		return BackendPtr();
+
+	const boost::uint64_t now = Clock::now();
+
+	// re-admit backends whose ejection ran out
+	for(size_t i = 0; i < current->backends.size() && this->ejected.load(boost::memory_order_relaxed) > 0; i++)
+	{
+		if(current->backends[i]->readmit(now))
+		{
+			this->ejected.fetch_sub(1, boost::memory_order_relaxed);
+		}
+	}
+
+	switch(this->policy)
+	{
+		case PEAK_EWMA:
+			return this->select_p2c(*current, exclude, now);
+		case CONSISTENT_HASH:
+		default:
+			return this->select_hashed(*current, key, exclude, now);
+	}
+}
+
+BackendPtr BackendPool::select_hashed(const Members& current, const std::string& key, const BackendPtr& exclude, boost::uint64_t now) const
+{
+	const boost::uint64_t hash = Maglev::hash(key);
+
+	// bounded load: skip backends already carrying more than their share
+	const double average = (this->inflight.load(boost::memory_order_relaxed) + 1) / (double)current.backends.size();
+	const int bound = (int)std::ceil(average * LOAD_FACTOR);
+
+	for(size_t probe = 0; probe < MAX_PROBES; probe++)
+	{
+		const BackendPtr& backend = current.backends[current.table.lookup(hash, probe)];
+		if(backend != exclude && !backend->ejected(now) && backend->get_inflight() < bound)
+			return backend;
+	}
+
+	// everybody is busy, stick with the hash
+	return current.backends[current.table.lookup(hash)];
+}
+
+BackendPtr BackendPool::select_p2c(const Members& current, const BackendPtr& exclude, boost::uint64_t now) const
+{
+	const size_t size = current.backends.size();
+	if(size == 1)
+		return current.backends[0];
+
+	// two distinct random candidates, ejected or excluded ones get rerolled a few times
+	BackendPtr candidates[2];
+	for(int c = 0; c < 2; c++)
+	{
+		for(int attempt = 0; attempt < 4; attempt++)
+		{
+			const BackendPtr& backend = current.backends[(size_t)(random() % size)];
+			if(c == 1 && backend == candidates[0])
+				continue;
+
+			candidates[c] = backend;
+			if(backend != exclude && !backend->ejected(now))
+				break;
+		}
+	}
+
+	if(!candidates[1] || candidates[1] == candidates[0] || candidates[1] == exclude)
+		return candidates[0];
+	if(candidates[0] == exclude)
+		return candidates[1];
+
+	return candidates[0]->get_cost(now) <= candidates[1]->get_cost(now) ? candidates[0] : candidates[1];
+}
+
+boost::shared_ptr<const BackendPool::Members> BackendPool::get_members() const
+{
+	boost::unique_lock<boost::mutex> lock(this->members_guard);
+	return this->members;
+}
+
+double BackendPool::observe(double sample)
+{
+	boost::unique_lock<boost::mutex> lock(this->latency_guard);
+
+	// plain EWMA, slow enough that a single outlier can't drag it along
+	this->latency = this->latency > 0.0 ? this->latency * (1.0 - AVERAGE_WEIGHT) + sample * AVERAGE_WEIGHT : sample;
+	return this->latency;
+}
+
+boost::uint64_t BackendPool::random()
+{
+	// splitmix64 over a shared counter
+	static boost::atomic<boost::uint64_t> state(0x9e3779b97f4a7c15ULL);
+
+	boost::uint64_t z = state.fetch_add(0x9e3779b97f4a7c15ULL, boost::memory_order_relaxed);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
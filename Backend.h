@@ -0,0 +1,144 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include "Maglev.h"
+
+class BackendPool;
+
+// One upstream server of a pool, in "host:port" form
+class Backend
+{
+public:
+
+	Backend(const std::string& address, BackendPool* pool);
+
+	const std::string& get_address() const { return this->address; }
+	int get_inflight() const { return this->inflight.load(boost::memory_order_relaxed); }
+
+	// a request is on its way to / being answered by this backend
+	void acquire();
+	void release();
+
+	// outcome of a request, latency is from sending the request to the response header (microseconds)
+	void report_success(boost::uint64_t latency);
+	void report_failure();
+	// smoothed TCP round trip time of a connection to this backend (microseconds)
+	void report_rtt(boost::uint32_t rtt);
+
+	// peak EWMA latency (microseconds) at time now, never below the network round trip
+	double get_latency(boost::uint64_t now);
+	// expected cost of another request, latency weighted by the requests already waiting
+	double get_cost(boost::uint64_t now);
+
+	bool ejected(boost::uint64_t now) const { return now < this->ejected_until.load(boost::memory_order_relaxed); }
+	// true if the backend's ejection ran out just now
+	bool readmit(boost::uint64_t now);
+
+private:
+
+	std::string address;
+	BackendPool* pool;
+
+	boost::atomic<int> inflight;
+
+	boost::mutex latency_guard;
+	double latency;             // peak EWMA, microseconds
+	double average;             // plain EWMA like the pool's, microseconds, for outlier detection
+	boost::uint64_t updated;    // time of the last latency sample
+	unsigned int samples;
+	double rtt;                 // EWMA of the kernel's RTT, microseconds
+
+	boost::atomic<unsigned int> failures; // consecutive
+	boost::atomic<unsigned int> ejections; // consecutive, backs off re-admission
+	boost::atomic<boost::uint64_t> ejected_until;
+
+	void eject(boost::uint64_t now);
+};
+
+typedef boost::shared_ptr<Backend> BackendPtr;
+
+// Backends behind a route. Requests are spread either with a bounded-load
+// Maglev hash, so each URL keeps going to the same backend (and its cache)
+// unless that one is much busier than the rest, or to the cheaper of two
+// random backends by peak EWMA latency and load.
+// Backends failing repeatedly or turning into latency outliers are ejected
+// for a jittered, growing while either way.
+class BackendPool
+{
+friend class Backend;
+public:
+
+	enum Policy
+	{
+		CONSISTENT_HASH,
+		PEAK_EWMA
+	};
+
+	static const double LOAD_FACTOR; // max. in-flight requests per backend relative to the average
+	static const size_t MAX_PROBES = 32U;
+
+	static const double DECAY_TIME;            // EWMA time constant, microseconds
+	static const unsigned int MAX_FAILURES = 5U; // consecutive, before ejection
+	static const double OUTLIER_FACTOR;        // ejected if the average latency exceeds the pool's by that much
+	static const double AVERAGE_WEIGHT;        // of a new sample in the plain latency EWMAs
+	static const double RTT_WEIGHT;            // of a new sample in the RTT EWMA
+	static const unsigned int MIN_SAMPLES = 10U; // before a backend can be an outlier
+	static const boost::uint64_t EJECTION_TIME = 10000000ULL; // microseconds, doubled for every consecutive ejection
+	static const unsigned int MAX_EJECTION_SHIFT = 5U;
+
+	BackendPool(const std::string& name, Policy policy = CONSISTENT_HASH);
+
+	const std::string& get_name() const { return this->name; }
+
+	// replaces the members, backends staying in the pool keep their state
+	void set_backends(const std::vector<std::string>& addresses);
+
+	// NULL if the pool is empty, exclude is only picked if there is nothing else
+	BackendPtr select(const std::string& key, const BackendPtr& exclude = BackendPtr()) const;
+
+	// random number for picking candidates and jitter, safe to call from any thread
+	static boost::uint64_t random();
+
+private:
+
+	// swapped as a whole on membership changes, readers keep the old one alive
+	struct Members
+	{
+		Members(const std::vector<std::string>& addresses) : table(addresses) { }
+
+		std::vector<BackendPtr> backends;
+		Maglev table;
+	};
+
+	std::string name;
+	Policy policy;
+
+	boost::shared_ptr<const Members> members;
+	mutable boost::mutex members_guard;
+
+	boost::atomic<int> inflight;
+	mutable boost::atomic<int> ejected; // backends currently ejected, at most half the pool
+
+	boost::mutex latency_guard;
+	double latency; // EWMA over all backends, microseconds
+
+	boost::shared_ptr<const Members> get_members() const;
+
+	BackendPtr select_hashed(const Members& current, const std::string& key, const BackendPtr& exclude, boost::uint64_t now) const;
+	BackendPtr select_p2c(const Members& current, const BackendPtr& exclude, boost::uint64_t now) const;
+
+	// pool wide latency, updated by every sample
+	double observe(double sample);
+};
+
+typedef boost::shared_ptr<BackendPool> BackendPoolPtr;
+
+#endif
@@ -0,0 +1,273 @@
+#include "Cache.h"
+
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include <boost/thread/locks.hpp>
+#include "Memory.h"
+#include "SharedCache.h"
+
+namespace
+{
+	bool equal_nocase(char a, char b)
+	{
+		return std::tolower((unsigned char)a) == std::tolower((unsigned char)b);
+	}
+
+	long at_least(long value, long minimum)
+	{
+		return value > minimum ? value : minimum;
+	}
+}
+
+Cache::Cache(size_t capacity, long grace)
+{
+	this->capacity = capacity;
+	this->size = 0;
+	this->grace = grace;
+}
+
+Cache::~Cache()
+{
+	Memory::release(Memory::CACHE, this->size);
+}
+
+Cache::EntryPtr Cache::lookup(const std::string& key)
+{
+	if(this->shared)
+		return this->shared->lookup(key);
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	SlotMap::iterator it = this->slots.find(key);
+	if(it == this->slots.end())
+		return EntryPtr();
+
+	this->lru.splice(this->lru.begin(), this->lru, it->second.lru);
+	return it->second.entry;
+}
+
+void Cache::store(const std::string& key, const EntryPtr& entry)
+{
+	if(this->shared)
+	{
+		this->shared->store(key, *entry);
+		return;
+	}
+
+	if(entry->size() > this->capacity)
+		return;
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	SlotMap::iterator it = this->slots.find(key);
+	if(it != this->slots.end())
+	{
+		this->erase(it);
+	}
+
+	while(this->size + entry->size() > this->capacity && !this->lru.empty())
+	{
+		this->erase(this->slots.find(this->lru.back()));
+	}
+
+	this->lru.push_front(key);
+
+	Slot& slot = this->slots[key];
+	slot.entry = entry;
+	slot.lru = this->lru.begin();
+	this->size += entry->size();
+	Memory::add(Memory::CACHE, entry->size());
+}
+
+void Cache::remove(const std::string& key)
+{
+	if(this->shared)
+	{
+		this->shared->remove(key);
+		return;
+	}
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	SlotMap::iterator it = this->slots.find(key);
+	if(it != this->slots.end())
+	{
+		this->erase(it);
+	}
+}
+
+size_t Cache::max_entry() const
+{
+	return this->shared ? this->shared->max_entry() : this->capacity;
+}
+
+size_t Cache::shrink(size_t bytes)
+{
+	// the segment is mapped once and for all, evicting from it frees nothing
+	if(this->shared)
+		return 0;
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	const size_t before = this->size;
+	while(before - this->size < bytes && !this->lru.empty())
+	{
+		this->erase(this->slots.find(this->lru.back()));
+	}
+	return before - this->size;
+}
+
+bool Cache::share()
+{
+	boost::scoped_ptr<SharedCache> segment(new SharedCache);
+	if(!segment->create(this->capacity))
+		return false;
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	// the segment is sized by the capacity and can't shrink, it's not the budget's to count
+	Memory::release(Memory::CACHE, this->size);
+
+	this->slots.clear();
+	this->lru.clear();
+	this->size = 0;
+	this->shared.swap(segment);
+	return true;
+}
+
+Cache::Freshness Cache::freshness(const Entry& entry, time_t now) const
+{
+	long age = (long)(now - entry.stored);
+
+	if(age <= entry.max_age)
+		return FRESH;
+
+	// the grace would undo must-revalidate
+	const long grace = entry.must_revalidate ? 0 : this->grace;
+
+	if(age <= entry.max_age + at_least(entry.stale_while_revalidate, grace))
+		return STALE;
+
+	if(age <= entry.max_age + at_least(entry.stale_if_error, grace))
+		return STALE_IF_ERROR;
+
+	return EXPIRED;
+}
+
+bool Cache::begin_refresh(const std::string& key)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return this->refreshing.insert(key).second;
+}
+
+void Cache::end_refresh(const std::string& key)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	this->refreshing.erase(key);
+}
+
+bool Cache::lifetime(const http::Response& response, long& max_age, long& stale_while_revalidate, long& stale_if_error, bool& must_revalidate)
+{
+	must_revalidate = false;
+
+	if(!response.has_header("Cache-Control"))
+		return false; // no heuristic freshness
+
+	const std::string cache_control = response.header("Cache-Control");
+
+	if(directive(cache_control, "no-cache") >= 0 ||
+	   directive(cache_control, "no-store") >= 0 ||
+	   directive(cache_control, "private")  >= 0)
+	{
+		return false;
+	}
+
+	// we're a shared cache, s-maxage takes precedence
+	max_age = directive(cache_control, "s-maxage");
+	if(max_age < 0)
+		max_age = directive(cache_control, "max-age");
+	if(max_age <= 0)
+		return false;
+
+	stale_while_revalidate = at_least(directive(cache_control, "stale-while-revalidate"), 0);
+	stale_if_error         = at_least(directive(cache_control, "stale-if-error"), 0);
+
+	// must-revalidate forbids serving stale copies
+	if(directive(cache_control, "must-revalidate")  >= 0 ||
+	   directive(cache_control, "proxy-revalidate") >= 0)
+	{
+		must_revalidate = true;
+		stale_while_revalidate = 0;
+		stale_if_error = 0;
+	}
+
+	return true;
+}
+
+long Cache::received_age(const http::Response& response)
+{
+	if(!response.has_header("Age"))
+		return 0;
+	return at_least(std::atol(response.header("Age").c_str()), 0);
+}
+
+bool Cache::refuses(const http::Request& request, long age)
+{
+	// a reload, the client wants to hear it from the origin
+	if(request.has_header("Pragma") && directive(request.header("Pragma"), "no-cache") >= 0)
+		return true;
+
+	if(!request.has_header("Cache-Control"))
+		return false;
+
+	const std::string cache_control = request.header("Cache-Control");
+	if(directive(cache_control, "no-cache") >= 0)
+		return true;
+
+	const long max_age = directive(cache_control, "max-age");
+	return max_age >= 0 && age > max_age;
+}
+
+long Cache::directive(const std::string& cache_control, const std::string& name)
+{
+	size_t pos = 0;
+	while(pos < cache_control.size())
+	{
+		size_t end = cache_control.find(',', pos);
+		if(end == std::string::npos)
+			end = cache_control.size();
+
+		// trim
+		size_t first = cache_control.find_first_not_of(" \t", pos);
+		size_t last = cache_control.find_last_not_of(" \t", end - 1);
+		if(first < end && last != std::string::npos && last >= first)
+		{
+			std::string token = cache_control.substr(first, last - first + 1);
+			size_t equals = token.find('=');
+			std::string token_name = token.substr(0, equals);
+
+			if(token_name.size() == name.size() && std::equal(name.begin(), name.end(), token_name.begin(), equal_nocase))
+			{
+				if(equals == std::string::npos)
+					return 0;
+				std::string value = token.substr(equals + 1);
+				if(!value.empty() && value[0] == '"')
+					value = value.substr(1);
+				return std::atol(value.c_str());
+			}
+		}
+
+		pos = end + 1;
+	}
+
+	return -1;
+}
+
+void Cache::erase(SlotMap::iterator it)
+{
+	this->size -= it->second.entry->size();
+	Memory::release(Memory::CACHE, it->second.entry->size());
+	this->lru.erase(it->second.lru);
+	this->slots.erase(it);
+}
@@ -0,0 +1,110 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <ctime>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <http.hpp>
+
+class SharedCache;
+
+// In-memory response cache, least recently used entries are evicted first
+class Cache
+{
+public:
+
+	struct Entry
+	{
+		std::string request;  // request header, sent again to refresh the entry
+		std::string host;
+		std::string response; // header and body as received from the origin
+
+		time_t stored; // less the Age it arrived with, so it's aged from when the origin made it
+		long max_age;                // seconds
+		long stale_while_revalidate; // seconds past max_age
+		long stale_if_error;         // seconds past max_age
+		bool must_revalidate;        // never stale, not even within the grace
+
+		size_t size() const { return this->request.size() + this->host.size() + this->response.size(); }
+	};
+
+	typedef boost::shared_ptr<const Entry> EntryPtr;
+
+	enum Freshness
+	{
+		FRESH,          // serve
+		STALE,          // serve, refresh in the background
+		STALE_IF_ERROR, // fetch, serve only if the origin fails
+		EXPIRED         // fetch
+	};
+
+	// grace is the minimum stale-while-revalidate and stale-if-error window, in seconds
+	Cache(size_t capacity, long grace = 0);
+	~Cache();
+
+	EntryPtr lookup(const std::string& key);
+	void store(const std::string& key, const EntryPtr& entry);
+	void remove(const std::string& key);
+	// bytes, larger entries aren't stored
+	size_t max_entry() const;
+	// evicts least recently used entries until at least bytes are freed (or nothing is left), returns the bytes freed
+	size_t shrink(size_t bytes);
+
+	// moves the entries into a SharedCache of the same capacity, for processes forked later
+	// what's stored so far is dropped, false (and nothing changes) where that isn't possible
+	bool share();
+	bool is_shared() const { return this->shared.get() != NULL; }
+
+	Freshness freshness(const Entry& entry, time_t now) const;
+
+	// at most one background refresh per key, begin_refresh returns false if one is running
+	bool begin_refresh(const std::string& key);
+	void end_refresh(const std::string& key);
+
+	// explicit freshness lifetime from Cache-Control, false if the response must not be stored
+	static bool lifetime(const http::Response& response, long& max_age, long& stale_while_revalidate, long& stale_if_error, bool& must_revalidate);
+
+	// seconds the response spent in caches upstream (its Age header), 0 if it didn't say
+	static long received_age(const http::Response& response);
+
+	// true if the request's Cache-Control (or Pragma) won't take a stored response older than age seconds
+	static bool refuses(const http::Request& request, long age);
+
+	// seconds value of a Cache-Control directive, -1 if absent
+	static long directive(const std::string& cache_control, const std::string& name);
+
+private:
+
+	typedef std::list<std::string> LruList;
+
+	struct Slot
+	{
+		EntryPtr entry;
+		LruList::iterator lru;
+	};
+
+	typedef std::map<std::string, Slot> SlotMap;
+
+	size_t capacity;
+	size_t size;
+	long grace;
+
+	SlotMap slots;
+	LruList lru; // most recently used first
+	std::set<std::string> refreshing; // per process, even when shared
+
+	boost::scoped_ptr<SharedCache> shared; // takes over from slots and lru once set
+
+	boost::mutex guard;
+
+	void erase(SlotMap::iterator it);
+};
+
+#endif
@@ -0,0 +1,217 @@
+#include "CircuitBreaker.h"
+
+#include <boost/thread/locks.hpp>
+#include "Clock.h"
+#include "Stats.h"
+
+const double CircuitBreaker::FAILURE_RATE = 0.5;
+
+CircuitBreaker::Origin::Origin()
+{
+	this->state = CLOSED;
+	this->window_start = Clock::now();
+	this->successes = this->failures = 0;
+	this->previous_successes = this->previous_failures = 0;
+	this->open_until = 0;
+	this->opened = 0;
+	this->probe_started = 0;
+	this->probing = false;
+	this->negative_until = 0;
+	this->last_failure = NONE;
+}
+
+bool CircuitBreaker::allow(const std::string& origin, Failure& reason)
+{
+	if(this->tracked.load(boost::memory_order_relaxed) == 0)
+		return true;
+
+	const boost::uint64_t now = Clock::now();
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	OriginMap::iterator it = this->origins.find(origin);
+	if(it == this->origins.end())
+		return true;
+
+	Origin& state = it->second;
+	reason = state.last_failure;
+
+	if(now < state.negative_until)
+	{
+		Stats::increment(Stats::NEGATIVE_CACHE_HITS);
+		return false;
+	}
+
+	switch(state.state)
+	{
+		case CLOSED:
+			return true;
+
+		case OPEN:
+			if(now < state.open_until)
+				break;
+			state.state = HALF_OPEN;
+			state.probing = false;
+			// fall through
+
+		case HALF_OPEN:
+			if(!state.probing || now - state.probe_started > PROBE_TIMEOUT)
+			{
+				state.probing = true;
+				state.probe_started = now;
+				return true;
+			}
+			break;
+	}
+
+	Stats::increment(Stats::BREAKER_REJECTS);
+	return false;
+}
+
+void CircuitBreaker::report_success(const std::string& origin)
+{
+	if(this->tracked.load(boost::memory_order_relaxed) == 0)
+		return;
+
+	const boost::uint64_t now = Clock::now();
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	OriginMap::iterator it = this->origins.find(origin);
+	if(it == this->origins.end())
+		return; // never failed, nothing to track
+
+	Origin& state = it->second;
+	advance(state, now);
+	state.successes++;
+	state.negative_until = 0;
+
+	if(state.state == HALF_OPEN)
+	{
+		// probe went through, start over
+		state.state = CLOSED;
+		state.probing = false;
+		state.opened = 0;
+		state.successes = state.failures = 0;
+		state.previous_successes = state.previous_failures = 0;
+		state.last_failure = NONE;
+	}
+}
+
+void CircuitBreaker::report_failure(const std::string& origin, Failure failure)
+{
+	const boost::uint64_t now = Clock::now();
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	if(this->origins.size() >= MAX_ORIGINS && this->origins.find(origin) == this->origins.end())
+	{
+		this->prune(now);
+	}
+
+	Origin& state = this->origins[origin];
+	this->tracked.store(this->origins.size(), boost::memory_order_relaxed);
+
+	advance(state, now);
+	state.failures++;
+	state.last_failure = failure;
+
+	// the name won't resolve or nobody listens, don't try again for a bit
+	if(failure == RESOLVE || failure == REFUSED)
+	{
+		state.negative_until = now + NEGATIVE_TTL;
+	}
+
+	if(state.state == HALF_OPEN)
+	{
+		this->open(state, now);
+		return;
+	}
+
+	if(state.state == CLOSED)
+	{
+		double requests = 0.0;
+		double rate = failure_rate(state, now, requests);
+		if(requests >= MIN_REQUESTS && rate >= FAILURE_RATE)
+		{
+			this->open(state, now);
+		}
+	}
+}
+
+CircuitBreaker::State CircuitBreaker::get_state(const std::string& origin)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	OriginMap::iterator it = this->origins.find(origin);
+	return it != this->origins.end() ? it->second.state : CLOSED;
+}
+
+void CircuitBreaker::advance(Origin& origin, boost::uint64_t now)
+{
+	const boost::uint64_t elapsed = now - origin.window_start;
+	if(elapsed < WINDOW)
+		return;
+
+	if(elapsed < 2 * WINDOW)
+	{
+		origin.previous_successes = origin.successes;
+		origin.previous_failures = origin.failures;
+		origin.window_start += WINDOW;
+	}
+	else
+	{
+		origin.previous_successes = origin.previous_failures = 0;
+		origin.window_start = now;
+	}
+	origin.successes = origin.failures = 0;
+}
+
+double CircuitBreaker::failure_rate(const Origin& origin, boost::uint64_t now, double& requests)
+{
+	const double overlap = 1.0 - (double)(now - origin.window_start) / WINDOW;
+
+	const double failures = origin.failures + origin.previous_failures * overlap;
+	requests = failures + origin.successes + origin.previous_successes * overlap;
+
+	return requests > 0.0 ? failures / requests : 0.0;
+}
+
+void CircuitBreaker::open(Origin& origin, boost::uint64_t now)
+{
+	unsigned int shift = origin.opened < MAX_OPEN_SHIFT ? origin.opened : MAX_OPEN_SHIFT;
+
+	origin.state = OPEN;
+	origin.open_until = now + (OPEN_TIME << shift);
+	origin.opened++;
+	origin.probing = false;
+
+	Stats::increment(Stats::BREAKER_OPENS);
+}
+
+void CircuitBreaker::prune(boost::uint64_t now)
+{
+	for(OriginMap::iterator it = this->origins.begin(); it != this->origins.end();)
+	{
+		Origin& origin = it->second;
+
+		// failures older than the window are rolled out, closed origins without any are healthy
+		bool idle = false;
+		if(origin.state == CLOSED)
+		{
+			advance(origin, now);
+			idle = origin.failures == 0 && origin.previous_failures == 0 && now >= origin.negative_until;
+		}
+		else
+		{
+			// nobody asked since the open time ran out, no probe is on its way either
+			idle = now >= origin.open_until + WINDOW && (!origin.probing || now - origin.probe_started > PROBE_TIMEOUT + WINDOW);
+		}
+
+		if(idle)
+			this->origins.erase(it++);
+		else
+			++it;
+	}
+	this->tracked.store(this->origins.size(), boost::memory_order_relaxed);
+}
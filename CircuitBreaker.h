@@ -0,0 +1,95 @@
+#ifndef CIRCUITBREAKER_H
+#define CIRCUITBREAKER_H
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Per origin circuit breaker with a negative cache for resolution and connect failures
+//
+// closed:    requests pass, failures are counted over a sliding window
+// open:      too many of them failed, requests are rejected right away
+// half-open: the open time ran out, a single probe request may pass
+//            and decides whether we close again or stay open (for longer)
+class CircuitBreaker
+{
+public:
+
+	enum State
+	{
+		CLOSED,
+		OPEN,
+		HALF_OPEN
+	};
+
+	enum Failure
+	{
+		NONE,
+		RESOLVE, // DNS lookup failed
+		REFUSED, // connect failed
+		TIMEOUT, // connect or response timed out
+		HANDSHAKE, // TLS handshake or certificate verification failed
+		RESPONSE // broken response or 5xx
+	};
+
+	static const boost::uint64_t WINDOW = 10000000ULL;         // failure rate window, microseconds
+	static const unsigned int MIN_REQUESTS = 10U;              // in the window before we may open
+	static const double FAILURE_RATE;                          // open at or above
+	static const boost::uint64_t OPEN_TIME = 5000000ULL;       // doubled for every failed probe
+	static const unsigned int MAX_OPEN_SHIFT = 4U;
+	static const boost::uint64_t PROBE_TIMEOUT = 10000000ULL;  // a probe that never reports is given up
+	static const boost::uint64_t NEGATIVE_TTL = 3000000ULL;    // resolve and connect failures are remembered this long
+	static const size_t MAX_ORIGINS = 10000U;                  // healthy and idle origins are forgotten beyond that
+
+	CircuitBreaker() : tracked(0) { }
+
+	// false if the request should fail right away, reason tells why the origin is considered down
+	bool allow(const std::string& origin, Failure& reason);
+
+	void report_success(const std::string& origin);
+	void report_failure(const std::string& origin, Failure failure);
+
+	State get_state(const std::string& origin);
+
+private:
+
+	struct Origin
+	{
+		Origin();
+
+		State state;
+
+		// sliding window, the previous one counts in proportion to its overlap
+		boost::uint64_t window_start;
+		unsigned int successes, failures;
+		unsigned int previous_successes, previous_failures;
+
+		boost::uint64_t open_until;
+		unsigned int opened; // consecutive, backs off the open time
+		boost::uint64_t probe_started;
+		bool probing;
+
+		boost::uint64_t negative_until;
+		Failure last_failure;
+	};
+
+	typedef std::map<std::string, Origin> OriginMap;
+
+	OriginMap origins;
+	boost::mutex guard;
+
+	boost::atomic<size_t> tracked; // origins.size(), lets the common all-healthy case skip the lock
+
+	static void advance(Origin& origin, boost::uint64_t now);
+	static double failure_rate(const Origin& origin, boost::uint64_t now, double& requests);
+
+	void open(Origin& origin, boost::uint64_t now);
+	// forgets origins that are healthy or haven't been heard of for a window
+	void prune(boost::uint64_t now);
+};
+
+#endif
@@ -0,0 +1,27 @@
+#include "Clock.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+boost::uint64_t Clock::now()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	if(frequency.QuadPart == 0)
+	{
+		::QueryPerformanceFrequency(&frequency);
+	}
+
+	LARGE_INTEGER counter;
+	::QueryPerformanceCounter(&counter);
+	return (boost::uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+	       (boost::uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+	timespec ts;
+	::clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (boost::uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
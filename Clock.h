@@ -0,0 +1,16 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#pragma once
+
+#include <boost/cstdint.hpp>
+
+class Clock
+{
+public:
+
+	// monotonic, microseconds since some arbitrary point
+	static boost::uint64_t now();
+};
+
+#endif
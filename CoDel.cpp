@@ -0,0 +1,78 @@
+#include "CoDel.h"
+
+#include <cmath>
+
+CoDel::CoDel(boost::uint64_t target, boost::uint64_t interval)
+{
+	this->target = target;
+	this->interval = interval;
+	this->first_above_time = 0;
+	this->drop_next = 0;
+	this->count = 0;
+	this->last_count = 0;
+	this->is_dropping = false;
+}
+
+bool CoDel::should_drop(boost::uint64_t sojourn, boost::uint64_t now)
+{
+	const bool ok = this->ok_to_drop(sojourn, now);
+
+	if(this->is_dropping)
+	{
+		if(!ok)
+		{
+			// delay is fine again
+			this->is_dropping = false;
+			return false;
+		}
+
+		if(now >= this->drop_next)
+		{
+			this->count++;
+			this->drop_next = this->control_law(this->drop_next);
+			return true;
+		}
+
+		return false;
+	}
+
+	if(ok)
+	{
+		this->is_dropping = true;
+
+		// we were dropping not long ago, pick up close to the rate that was needed then
+		const unsigned int delta = this->count - this->last_count;
+		if(delta > 1 && now - this->drop_next < 16 * this->interval)
+			this->count = delta;
+		else
+			this->count = 1;
+		this->last_count = this->count;
+
+		this->drop_next = this->control_law(now);
+		return true;
+	}
+
+	return false;
+}
+
+bool CoDel::ok_to_drop(boost::uint64_t sojourn, boost::uint64_t now)
+{
+	if(sojourn < this->target)
+	{
+		this->first_above_time = 0;
+		return false;
+	}
+
+	if(this->first_above_time == 0)
+	{
+		this->first_above_time = now + this->interval;
+		return false;
+	}
+
+	return now >= this->first_above_time;
+}
+
+boost::uint64_t CoDel::control_law(boost::uint64_t t) const
+{
+	return t + (boost::uint64_t)(this->interval / std::sqrt((double)this->count));
+}
@@ -0,0 +1,40 @@
+#ifndef CODEL_H
+#define CODEL_H
+
+#pragma once
+
+#include <boost/cstdint.hpp>
+
+// CoDel queue management (Nichols & Jacobson, RFC 8289)
+// Watches how long items waited in the queue rather than how many there are.
+// Once the delay stayed above target for a whole interval, items are dropped
+// at a rate growing with the square root of the drops so far, until the delay
+// falls below target again. Not thread safe, call it under the queue's lock.
+class CoDel
+{
+public:
+
+	// microseconds
+	CoDel(boost::uint64_t target, boost::uint64_t interval);
+
+	// called for every dequeued item, true if it should be dropped
+	bool should_drop(boost::uint64_t sojourn, boost::uint64_t now);
+
+	bool dropping() const { return this->is_dropping; }
+
+private:
+
+	boost::uint64_t target;
+	boost::uint64_t interval;
+
+	boost::uint64_t first_above_time; // when the delay has been above target for an interval, 0 if below
+	boost::uint64_t drop_next;
+	unsigned int count;               // drops in the current dropping state
+	unsigned int last_count;
+	bool is_dropping;
+
+	bool ok_to_drop(boost::uint64_t sojourn, boost::uint64_t now);
+	boost::uint64_t control_law(boost::uint64_t t) const;
+};
+
+#endif
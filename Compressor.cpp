@@ -0,0 +1,171 @@
+#include "Compressor.h"
+
+#include <cstdlib>
+#include <cctype>
+#include <boost/thread/tss.hpp>
+
+namespace
+{
+	std::string trim_lower(const std::string& s)
+	{
+		size_t begin = 0;
+		size_t end = s.size();
+		while(begin < end && std::isspace((unsigned char)s[begin]))
+			begin++;
+		while(end > begin && std::isspace((unsigned char)s[end - 1]))
+			end--;
+
+		std::string result = s.substr(begin, end - begin);
+		for(size_t i = 0; i < result.size(); i++)
+		{
+			result[i] = (char)std::tolower((unsigned char)result[i]);
+		}
+		return result;
+	}
+
+	bool ends_with(const std::string& s, const std::string& suffix)
+	{
+		return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+}
+
+bool Compressor::available()
+{
+#ifdef HAVE_ZLIB
+	return true;
+#else
+	return false;
+#endif
+}
+
+Compressor* Compressor::local()
+{
+#ifdef HAVE_ZLIB
+	static boost::thread_specific_ptr<Compressor> instance;
+	if(!instance.get())
+	{
+		instance.reset(new Compressor);
+	}
+	return instance->ready ? instance.get() : NULL;
+#else
+	return NULL;
+#endif
+}
+
+bool Compressor::accepts(const std::string& accept_encoding)
+{
+	bool wildcard = false;
+
+	size_t pos = 0;
+	while(pos <= accept_encoding.size())
+	{
+		size_t end = accept_encoding.find(',', pos);
+		if(end == std::string::npos)
+			end = accept_encoding.size();
+
+		std::string coding = accept_encoding.substr(pos, end - pos);
+		bool allowed = true;
+
+		size_t params = coding.find(';');
+		if(params != std::string::npos)
+		{
+			std::string q = trim_lower(coding.substr(params + 1));
+			if(q.compare(0, 2, "q=") == 0)
+				allowed = std::atof(q.c_str() + 2) > 0.0;
+			coding = coding.substr(0, params);
+		}
+		coding = trim_lower(coding);
+
+		// an explicit gzip entry overrides the wildcard
+		if(coding == "gzip" || coding == "x-gzip")
+			return allowed;
+		if(coding == "*")
+			wildcard = allowed;
+
+		pos = end + 1;
+	}
+
+	return wildcard;
+}
+
+bool Compressor::compressible(const std::string& content_type)
+{
+	std::string type = content_type.substr(0, content_type.find(';'));
+	type = trim_lower(type);
+
+	return type.compare(0, 5, "text/") == 0 ||
+	       type == "application/json" ||
+	       type == "application/javascript" ||
+	       type == "application/xml" ||
+	       type == "image/svg+xml" ||
+	       ends_with(type, "+json") ||
+	       ends_with(type, "+xml");
+}
+
+Compressor::Compressor()
+{
+	this->ready = false;
+
+#ifdef HAVE_ZLIB
+	this->stream.zalloc = Z_NULL;
+	this->stream.zfree = Z_NULL;
+	this->stream.opaque = Z_NULL;
+
+	// 16 + window bits selects the gzip wrapper
+	this->ready = deflateInit2(&this->stream, LEVEL, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+#endif
+}
+
+Compressor::~Compressor()
+{
+#ifdef HAVE_ZLIB
+	if(this->ready)
+	{
+		deflateEnd(&this->stream);
+	}
+#endif
+}
+
+bool Compressor::begin()
+{
+#ifdef HAVE_ZLIB
+	return this->ready && deflateReset(&this->stream) == Z_OK;
+#else
+	return false;
+#endif
+}
+
+bool Compressor::compress(const char* data, size_t size, std::string& out, Flush flush)
+{
+#ifdef HAVE_ZLIB
+	const int mode = flush == FINISH ? Z_FINISH : (flush == SYNC ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+
+	this->stream.next_in = (Bytef*)data;
+	this->stream.avail_in = (uInt)size;
+
+	char buf[16384];
+	int result;
+	do
+	{
+		this->stream.next_out = (Bytef*)buf;
+		this->stream.avail_out = sizeof(buf);
+
+		result = deflate(&this->stream, mode);
+		if(result == Z_STREAM_ERROR)
+		{
+			return false;
+		}
+
+		out.append(buf, sizeof(buf) - this->stream.avail_out);
+	}
+	while(this->stream.avail_out == 0);
+
+	return this->stream.avail_in == 0 && (flush != FINISH || result == Z_STREAM_END);
+#else
+	(void)data;
+	(void)size;
+	(void)out;
+	(void)flush;
+	return false;
+#endif
+}
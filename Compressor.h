@@ -0,0 +1,54 @@
+#ifndef COMPRESSOR_H
+#define COMPRESSOR_H
+
+#pragma once
+
+#include <string>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Streaming gzip encoder, one reusable instance per thread
+// Only does something when built with HAVE_ZLIB (and linked against zlib).
+class Compressor
+{
+public:
+
+	enum Flush
+	{
+		NONE,   // buffer as the encoder likes
+		SYNC,   // everything so far becomes decodable
+		FINISH  // end of the stream
+	};
+
+	static bool available();
+
+	// this thread's instance, NULL without zlib
+	static Compressor* local();
+
+	// true if the Accept-Encoding value allows gzip
+	static bool accepts(const std::string& accept_encoding);
+	// textual content types worth compressing
+	static bool compressible(const std::string& content_type);
+
+	~Compressor();
+
+	// starts a new stream, keeps the allocated state
+	bool begin();
+	// appends the output to out
+	bool compress(const char* data, size_t size, std::string& out, Flush flush);
+
+private:
+
+	static const int LEVEL = 6;
+
+	Compressor();
+
+#ifdef HAVE_ZLIB
+	z_stream stream;
+#endif
+	bool ready;
+};
+
+#endif
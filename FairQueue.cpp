@@ -0,0 +1,152 @@
+#include "FairQueue.h"
+
+#include <cassert>
+
+FairQueue::FairQueue(boost::uint64_t quantum)
+{
+	this->quantum = quantum;
+	this->capacity = (size_t)-1;
+	this->client_limit = 0;
+	this->queued = 0;
+}
+
+bool FairQueue::push(const Item& item)
+{
+	if(this->queued >= this->capacity)
+	{
+		return false;
+	}
+
+	if(this->clients.size() >= MAX_CLIENTS)
+	{
+		this->forget_debts();
+	}
+
+	Client& client = this->clients[item.client];
+	if(client.queue.empty())
+	{
+		this->backlogged.push_back(item.client);
+	}
+	client.queue.push_back(item);
+	this->queued++;
+
+	return true;
+}
+
+bool FairQueue::pop(Item& item)
+{
+	// make sure the rounds below end
+	bool any = false;
+	for(std::list<std::string>::const_iterator it = this->backlogged.begin(); it != this->backlogged.end() && !any; ++it)
+	{
+		any = this->eligible(this->clients[*it]);
+	}
+
+	if(!any)
+	{
+		return false;
+	}
+
+	while(true)
+	{
+		const std::string key = this->backlogged.front();
+		Client& client = this->clients[key];
+		assert(!client.queue.empty());
+
+		if(!this->eligible(client))
+		{
+			// at its limit, keeps its place in the rotation but doesn't earn credit
+			this->backlogged.splice(this->backlogged.end(), this->backlogged, this->backlogged.begin());
+			continue;
+		}
+
+		if(client.deficit <= 0)
+		{
+			client.deficit += this->quantum;
+			this->backlogged.splice(this->backlogged.end(), this->backlogged, this->backlogged.begin());
+			continue;
+		}
+
+		item = client.queue.front();
+		client.queue.pop_front();
+		client.active++;
+		this->queued--;
+
+		if(client.queue.empty())
+		{
+			// idle clients don't bank credit
+			this->backlogged.pop_front();
+			client.deficit = 0;
+		}
+
+		return true;
+	}
+}
+
+void FairQueue::finish(const std::string& key, boost::uint64_t busy)
+{
+	ClientMap::iterator it = this->clients.find(key);
+	if(it == this->clients.end())
+	{
+		return;
+	}
+
+	Client& client = it->second;
+
+	assert(client.active > 0);
+	client.active--;
+
+	// the debt is paid off in later rounds
+	client.deficit -= (boost::int64_t)busy;
+	const boost::int64_t max_debt = MAX_DEBT_ROUNDS * (boost::int64_t)this->quantum;
+	if(client.deficit < -max_debt)
+	{
+		client.deficit = -max_debt;
+	}
+
+	this->forget_idle(it);
+}
+
+void FairQueue::clear(std::vector<Socket>& sockets)
+{
+	for(ClientMap::iterator it = this->clients.begin(); it != this->clients.end(); ++it)
+	{
+		for(size_t i = 0; i < it->second.queue.size(); i++)
+		{
+			sockets.push_back(it->second.queue[i].socket);
+		}
+		it->second.queue.clear();
+	}
+
+	this->clients.clear();
+	this->backlogged.clear();
+	this->queued = 0;
+}
+
+bool FairQueue::eligible(const Client& client) const
+{
+	return !client.queue.empty() &&
+	       (this->client_limit == 0 || client.active < this->client_limit);
+}
+
+void FairQueue::forget_idle(ClientMap::iterator it)
+{
+	// idle clients are kept around while they are in debt, so opening a new
+	// connection after each long one doesn't wipe the slate clean
+	if(it->second.queue.empty() && it->second.active == 0 && it->second.deficit >= 0)
+	{
+		this->clients.erase(it);
+	}
+}
+
+void FairQueue::forget_debts()
+{
+	ClientMap::iterator it = this->clients.begin();
+	while(it != this->clients.end())
+	{
+		if(it->second.queue.empty() && it->second.active == 0)
+			this->clients.erase(it++);
+		else
+			++it;
+	}
+}
@@ -0,0 +1,81 @@
+#ifndef FAIRQUEUE_H
+#define FAIRQUEUE_H
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include "Socket.h"
+
+// Per-client connection queues served by deficit round robin
+// Clients are charged for the worker time their connections used, so a client
+// holding workers with long transfers gets fewer new connections admitted while
+// others wait, and every backlogged client ends up with a similar share of
+// worker time. Optionally caps the connections one client has in service.
+// Not thread safe, call it under the queue's lock.
+class FairQueue
+{
+public:
+
+	struct Item
+	{
+		Socket socket;
+		boost::uint64_t id;       // connection number, for tracing
+		boost::uint64_t enqueued; // Clock::now()
+		std::string client;
+	};
+
+	// quantum: worker time (microseconds) a client is credited per round
+	explicit FairQueue(boost::uint64_t quantum);
+
+	// max. queued items over all clients
+	void set_capacity(size_t capacity) { this->capacity = capacity; }
+	// max. items per client between pop() and finish(), 0 for no limit
+	void set_client_limit(unsigned int limit) { this->client_limit = limit; }
+
+	// false if the queue is full
+	bool push(const Item& item);
+	// false if nothing is queued or every backlogged client is at its limit
+	bool pop(Item& item);
+	// a popped item is done, busy is the worker time it took
+	void finish(const std::string& client, boost::uint64_t busy);
+
+	// removes everything still queued
+	void clear(std::vector<Socket>& sockets);
+
+	size_t size() const { return this->queued; }
+
+private:
+
+	static const boost::int64_t MAX_DEBT_ROUNDS = 64; // debt beyond that is forgiven
+	static const size_t MAX_CLIENTS = 4096;            // idle debtors are forgotten beyond that
+
+	struct Client
+	{
+		std::deque<Item> queue;
+		boost::int64_t deficit;
+		unsigned int active;
+
+		Client() : deficit(0), active(0) { }
+	};
+
+	typedef std::map<std::string, Client> ClientMap;
+
+	boost::uint64_t quantum;
+	size_t capacity;
+	unsigned int client_limit;
+
+	ClientMap clients;
+	std::list<std::string> backlogged; // clients with queued items, in round robin order
+	size_t queued;
+
+	bool eligible(const Client& client) const;
+	void forget_idle(ClientMap::iterator it);
+	void forget_debts();
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include "Histogram.h"
+
+Histogram::Histogram() : recorded(0)
+{
+	for(size_t i = 0; i < BUCKETS; i++)
+	{
+		this->buckets[i].store(0, boost::memory_order_relaxed);
+	}
+}
+
+void Histogram::record(boost::uint64_t value)
+{
+	this->buckets[bucket(value)].fetch_add(1, boost::memory_order_relaxed);
+
+	if((this->recorded.fetch_add(1, boost::memory_order_relaxed) + 1) % DECAY_INTERVAL == 0)
+	{
+		this->decay();
+	}
+}
+
+boost::uint64_t Histogram::percentile(double p) const
+{
+	const boost::uint64_t total = this->count();
+	if(total == 0)
+		return 0;
+
+	boost::uint64_t rank = (boost::uint64_t)(total * p / 100.0 + 0.5);
+	if(rank < 1)
+		rank = 1;
+
+	boost::uint64_t seen = 0;
+	for(size_t i = 0; i < BUCKETS; i++)
+	{
+		seen += this->buckets[i].load(boost::memory_order_relaxed);
+		if(seen >= rank)
+			return bucket_value(i);
+	}
+
+	return bucket_value(BUCKETS - 1);
+}
+
+boost::uint64_t Histogram::count() const
+{
+	boost::uint64_t total = 0;
+	for(size_t i = 0; i < BUCKETS; i++)
+	{
+		total += this->buckets[i].load(boost::memory_order_relaxed);
+	}
+	return total;
+}
+
+size_t Histogram::bucket(boost::uint64_t value)
+{
+	if(value < SUB_BUCKETS)
+		return (size_t)value;
+
+	// exponent >= 4 here, keep the 4 bits below the leading one
+	size_t exponent = 0;
+	while((value >> exponent) > 1)
+		exponent++;
+
+	const size_t mantissa = (size_t)(value >> (exponent - 4)) & (SUB_BUCKETS - 1);
+	return (exponent - 3) * SUB_BUCKETS + mantissa;
+}
+
+boost::uint64_t Histogram::bucket_value(size_t index)
+{
+	if(index < SUB_BUCKETS)
+		return index;
+
+	const size_t exponent = index / SUB_BUCKETS + 3;
+	const boost::uint64_t mantissa = index % SUB_BUCKETS;
+	return ((SUB_BUCKETS + mantissa + 1) << (exponent - 4)) - 1;
+}
+
+void Histogram::decay()
+{
+	for(size_t i = 0; i < BUCKETS; i++)
+	{
+		boost::uint64_t current = this->buckets[i].load(boost::memory_order_relaxed);
+		while(current > 0 && !this->buckets[i].compare_exchange_weak(current, current - current / 2))
+		{
+		}
+	}
+}
@@ -0,0 +1,41 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#pragma once
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+
+// Log-linear histogram (16 buckets per power of two, ~6% resolution)
+// Recording is lock free. Every DECAY_INTERVAL samples all counts are halved,
+// so percentiles follow recent behaviour rather than the whole uptime.
+class Histogram
+{
+public:
+
+	static const boost::uint64_t DECAY_INTERVAL = 1U << 14;
+
+	Histogram();
+
+	void record(boost::uint64_t value);
+
+	// value at or below which p percent (0-100] of the samples are, 0 without samples
+	boost::uint64_t percentile(double p) const;
+	// samples currently counted (after decay)
+	boost::uint64_t count() const;
+
+private:
+
+	static const size_t SUB_BUCKETS = 16;
+	static const size_t BUCKETS = 64 * SUB_BUCKETS;
+
+	boost::atomic<boost::uint64_t> buckets[BUCKETS];
+	boost::atomic<boost::uint64_t> recorded;
+
+	static size_t bucket(boost::uint64_t value);
+	static boost::uint64_t bucket_value(size_t index); // upper bound of the bucket
+
+	void decay();
+};
+
+#endif
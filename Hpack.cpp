@@ -0,0 +1,557 @@
+#include "Hpack.h"
+
+namespace
+{
+	struct StaticEntry
+	{
+		const char* name;
+		const char* value;
+	};
+
+	// RFC 7541 appendix A
+	const StaticEntry STATIC_TABLE[] =
+	{
+		{ ":authority", "" },
+		{ ":method", "GET" },
+		{ ":method", "POST" },
+		{ ":path", "/" },
+		{ ":path", "/index.html" },
+		{ ":scheme", "http" },
+		{ ":scheme", "https" },
+		{ ":status", "200" },
+		{ ":status", "204" },
+		{ ":status", "206" },
+		{ ":status", "304" },
+		{ ":status", "400" },
+		{ ":status", "404" },
+		{ ":status", "500" },
+		{ "accept-charset", "" },
+		{ "accept-encoding", "gzip, deflate" },
+		{ "accept-language", "" },
+		{ "accept-ranges", "" },
+		{ "accept", "" },
+		{ "access-control-allow-origin", "" },
+		{ "age", "" },
+		{ "allow", "" },
+		{ "authorization", "" },
+		{ "cache-control", "" },
+		{ "content-disposition", "" },
+		{ "content-encoding", "" },
+		{ "content-language", "" },
+		{ "content-length", "" },
+		{ "content-location", "" },
+		{ "content-range", "" },
+		{ "content-type", "" },
+		{ "cookie", "" },
+		{ "date", "" },
+		{ "etag", "" },
+		{ "expect", "" },
+		{ "expires", "" },
+		{ "from", "" },
+		{ "host", "" },
+		{ "if-match", "" },
+		{ "if-modified-since", "" },
+		{ "if-none-match", "" },
+		{ "if-range", "" },
+		{ "if-unmodified-since", "" },
+		{ "last-modified", "" },
+		{ "link", "" },
+		{ "location", "" },
+		{ "max-forwards", "" },
+		{ "proxy-authenticate", "" },
+		{ "proxy-authorization", "" },
+		{ "range", "" },
+		{ "referer", "" },
+		{ "refresh", "" },
+		{ "retry-after", "" },
+		{ "server", "" },
+		{ "set-cookie", "" },
+		{ "strict-transport-security", "" },
+		{ "transfer-encoding", "" },
+		{ "user-agent", "" },
+		{ "vary", "" },
+		{ "via", "" },
+		{ "www-authenticate", "" }
+	};
+
+	const size_t STATIC_COUNT = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+
+	// per entry overhead, RFC 7541 section 4.1
+	const size_t ENTRY_OVERHEAD = 32;
+
+	// RFC 7541 appendix B, symbol 256 is EOS
+	const boost::uint32_t HUFFMAN_CODES[257] =
+	{
+		0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+		0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+		0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+		0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+		0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+		0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+		0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+		0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+		0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+		0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+		0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+		0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+		0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+		0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+		0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+		0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+		0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+		0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+		0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+		0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+		0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+		0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+		0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+		0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+		0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+		0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+		0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+		0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+		0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+		0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+		0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+		0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+		0x3fffffff
+	};
+
+	const unsigned char HUFFMAN_LENGTHS[257] =
+	{
+		13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+		28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+		6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+		5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+		13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+		7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+		15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+		6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+		20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+		24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+		22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+		21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+		26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+		19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+		20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+		26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+		30
+	};
+
+	const int EOS = 256;
+
+	// binary tree of the code, built once at startup
+	class HuffmanTree
+	{
+	public:
+
+		struct Node
+		{
+			int child[2]; // node indices, 0 = none (the root is never a child)
+			int symbol;   // -1 for inner nodes
+		};
+
+		std::vector<Node> nodes;
+
+		HuffmanTree()
+		{
+			Node root = { { 0, 0 }, -1 };
+			this->nodes.push_back(root);
+
+			for(int symbol = 0; symbol <= EOS; symbol++)
+			{
+				size_t node = 0;
+				for(int bit = HUFFMAN_LENGTHS[symbol] - 1; bit >= 0; bit--)
+				{
+					const int direction = (HUFFMAN_CODES[symbol] >> bit) & 1;
+					if(this->nodes[node].child[direction] == 0)
+					{
+						Node inner = { { 0, 0 }, -1 };
+						this->nodes[node].child[direction] = (int)this->nodes.size();
+						this->nodes.push_back(inner);
+					}
+					node = this->nodes[node].child[direction];
+				}
+				this->nodes[node].symbol = symbol;
+			}
+		}
+	};
+
+	const HuffmanTree HUFFMAN_TREE;
+
+	std::vector<Hpack::Header> static_headers()
+	{
+		std::vector<Hpack::Header> headers;
+		for(size_t i = 0; i < STATIC_COUNT; i++)
+		{
+			headers.push_back(Hpack::Header(STATIC_TABLE[i].name, STATIC_TABLE[i].value));
+		}
+		return headers;
+	}
+
+	const std::vector<Hpack::Header> STATIC_HEADERS = static_headers();
+
+	size_t entry_size(const Hpack::Header& header)
+	{
+		return header.first.size() + header.second.size() + ENTRY_OVERHEAD;
+	}
+
+	bool sensitive(const std::string& name)
+	{
+		return name == "authorization" || name == "proxy-authorization";
+	}
+}
+
+Hpack::Hpack(size_t max_table_size)
+{
+	this->table_size = 0;
+	this->max_table_size = max_table_size;
+	this->settings_size = max_table_size;
+	this->size_update = false;
+}
+
+void Hpack::encode(const HeaderList& headers, std::string& out)
+{
+	if(this->size_update)
+	{
+		encode_integer((boost::uint32_t)this->max_table_size, 5, 0x20, out);
+		this->size_update = false;
+	}
+
+	for(HeaderList::const_iterator it = headers.begin(); it != headers.end(); ++it)
+	{
+		bool value_match = false;
+		const size_t index = this->find(*it, value_match);
+
+		if(value_match)
+		{
+			encode_integer((boost::uint32_t)index, 7, 0x80, out);
+			continue;
+		}
+
+		const bool never_index = sensitive(it->first);
+		const bool indexing = !never_index && entry_size(*it) <= MAX_INDEXED_ENTRY && entry_size(*it) <= this->max_table_size;
+
+		const unsigned char representation = indexing ? 0x40 : (never_index ? 0x10 : 0x00);
+		encode_integer((boost::uint32_t)index, indexing ? 6 : 4, representation, out);
+		if(index == 0)
+		{
+			encode_string(it->first, out);
+		}
+		encode_string(it->second, out);
+
+		if(indexing)
+		{
+			this->insert(*it);
+		}
+	}
+}
+
+void Hpack::set_max_table_size(size_t size)
+{
+	this->settings_size = size;
+
+	// we never need more than the default
+	const size_t limit = size < DEFAULT_TABLE_SIZE ? size : DEFAULT_TABLE_SIZE;
+	if(limit != this->max_table_size)
+	{
+		this->max_table_size = limit;
+		this->evict(limit);
+		this->size_update = true;
+	}
+}
+
+bool Hpack::decode(const char* data, size_t size, HeaderList& headers)
+{
+	const unsigned char* pos = (const unsigned char*)data;
+	const unsigned char* end = pos + size;
+
+	while(pos < end)
+	{
+		const unsigned char first = *pos;
+		boost::uint32_t index;
+
+		if(first & 0x80)
+		{
+			// indexed header field
+			if(!decode_integer(pos, end, 7, index))
+				return false;
+
+			const Header* header = this->lookup(index);
+			if(!header)
+				return false;
+
+			headers.push_back(*header);
+			continue;
+		}
+
+		if((first & 0xe0) == 0x20)
+		{
+			// dynamic table size update
+			if(!decode_integer(pos, end, 5, index) || index > this->settings_size)
+				return false;
+
+			this->max_table_size = index;
+			this->evict(this->max_table_size);
+			continue;
+		}
+
+		// literal, with incremental indexing, without indexing or never indexed
+		const bool indexing = (first & 0xc0) == 0x40;
+		if(!decode_integer(pos, end, indexing ? 6 : 4, index))
+			return false;
+
+		Header header;
+		if(index == 0)
+		{
+			if(!decode_string(pos, end, header.first))
+				return false;
+		}
+		else
+		{
+			const Header* named = this->lookup(index);
+			if(!named)
+				return false;
+			header.first = named->first;
+		}
+
+		if(!decode_string(pos, end, header.second))
+			return false;
+
+		if(indexing)
+		{
+			this->insert(header);
+		}
+
+		headers.push_back(header);
+	}
+
+	return true;
+}
+
+void Hpack::insert(const Header& header)
+{
+	const size_t size = entry_size(header);
+
+	// an entry larger than the table empties it, RFC 7541 section 4.4
+	if(size > this->max_table_size)
+	{
+		this->evict(0);
+		return;
+	}
+
+	this->evict(this->max_table_size - size);
+	this->table.push_front(header);
+	this->table_size += size;
+}
+
+void Hpack::evict(size_t limit)
+{
+	while(this->table_size > limit && !this->table.empty())
+	{
+		this->table_size -= entry_size(this->table.back());
+		this->table.pop_back();
+	}
+}
+
+const Hpack::Header* Hpack::lookup(size_t index) const
+{
+	if(index == 0)
+		return NULL;
+	if(index <= STATIC_COUNT)
+		return &STATIC_HEADERS[index - 1];
+
+	index -= STATIC_COUNT + 1;
+	return index < this->table.size() ? &this->table[index] : NULL;
+}
+
+size_t Hpack::find(const Header& header, bool& value_match) const
+{
+	size_t name_index = 0;
+	value_match = false;
+
+	for(size_t i = 0; i < STATIC_COUNT; i++)
+	{
+		if(header.first == STATIC_TABLE[i].name)
+		{
+			if(header.second == STATIC_TABLE[i].value)
+			{
+				value_match = true;
+				return i + 1;
+			}
+			if(name_index == 0)
+				name_index = i + 1;
+		}
+	}
+
+	for(size_t i = 0; i < this->table.size(); i++)
+	{
+		if(header.first == this->table[i].first)
+		{
+			if(header.second == this->table[i].second)
+			{
+				value_match = true;
+				return STATIC_COUNT + 1 + i;
+			}
+			if(name_index == 0)
+				name_index = STATIC_COUNT + 1 + i;
+		}
+	}
+
+	return name_index;
+}
+
+void Hpack::encode_integer(boost::uint32_t value, int prefix_bits, unsigned char first, std::string& out)
+{
+	const boost::uint32_t max_prefix = (1U << prefix_bits) - 1;
+
+	if(value < max_prefix)
+	{
+		out += (char)(first | value);
+		return;
+	}
+
+	out += (char)(first | max_prefix);
+	value -= max_prefix;
+	while(value >= 128)
+	{
+		out += (char)((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out += (char)value;
+}
+
+bool Hpack::decode_integer(const unsigned char*& pos, const unsigned char* end, int prefix_bits, boost::uint32_t& value)
+{
+	if(pos >= end)
+		return false;
+
+	const boost::uint32_t max_prefix = (1U << prefix_bits) - 1;
+	value = *pos++ & max_prefix;
+	if(value < max_prefix)
+		return true;
+
+	for(int shift = 0; shift <= 28; shift += 7)
+	{
+		if(pos >= end)
+			return false;
+
+		const unsigned char byte = *pos++;
+		value += (boost::uint32_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+	}
+
+	return false; // doesn't fit 32 bits
+}
+
+void Hpack::encode_string(const std::string& s, std::string& out)
+{
+	const size_t huffman = huffman_size(s);
+	if(huffman < s.size())
+	{
+		encode_integer((boost::uint32_t)huffman, 7, 0x80, out);
+		huffman_encode(s, out);
+	}
+	else
+	{
+		encode_integer((boost::uint32_t)s.size(), 7, 0x00, out);
+		out += s;
+	}
+}
+
+bool Hpack::decode_string(const unsigned char*& pos, const unsigned char* end, std::string& s)
+{
+	if(pos >= end)
+		return false;
+
+	const bool huffman = (*pos & 0x80) != 0;
+	boost::uint32_t length;
+	if(!decode_integer(pos, end, 7, length) || length > (size_t)(end - pos))
+		return false;
+
+	s.clear();
+	if(huffman)
+	{
+		if(!huffman_decode(pos, length, s))
+			return false;
+	}
+	else
+	{
+		s.assign((const char*)pos, length);
+	}
+
+	pos += length;
+	return true;
+}
+
+size_t Hpack::huffman_size(const std::string& s)
+{
+	size_t bits = 0;
+	for(size_t i = 0; i < s.size(); i++)
+	{
+		bits += HUFFMAN_LENGTHS[(unsigned char)s[i]];
+	}
+	return (bits + 7) / 8;
+}
+
+void Hpack::huffman_encode(const std::string& s, std::string& out)
+{
+	boost::uint64_t buffer = 0;
+	int bits = 0;
+
+	for(size_t i = 0; i < s.size(); i++)
+	{
+		const unsigned char symbol = (unsigned char)s[i];
+		buffer = (buffer << HUFFMAN_LENGTHS[symbol]) | HUFFMAN_CODES[symbol];
+		bits += HUFFMAN_LENGTHS[symbol];
+
+		while(bits >= 8)
+		{
+			bits -= 8;
+			out += (char)(buffer >> bits);
+		}
+	}
+
+	// pad with the most significant bits of EOS, all ones
+	if(bits > 0)
+	{
+		out += (char)((buffer << (8 - bits)) | (0xff >> bits));
+	}
+}
+
+bool Hpack::huffman_decode(const unsigned char* data, size_t size, std::string& out)
+{
+	size_t node = 0;
+	int pending_bits = 0;   // since the last complete symbol
+	bool pending_ones = true;
+
+	for(size_t i = 0; i < size; i++)
+	{
+		for(int bit = 7; bit >= 0; bit--)
+		{
+			const int direction = (data[i] >> bit) & 1;
+			node = HUFFMAN_TREE.nodes[node].child[direction];
+			if(node == 0)
+				return false;
+
+			pending_bits++;
+			pending_ones = pending_ones && direction == 1;
+
+			const int symbol = HUFFMAN_TREE.nodes[node].symbol;
+			if(symbol >= 0)
+			{
+				if(symbol == EOS)
+					return false;
+
+				out += (char)symbol;
+				node = 0;
+				pending_bits = 0;
+				pending_ones = true;
+			}
+		}
+	}
+
+	// padding is a prefix of EOS, shorter than a byte
+	return pending_bits < 8 && pending_ones;
+}
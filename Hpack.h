@@ -0,0 +1,62 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <boost/cstdint.hpp>
+
+// HPACK header compression (RFC 7541)
+// One instance per direction of an HTTP/2 connection, the encoder and the
+// decoder on both ends keep their dynamic tables in sync.
+class Hpack
+{
+public:
+
+	typedef std::pair<std::string, std::string> Header; // lowercase name, value
+	typedef std::vector<Header> HeaderList;
+
+	static const size_t DEFAULT_TABLE_SIZE = 4096;
+
+	explicit Hpack(size_t max_table_size = DEFAULT_TABLE_SIZE);
+
+	// encoder side, appends one header block
+	void encode(const HeaderList& headers, std::string& out);
+	// encoder side, the peer's SETTINGS_HEADER_TABLE_SIZE, announced in the next block
+	void set_max_table_size(size_t size);
+
+	// decoder side, false on a compression error (fatal for the connection)
+	bool decode(const char* data, size_t size, HeaderList& headers);
+
+private:
+
+	// entries the encoder adds to the table, larger ones (cookies...) are sent literally
+	static const size_t MAX_INDEXED_ENTRY = 256;
+
+	std::deque<Header> table; // newest first
+	size_t table_size;
+	size_t max_table_size;   // current limit
+	size_t settings_size;    // upper bound, from SETTINGS
+	bool size_update;        // encoder owes the peer a table size update
+
+	void insert(const Header& header);
+	void evict(size_t limit);
+	// 1-based HPACK index, static table first
+	const Header* lookup(size_t index) const;
+	// exact match or name only match (value_match false), 0 if none
+	size_t find(const Header& header, bool& value_match) const;
+
+	static void encode_integer(boost::uint32_t value, int prefix_bits, unsigned char first, std::string& out);
+	static bool decode_integer(const unsigned char*& pos, const unsigned char* end, int prefix_bits, boost::uint32_t& value);
+	static void encode_string(const std::string& s, std::string& out);
+	static bool decode_string(const unsigned char*& pos, const unsigned char* end, std::string& s);
+
+	static size_t huffman_size(const std::string& s);
+	static void huffman_encode(const std::string& s, std::string& out);
+	static bool huffman_decode(const unsigned char* data, size_t size, std::string& out);
+};
+
+#endif
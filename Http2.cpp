@@ -0,0 +1,734 @@
+#include "Http2.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include "Message.h"
+
+namespace
+{
+	const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+	enum Setting
+	{
+		SETTINGS_HEADER_TABLE_SIZE = 0x1,
+		SETTINGS_ENABLE_PUSH = 0x2,
+		SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+		SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+		SETTINGS_MAX_FRAME_SIZE = 0x5
+	};
+
+	const boost::uint32_t MAX_WINDOW = 0x7fffffff;
+}
+
+Http2Stream::Http2Stream()
+{
+	this->id = 0;
+	this->status = 0;
+	this->local_closed = false;
+	this->remote_closed = false;
+	this->reset = false;
+	this->refused = false;
+	this->send_window = 0;
+	this->consumed = 0;
+}
+
+Http2Connection::Http2Connection(Socket socket)
+{
+	this->socket = socket;
+	this->started = false;
+
+	this->opening = 0;
+	this->next_stream_id = 1;
+
+	this->max_streams = DEFAULT_MAX_STREAMS;
+	this->peer_initial_window = DEFAULT_WINDOW;
+	this->peer_max_frame = DEFAULT_FRAME_SIZE;
+	this->send_window = DEFAULT_WINDOW;
+	this->consumed = 0;
+	this->peer_table_size = Hpack::DEFAULT_TABLE_SIZE;
+	this->table_size_changed = false;
+
+	this->goaway = false;
+	this->broken = false;
+
+	this->header_stream = 0;
+	this->header_end_stream = false;
+}
+
+Http2Connection::~Http2Connection()
+{
+	this->shutdown();
+}
+
+bool Http2Connection::start()
+{
+	std::string out(PREFACE, sizeof(PREFACE) - 1);
+
+	// no pushes, and a larger window than the default 64k, per stream and for the connection
+	std::string settings;
+	settings += (char)0;
+	settings += (char)SETTINGS_ENABLE_PUSH;
+	append_u32(settings, 0);
+	settings += (char)0;
+	settings += (char)SETTINGS_INITIAL_WINDOW_SIZE;
+	append_u32(settings, STREAM_WINDOW);
+
+	append_frame(out, SETTINGS, 0, 0, settings.data(), settings.size());
+	append_window_update(out, 0, CONNECTION_WINDOW - DEFAULT_WINDOW);
+
+	if(!this->write(out))
+	{
+		return false;
+	}
+
+	this->started = true;
+	this->reader_thread = boost::thread(boost::bind(&Http2Connection::reader, this));
+	return true;
+}
+
+void Http2Connection::shutdown()
+{
+	if(!this->started)
+	{
+		this->socket.close();
+		return;
+	}
+	this->started = false;
+
+	boost::uint32_t last_id = 0; // we don't accept streams from the server
+	std::string goaway;
+	append_u32(goaway, last_id);
+	append_u32(goaway, NO_ERROR_CODE);
+
+	std::string out;
+	append_frame(out, GOAWAY, 0, 0, goaway.data(), goaway.size());
+	this->write(out);
+
+	// wakes up the reader
+	this->socket.shutdown(true, true);
+	this->reader_thread.join();
+	this->socket.close();
+}
+
+bool Http2Connection::usable()
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return !this->goaway && !this->broken;
+}
+
+size_t Http2Connection::get_streams()
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return this->streams.size() + this->opening;
+}
+
+Http2StreamPtr Http2Connection::open(const Hpack::HeaderList& headers, bool end_stream, long seconds)
+{
+	Http2StreamPtr stream(new Http2Stream);
+
+	// reserve a slot first, the id has to be taken in the order the HEADERS go out
+	{
+		const boost::system_time until = deadline(seconds);
+		boost::unique_lock<boost::mutex> lock(this->guard);
+		while(!this->goaway && !this->broken && this->streams.size() + this->opening >= this->max_streams)
+		{
+			if(!this->wait(lock, until))
+			{
+				return Http2StreamPtr();
+			}
+		}
+
+		if(this->goaway || this->broken)
+		{
+			return Http2StreamPtr();
+		}
+
+		this->opening++;
+	}
+
+	boost::unique_lock<boost::mutex> write_lock(this->write_guard);
+
+	{
+		boost::unique_lock<boost::mutex> lock(this->guard);
+		this->opening--;
+
+		if(this->goaway || this->broken || this->next_stream_id > MAX_WINDOW)
+		{
+			this->changed.notify_all();
+			return Http2StreamPtr();
+		}
+
+		stream->id = this->next_stream_id;
+		this->next_stream_id += 2;
+		stream->send_window = this->peer_initial_window;
+		stream->local_closed = end_stream;
+		this->streams[stream->id] = stream;
+
+		if(this->table_size_changed)
+		{
+			this->encoder.set_max_table_size(this->peer_table_size);
+			this->table_size_changed = false;
+		}
+	}
+
+	std::string block;
+	this->encoder.encode(headers, block);
+
+	// the block may need CONTINUATION frames, nothing else may go out in between
+	std::string out;
+	size_t offset = 0;
+	bool first = true;
+	do
+	{
+		const size_t length = block.size() - offset < this->peer_max_frame ? block.size() - offset : this->peer_max_frame;
+		const bool last = offset + length == block.size();
+
+		int flags = last ? END_HEADERS : 0;
+		if(first && end_stream)
+			flags |= END_STREAM;
+
+		append_frame(out, first ? HEADERS : CONTINUATION, flags, stream->id, block.data() + offset, length);
+		offset += length;
+		first = false;
+	}
+	while(offset < block.size());
+
+	const size_t sent = this->socket.send(out.data(), out.size());
+	write_lock.unlock();
+
+	if(sent != out.size())
+	{
+		this->close(stream);
+		return Http2StreamPtr();
+	}
+
+	return stream;
+}
+
+bool Http2Connection::send_data(const Http2StreamPtr& stream, const char* data, size_t size, bool end_stream, long seconds)
+{
+	const boost::system_time until = deadline(seconds);
+	size_t offset = 0;
+
+	do
+	{
+		size_t length = size - offset;
+
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+
+			// an empty frame only carries END_STREAM and needs no window
+			while(length > 0 && (this->send_window <= 0 || stream->send_window <= 0))
+			{
+				if(stream->reset || this->broken || !this->wait(lock, until))
+				{
+					return false;
+				}
+			}
+
+			if(stream->reset || this->broken)
+			{
+				return false;
+			}
+
+			if((boost::int64_t)length > this->send_window)
+				length = (size_t)this->send_window;
+			if((boost::int64_t)length > stream->send_window)
+				length = (size_t)stream->send_window;
+			if(length > this->peer_max_frame)
+				length = this->peer_max_frame;
+
+			this->send_window -= length;
+			stream->send_window -= length;
+		}
+
+		const bool last = end_stream && offset + length == size;
+
+		std::string out;
+		append_frame(out, DATA, last ? END_STREAM : 0, stream->id, data + offset, length);
+		if(!this->write(out))
+		{
+			return false;
+		}
+
+		offset += length;
+
+		if(last)
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+			stream->local_closed = true;
+		}
+	}
+	while(offset < size);
+
+	return true;
+}
+
+bool Http2Connection::wait_response(const Http2StreamPtr& stream, long seconds, int& status, Hpack::HeaderList& headers)
+{
+	const boost::system_time until = deadline(seconds);
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	while(stream->status == 0)
+	{
+		if(stream->reset || stream->remote_closed || !this->wait(lock, until))
+		{
+			return false;
+		}
+	}
+
+	status = stream->status;
+	headers = stream->headers;
+	return true;
+}
+
+bool Http2Connection::read(const Http2StreamPtr& stream, std::string& out, long seconds)
+{
+	std::string updates;
+
+	{
+		const boost::system_time until = deadline(seconds);
+		boost::unique_lock<boost::mutex> lock(this->guard);
+
+		while(stream->data.empty())
+		{
+			if(stream->reset || stream->remote_closed || !this->wait(lock, until))
+			{
+				return false;
+			}
+		}
+
+		out.swap(stream->data);
+		stream->data.clear();
+
+		// reopen the windows once half of them is used up
+		stream->consumed += out.size();
+		this->consumed += out.size();
+
+		if(stream->consumed >= STREAM_WINDOW / 2 && !stream->remote_closed)
+		{
+			append_window_update(updates, stream->id, stream->consumed);
+			stream->consumed = 0;
+		}
+		if(this->consumed >= CONNECTION_WINDOW / 2)
+		{
+			append_window_update(updates, 0, this->consumed);
+			this->consumed = 0;
+		}
+	}
+
+	if(!updates.empty())
+	{
+		this->write(updates);
+	}
+
+	return true;
+}
+
+bool Http2Connection::finished(const Http2StreamPtr& stream)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return stream->remote_closed && !stream->reset && stream->data.empty();
+}
+
+bool Http2Connection::refused(const Http2StreamPtr& stream)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return stream->refused;
+}
+
+void Http2Connection::close(const Http2StreamPtr& stream)
+{
+	std::string out;
+
+	{
+		boost::unique_lock<boost::mutex> lock(this->guard);
+
+		if(this->streams.erase(stream->id) == 0)
+		{
+			return;
+		}
+
+		// unread data still counts against the connection window
+		this->consumed += stream->data.size();
+		stream->data.clear();
+		if(this->consumed >= CONNECTION_WINDOW / 2)
+		{
+			append_window_update(out, 0, this->consumed);
+			this->consumed = 0;
+		}
+
+		if(!stream->reset && !(stream->local_closed && stream->remote_closed))
+		{
+			std::string code;
+			append_u32(code, CANCEL);
+			append_frame(out, RST_STREAM, 0, stream->id, code.data(), code.size());
+		}
+
+		stream->reset = true;
+		this->changed.notify_all(); // a slot is free
+	}
+
+	if(!out.empty())
+	{
+		this->write(out);
+	}
+}
+
+void Http2Connection::reader()
+{
+	char header[FRAME_HEADER_SIZE];
+	std::vector<char> payload;
+
+	// the server's SETTINGS come first
+	bool ok = true;
+	while(ok && this->socket.recv(header, sizeof(header), Socket::NONE, true) == (int)sizeof(header))
+	{
+		const size_t length = ((unsigned char)header[0] << 16) | ((unsigned char)header[1] << 8) | (unsigned char)header[2];
+		const int type = (unsigned char)header[3];
+		const int flags = (unsigned char)header[4];
+		const boost::uint32_t id = read_u32(header + 5) & MAX_WINDOW;
+
+		// we never raise SETTINGS_MAX_FRAME_SIZE
+		if(length > DEFAULT_FRAME_SIZE)
+		{
+			Message::error() << "HTTP/2 frame too large" << '\n';
+			break;
+		}
+
+		payload.resize(length + 1);
+		if(length > 0 && this->socket.recv(&payload[0], length, Socket::NONE, true) != (int)length)
+		{
+			break;
+		}
+
+		std::string reply;
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+			ok = this->handle_frame(type, flags, id, &payload[0], length, reply);
+			this->changed.notify_all();
+		}
+
+		if(!reply.empty() && !this->write(reply))
+		{
+			ok = false;
+		}
+	}
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	this->broken = true;
+	this->fail_streams(0, false);
+	this->changed.notify_all();
+}
+
+bool Http2Connection::handle_frame(int type, int flags, boost::uint32_t id, const char* payload, size_t length, std::string& reply)
+{
+	// a header block must not be interrupted
+	if(this->header_stream != 0 && (type != CONTINUATION || id != this->header_stream))
+	{
+		Message::error() << "HTTP/2 header block interrupted" << '\n';
+		return false;
+	}
+
+	switch(type)
+	{
+	case DATA:
+		{
+			StreamMap::iterator it = this->streams.find(id);
+
+			size_t padding = 0;
+			size_t offset = 0;
+			if(flags & PADDED)
+			{
+				if(length < 1 || (size_t)(unsigned char)payload[0] + 1 > length)
+					return false;
+				padding = (unsigned char)payload[0];
+				offset = 1;
+			}
+
+			if(it == this->streams.end() || it->second->reset)
+			{
+				// nobody reads it, give the window back right away
+				this->consumed += length;
+			}
+			else
+			{
+				Http2Stream& stream = *it->second;
+				stream.data.append(payload + offset, length - offset - padding);
+				stream.consumed += offset + padding;
+				this->consumed += offset + padding;
+				if(flags & END_STREAM)
+					stream.remote_closed = true;
+			}
+
+			if(this->consumed >= CONNECTION_WINDOW / 2)
+			{
+				append_window_update(reply, 0, this->consumed);
+				this->consumed = 0;
+			}
+			return true;
+		}
+
+	case HEADERS:
+		{
+			size_t offset = 0;
+			size_t padding = 0;
+			if(flags & PADDED)
+			{
+				if(length < 1)
+					return false;
+				padding = (unsigned char)payload[0];
+				offset = 1;
+			}
+			if(flags & PRIORITY_FLAG)
+			{
+				offset += 5;
+			}
+			if(offset + padding > length)
+				return false;
+
+			this->header_block.assign(payload + offset, length - offset - padding);
+			this->header_end_stream = (flags & END_STREAM) != 0;
+			this->header_stream = id;
+
+			return !(flags & END_HEADERS) || this->handle_headers(id, this->header_end_stream, reply);
+		}
+
+	case CONTINUATION:
+		{
+			if(this->header_stream == 0)
+				return false;
+
+			this->header_block.append(payload, length);
+			return !(flags & END_HEADERS) || this->handle_headers(id, this->header_end_stream, reply);
+		}
+
+	case RST_STREAM:
+		{
+			if(length != 4)
+				return false;
+
+			StreamMap::iterator it = this->streams.find(id);
+			if(it != this->streams.end())
+			{
+				it->second->reset = true;
+				it->second->refused = read_u32(payload) == REFUSED_STREAM;
+			}
+			return true;
+		}
+
+	case SETTINGS:
+		{
+			if(flags & ACK)
+				return true;
+			if(length % 6 != 0)
+				return false;
+
+			for(size_t i = 0; i < length; i += 6)
+			{
+				const int setting = ((unsigned char)payload[i] << 8) | (unsigned char)payload[i + 1];
+				const boost::uint32_t value = read_u32(payload + i + 2);
+
+				switch(setting)
+				{
+				case SETTINGS_HEADER_TABLE_SIZE:
+					this->peer_table_size = value;
+					this->table_size_changed = true;
+					break;
+				case SETTINGS_MAX_CONCURRENT_STREAMS:
+					this->max_streams = value;
+					break;
+				case SETTINGS_INITIAL_WINDOW_SIZE:
+					{
+						if(value > MAX_WINDOW)
+							return false;
+
+						// applies to open streams as well
+						const boost::int64_t delta = (boost::int64_t)value - this->peer_initial_window;
+						for(StreamMap::iterator it = this->streams.begin(); it != this->streams.end(); ++it)
+						{
+							it->second->send_window += delta;
+						}
+						this->peer_initial_window = value;
+					}
+					break;
+				case SETTINGS_MAX_FRAME_SIZE:
+					if(value < DEFAULT_FRAME_SIZE || value > 0xffffff)
+						return false;
+					this->peer_max_frame = value;
+					break;
+				}
+			}
+
+			append_frame(reply, SETTINGS, ACK, 0, NULL, 0);
+			return true;
+		}
+
+	case PING:
+		{
+			if(length != 8)
+				return false;
+			if(!(flags & ACK))
+				append_frame(reply, PING, ACK, 0, payload, length);
+			return true;
+		}
+
+	case GOAWAY:
+		{
+			if(length < 8)
+				return false;
+
+			// streams above the last one it processed can be retried elsewhere, the others finish
+			const boost::uint32_t last_id = read_u32(payload) & MAX_WINDOW;
+			this->goaway = true;
+			this->fail_streams(last_id, true);
+			return true;
+		}
+
+	case WINDOW_UPDATE:
+		{
+			if(length != 4)
+				return false;
+
+			const boost::uint32_t increment = read_u32(payload) & MAX_WINDOW;
+			if(id == 0)
+			{
+				this->send_window += increment;
+				return this->send_window <= MAX_WINDOW;
+			}
+
+			StreamMap::iterator it = this->streams.find(id);
+			if(it != this->streams.end())
+			{
+				it->second->send_window += increment;
+			}
+			return true;
+		}
+
+	case PUSH_PROMISE:
+		// disabled in our SETTINGS
+		return false;
+
+	default:
+		// PRIORITY and unknown frame types are ignored
+		return true;
+	}
+}
+
+bool Http2Connection::handle_headers(boost::uint32_t id, bool end_stream, std::string& reply)
+{
+	this->header_stream = 0;
+
+	// decode even for streams we closed, the table has to stay in sync
+	Hpack::HeaderList headers;
+	const bool decoded = this->decoder.decode(this->header_block.data(), this->header_block.size(), headers);
+	this->header_block.clear();
+
+	if(!decoded)
+	{
+		Message::error() << "HPACK decoding failed" << '\n';
+
+		std::string goaway;
+		append_u32(goaway, this->next_stream_id > 2 ? this->next_stream_id - 2 : 0);
+		append_u32(goaway, COMPRESSION_ERROR);
+		append_frame(reply, GOAWAY, 0, 0, goaway.data(), goaway.size());
+		return false;
+	}
+
+	StreamMap::iterator it = this->streams.find(id);
+	if(it == this->streams.end())
+	{
+		return true;
+	}
+
+	Http2Stream& stream = *it->second;
+
+	int status = 0;
+	for(size_t i = 0; i < headers.size(); i++)
+	{
+		if(headers[i].first == ":status")
+		{
+			status = std::atoi(headers[i].second.c_str());
+		}
+	}
+
+	// informational responses are dropped, a second block after the final one holds trailers
+	if(stream.status == 0 && status >= 200)
+	{
+		stream.status = status;
+		stream.headers.swap(headers);
+	}
+
+	if(end_stream)
+	{
+		stream.remote_closed = true;
+	}
+
+	return true;
+}
+
+void Http2Connection::fail_streams(boost::uint32_t above, bool refused)
+{
+	for(StreamMap::iterator it = this->streams.begin(); it != this->streams.end(); ++it)
+	{
+		if(it->first > above && !it->second->remote_closed)
+		{
+			it->second->reset = true;
+			it->second->refused = refused;
+		}
+	}
+}
+
+bool Http2Connection::write(const std::string& frames)
+{
+	boost::unique_lock<boost::mutex> lock(this->write_guard);
+	return this->socket.send(frames.data(), frames.size()) == frames.size();
+}
+
+bool Http2Connection::wait(boost::unique_lock<boost::mutex>& lock, const boost::system_time& until)
+{
+	return this->changed.timed_wait(lock, until);
+}
+
+boost::system_time Http2Connection::deadline(long seconds)
+{
+	return boost::get_system_time() + boost::posix_time::seconds(seconds);
+}
+
+void Http2Connection::append_frame(std::string& out, int type, int flags, boost::uint32_t id, const char* payload, size_t length)
+{
+	out += (char)((length >> 16) & 0xff);
+	out += (char)((length >> 8) & 0xff);
+	out += (char)(length & 0xff);
+	out += (char)type;
+	out += (char)flags;
+	append_u32(out, id & MAX_WINDOW);
+	if(length > 0)
+	{
+		out.append(payload, length);
+	}
+}
+
+void Http2Connection::append_window_update(std::string& out, boost::uint32_t id, boost::uint32_t increment)
+{
+	std::string payload;
+	append_u32(payload, increment);
+	append_frame(out, WINDOW_UPDATE, 0, id, payload.data(), payload.size());
+}
+
+void Http2Connection::append_u32(std::string& out, boost::uint32_t value)
+{
+	out += (char)((value >> 24) & 0xff);
+	out += (char)((value >> 16) & 0xff);
+	out += (char)((value >> 8) & 0xff);
+	out += (char)(value & 0xff);
+}
+
+boost::uint32_t Http2Connection::read_u32(const char* data)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	return ((boost::uint32_t)bytes[0] << 24) | ((boost::uint32_t)bytes[1] << 16) | ((boost::uint32_t)bytes[2] << 8) | bytes[3];
+}
@@ -0,0 +1,180 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include "Socket.h"
+#include "Hpack.h"
+
+// One request/response exchange on an Http2Connection
+class Http2Stream
+{
+public:
+
+	Http2Stream();
+
+	boost::uint32_t get_id() const { return this->id; }
+
+private:
+
+	friend class Http2Connection;
+
+	boost::uint32_t id;
+
+	int status;               // final response status, 0 until the header arrived
+	Hpack::HeaderList headers;
+	std::string data;         // received, not read yet
+
+	bool local_closed;        // we sent END_STREAM
+	bool remote_closed;       // the peer sent END_STREAM
+	bool reset;               // RST_STREAM, GOAWAY or connection loss
+	bool refused;             // the peer never processed it, safe to retry
+
+	boost::int64_t send_window;
+	boost::uint32_t consumed; // read but not announced in a WINDOW_UPDATE yet
+};
+
+typedef boost::shared_ptr<Http2Stream> Http2StreamPtr;
+
+// HTTP/2 client connection with prior knowledge (h2c) over an established socket
+// Any number of threads run their own streams on it, a reader thread sorts
+// incoming frames into them. Flow control windows are only reopened as the
+// streams' owners read their data, so slow clients don't make us buffer.
+class Http2Connection
+{
+public:
+
+	explicit Http2Connection(Socket socket);
+	~Http2Connection();
+
+	// preface and SETTINGS, starts the reader
+	bool start();
+	// GOAWAY, then closes the socket, streams still running fail
+	void shutdown();
+
+	// takes new streams, no GOAWAY received and still connected
+	bool usable();
+	size_t get_streams();
+
+	// sends the request header, waits up to seconds for a free stream slot
+	// NULL if the connection is going away
+	Http2StreamPtr open(const Hpack::HeaderList& headers, bool end_stream, long seconds);
+	// request body, waits for the flow control windows
+	bool send_data(const Http2StreamPtr& stream, const char* data, size_t size, bool end_stream, long seconds);
+
+	// waits for the final response header (informational ones are skipped)
+	bool wait_response(const Http2StreamPtr& stream, long seconds, int& status, Hpack::HeaderList& headers);
+	// response body as it arrives, false once it's complete or the stream failed
+	bool read(const Http2StreamPtr& stream, std::string& out, long seconds);
+
+	// the response arrived completely
+	bool finished(const Http2StreamPtr& stream);
+	// the request never got processed, another connection may try it
+	bool refused(const Http2StreamPtr& stream);
+
+	// done with it, an unfinished stream is cancelled
+	void close(const Http2StreamPtr& stream);
+
+private:
+
+	enum FrameType
+	{
+		DATA = 0x0,
+		HEADERS = 0x1,
+		PRIORITY = 0x2,
+		RST_STREAM = 0x3,
+		SETTINGS = 0x4,
+		PUSH_PROMISE = 0x5,
+		PING = 0x6,
+		GOAWAY = 0x7,
+		WINDOW_UPDATE = 0x8,
+		CONTINUATION = 0x9
+	};
+
+	enum Flag
+	{
+		END_STREAM = 0x1,
+		ACK = 0x1,
+		END_HEADERS = 0x4,
+		PADDED = 0x8,
+		PRIORITY_FLAG = 0x20
+	};
+
+	enum ErrorCode
+	{
+		NO_ERROR_CODE = 0x0,
+		PROTOCOL_ERROR = 0x1,
+		FLOW_CONTROL_ERROR = 0x3,
+		FRAME_SIZE_ERROR = 0x6,
+		REFUSED_STREAM = 0x7,
+		CANCEL = 0x8,
+		COMPRESSION_ERROR = 0x9
+	};
+
+	static const size_t FRAME_HEADER_SIZE = 9;
+	static const boost::uint32_t DEFAULT_WINDOW = 65535;
+	static const boost::uint32_t DEFAULT_FRAME_SIZE = 16384;
+	static const boost::uint32_t STREAM_WINDOW = 1U << 20;     // what we let each stream buffer
+	static const boost::uint32_t CONNECTION_WINDOW = 1U << 24;
+	static const boost::uint32_t DEFAULT_MAX_STREAMS = 100;    // until the peer tells us
+
+	typedef std::map<boost::uint32_t, Http2StreamPtr> StreamMap;
+
+	Socket socket;
+	boost::thread reader_thread;
+	bool started;
+
+	boost::mutex guard;        // everything below but the encoder
+	boost::mutex write_guard;  // socket writes and the encoder, taken before guard if both are needed
+	boost::condition_variable changed;
+
+	StreamMap streams;
+	size_t opening;            // slots reserved by open() that don't have an id yet
+	boost::uint32_t next_stream_id;
+
+	boost::uint32_t max_streams;
+	boost::uint32_t peer_initial_window;
+	boost::uint32_t peer_max_frame;
+	boost::int64_t send_window;    // connection level
+	boost::uint32_t consumed;      // connection level, not announced yet
+	size_t peer_table_size;        // SETTINGS_HEADER_TABLE_SIZE for the encoder
+	bool table_size_changed;
+
+	bool goaway;
+	bool broken;
+
+	Hpack encoder;
+	Hpack decoder;                 // reader thread only
+
+	// header block spanning HEADERS and CONTINUATION frames, reader thread only
+	boost::uint32_t header_stream;
+	bool header_end_stream;
+	std::string header_block;
+
+	void reader();
+	bool handle_frame(int type, int flags, boost::uint32_t id, const char* payload, size_t length, std::string& reply);
+	bool handle_headers(boost::uint32_t id, bool end_stream, std::string& reply);
+	void fail_streams(boost::uint32_t above, bool refused);
+
+	bool write(const std::string& frames);
+	// false once the deadline passed
+	bool wait(boost::unique_lock<boost::mutex>& lock, const boost::system_time& until);
+	static boost::system_time deadline(long seconds);
+
+	static void append_frame(std::string& out, int type, int flags, boost::uint32_t id, const char* payload, size_t length);
+	static void append_window_update(std::string& out, boost::uint32_t id, boost::uint32_t increment);
+	static void append_u32(std::string& out, boost::uint32_t value);
+	static boost::uint32_t read_u32(const char* data);
+};
+
+typedef boost::shared_ptr<Http2Connection> Http2ConnectionPtr;
+
+#endif
@@ -0,0 +1,166 @@
+#include "Inflight.h"
+
+#include <cassert>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/thread_time.hpp>
+
+InflightFetch::InflightFetch(const std::string& key, size_t limit) : charge(Memory::IO_BUFFERS)
+{
+	this->key = key;
+	this->state = WAITING;
+	this->keep_alive = false;
+	this->limit = limit;
+}
+
+void InflightFetch::start(bool shared, bool keep_alive)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	assert(this->state == WAITING);
+
+	this->state = shared ? SHARED : PRIVATE;
+	this->keep_alive = keep_alive;
+	this->changed.notify_all();
+}
+
+void InflightFetch::append(const char* data, size_t size)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	if(this->state != SHARED)
+		return;
+
+	// too big to keep around, followers that haven't started yet fetch on their own
+	if(this->data.size() + size > this->limit)
+	{
+		this->state = PRIVATE;
+		std::string().swap(this->data);
+		this->charge.resize(0);
+		this->changed.notify_all();
+		return;
+	}
+
+	this->data.append(data, size);
+	this->charge.resize(this->data.size());
+	this->changed.notify_all();
+}
+
+void InflightFetch::finish(bool success)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	if(this->state == SHARED)
+	{
+		this->state = success ? DONE : FAILED;
+	}
+	else if(this->state == WAITING)
+	{
+		this->state = FAILED;
+	}
+	this->changed.notify_all();
+}
+
+InflightFetch::State InflightFetch::wait_start(long seconds)
+{
+	const boost::system_time until = boost::get_system_time() + boost::posix_time::seconds(seconds);
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	while(this->state == WAITING)
+	{
+		if(seconds < 0)
+		{
+			this->changed.wait(lock);
+		}
+		else if(!this->changed.timed_wait(lock, until))
+		{
+			break;
+		}
+	}
+	return this->state;
+}
+
+bool InflightFetch::read(size_t offset, std::string& out, long seconds)
+{
+	const boost::system_time until = boost::get_system_time() + boost::posix_time::seconds(seconds);
+
+	out.clear();
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	while(this->state == SHARED && this->data.size() <= offset)
+	{
+		if(seconds < 0)
+		{
+			this->changed.wait(lock);
+		}
+		else if(!this->changed.timed_wait(lock, until))
+		{
+			return false;
+		}
+	}
+
+	if(this->state == FAILED || this->state == PRIVATE)
+		return false;
+
+	if(offset < this->data.size())
+	{
+		out.assign(this->data, offset, std::string::npos);
+		return true;
+	}
+
+	return false; // DONE and nothing left
+}
+
+InflightFetch::State InflightFetch::get_state()
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return this->state;
+}
+
+std::string InflightFetch::get_data()
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	return this->data;
+}
+
+InflightTable::InflightTable()
+{
+	this->limit = DEFAULT_LIMIT;
+}
+
+void InflightTable::set_limit(size_t bytes)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+	this->limit = bytes;
+}
+
+boost::shared_ptr<InflightFetch> InflightTable::join(const std::string& key, bool& leader)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	FetchMap::iterator it = this->fetches.find(key);
+	if(it != this->fetches.end())
+	{
+		leader = false;
+		return it->second;
+	}
+
+	boost::shared_ptr<InflightFetch> fetch(new InflightFetch(key, this->limit));
+	this->fetches[key] = fetch;
+	leader = true;
+	return fetch;
+}
+
+void InflightTable::complete(const boost::shared_ptr<InflightFetch>& fetch, bool success)
+{
+	assert(fetch);
+
+	fetch->finish(success);
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	FetchMap::iterator it = this->fetches.find(fetch->get_key());
+	if(it != this->fetches.end() && it->second == fetch)
+	{
+		this->fetches.erase(it);
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "Memory.h"
+
+// A response one connection (the leader) fetches from the origin while other
+// connections asking for the same thing stream it as it arrives
+class InflightFetch
+{
+public:
+
+	enum State
+	{
+		WAITING, // no response header yet
+		SHARED,  // response is streaming, followers may read it
+		PRIVATE, // response can't be shared, followers fetch on their own
+		DONE,    // response complete
+		FAILED   // leader gave up
+	};
+
+	// a response growing past limit bytes turns PRIVATE, it couldn't be stored anyway
+	InflightFetch(const std::string& key, size_t limit);
+
+	const std::string& get_key() const { return this->key; }
+
+	// leader side
+	void start(bool shared, bool keep_alive);
+	void append(const char* data, size_t size);
+	void finish(bool success);
+
+	// follower side, seconds < 0 -> infinite
+	State wait_start(long seconds);
+	// copies everything past offset into out, waiting until there is something new
+	// returns false once the response is complete and fully read, or on failure/timeout
+	bool read(size_t offset, std::string& out, long seconds);
+
+	State get_state();
+	bool get_keep_alive() const { return this->keep_alive; }
+
+	// whole response as received so far
+	std::string get_data();
+
+private:
+
+	std::string key;
+
+	State state;
+	bool keep_alive;
+	size_t limit;
+	std::string data;
+	Memory::Charge charge; // for data
+
+	boost::mutex guard;
+	boost::condition_variable changed;
+};
+
+// In-flight fetches by cache key
+class InflightTable
+{
+public:
+
+	static const size_t DEFAULT_LIMIT = 64U * 1024U * 1024U; // bytes kept per fetch
+
+	InflightTable();
+
+	// for fetches starting from now on, usually the largest entry the cache takes
+	void set_limit(size_t bytes);
+
+	// returns the fetch for key, creating it if there is none (leader = true)
+	boost::shared_ptr<InflightFetch> join(const std::string& key, bool& leader);
+	// leader is done, new requests for the key start their own fetch
+	void complete(const boost::shared_ptr<InflightFetch>& fetch, bool success);
+
+private:
+
+	typedef std::map<std::string, boost::shared_ptr<InflightFetch> > FetchMap;
+
+	FetchMap fetches;
+	size_t limit;
+	boost::mutex guard;
+};
+
+#endif
@@ -0,0 +1,59 @@
+#include "Maglev.h"
+
+Maglev::Maglev(const std::vector<std::string>& members)
+{
+	const size_t count = members.size();
+	if(count == 0)
+		return;
+
+	std::vector<size_t> offset(count);
+	std::vector<size_t> skip(count);
+	std::vector<size_t> next(count, 0);
+
+	for(size_t i = 0; i < count; i++)
+	{
+		offset[i] = (size_t)(hash(members[i], 0xdeadbeefULL) % TABLE_SIZE);
+		skip[i]   = (size_t)(hash(members[i], 0xcafebabeULL) % (TABLE_SIZE - 1)) + 1;
+	}
+
+	const size_t EMPTY = (size_t)-1;
+	this->table.assign(TABLE_SIZE, EMPTY);
+
+	size_t filled = 0;
+	while(true)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			// next free slot along this member's permutation
+			size_t slot;
+			do
+			{
+				slot = (offset[i] + next[i] * skip[i]) % TABLE_SIZE;
+				next[i]++;
+			}
+			while(this->table[slot] != EMPTY);
+
+			this->table[slot] = i;
+			if(++filled == TABLE_SIZE)
+				return;
+		}
+	}
+}
+
+boost::uint64_t Maglev::hash(const std::string& key, boost::uint64_t seed)
+{
+	// FNV-1a, finished with a murmur3 style mix so consecutive keys spread out
+	boost::uint64_t h = 14695981039346656037ULL ^ seed;
+	for(size_t i = 0; i < key.size(); i++)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
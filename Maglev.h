@@ -0,0 +1,37 @@
+#ifndef MAGLEV_H
+#define MAGLEV_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+// Maglev consistent hashing (Eisenbud et al., NSDI 2016)
+// Every slot of a prime sized table names one member. Members fill the table
+// round robin along their own permutation of it, so each one gets an almost
+// equal share and a membership change only remaps a small share of the slots.
+class Maglev
+{
+public:
+
+	static const size_t TABLE_SIZE = 65537; // prime, should stay > 100 * members
+
+	Maglev(const std::vector<std::string>& members);
+
+	bool empty() const { return this->table.empty(); }
+
+	// member index for a key hash, probe > 0 walks on to the following slots
+	size_t lookup(boost::uint64_t hash, size_t probe = 0) const
+	{
+		return this->table[(size_t)((hash + probe) % TABLE_SIZE)];
+	}
+
+	static boost::uint64_t hash(const std::string& key, boost::uint64_t seed = 0);
+
+private:
+
+	std::vector<size_t> table;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "Memory.h"
+
+#include <vector>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/thread.hpp>
+#include "Clock.h"
+
+namespace
+{
+	const long THROTTLE_STEP = 10; // milliseconds between looks at the pressure
+
+	const char* const NAMES[Memory::CATEGORY_COUNT] =
+	{
+		"io_buffers",
+		"headers",
+		"cache",
+		"logging",
+	};
+
+	const char* const LEVELS[] = { "normal", "shrink", "throttle", "shed" };
+
+	// a thread's counters, only that thread writes them
+	struct Slot
+	{
+		boost::atomic<boost::int64_t> bytes[Memory::CATEGORY_COUNT];
+
+		Slot()
+		{
+			for(int i = 0; i < Memory::CATEGORY_COUNT; i++)
+			{
+				this->bytes[i].store(0, boost::memory_order_relaxed);
+			}
+		}
+	};
+
+	boost::mutex registry_guard;
+	std::vector<Slot*> slots; // every slot handed out, never freed, their bytes still count
+	std::vector<Slot*> idle;  // of threads that ended, the next new thread takes one over
+
+	void retire(Slot* slot)
+	{
+		boost::unique_lock<boost::mutex> lock(registry_guard);
+		idle.push_back(slot);
+	}
+
+	boost::thread_specific_ptr<Slot> current(&retire);
+
+	Slot& own_slot()
+	{
+		Slot* slot = current.get();
+		if(!slot)
+		{
+			{
+				boost::unique_lock<boost::mutex> lock(registry_guard);
+				if(!idle.empty())
+				{
+					slot = idle.back();
+					idle.pop_back();
+				}
+				else
+				{
+					slot = new Slot;
+					slots.push_back(slot);
+				}
+			}
+			current.reset(slot);
+		}
+		return *slot;
+	}
+
+	void adjust(Memory::Category category, boost::int64_t delta)
+	{
+		// no read-modify-write needed with a single writer
+		boost::atomic<boost::int64_t>& bytes = own_slot().bytes[category];
+		bytes.store(bytes.load(boost::memory_order_relaxed) + delta, boost::memory_order_relaxed);
+	}
+
+	// per category, over every slot
+	void sum(boost::uint64_t totals[Memory::CATEGORY_COUNT])
+	{
+		boost::int64_t bytes[Memory::CATEGORY_COUNT] = { 0 };
+		{
+			boost::unique_lock<boost::mutex> lock(registry_guard);
+			for(size_t i = 0; i < slots.size(); i++)
+			{
+				for(int c = 0; c < Memory::CATEGORY_COUNT; c++)
+				{
+					bytes[c] += slots[i]->bytes[c].load(boost::memory_order_relaxed);
+				}
+			}
+		}
+
+		// a release counted before its add may leave a sum below 0 for a moment
+		for(int c = 0; c < Memory::CATEGORY_COUNT; c++)
+		{
+			totals[c] = bytes[c] > 0 ? (boost::uint64_t)bytes[c] : 0;
+		}
+	}
+
+	boost::atomic<boost::uint64_t> budget(0);
+
+	// the last sum, shared by everybody asking within REFRESH_INTERVAL
+	boost::atomic<boost::uint64_t> refreshed(0); // Clock::now()
+	boost::atomic<int> level(Memory::NORMAL);
+}
+
+void Memory::set_budget(boost::uint64_t bytes)
+{
+	budget.store(bytes, boost::memory_order_relaxed);
+	refreshed.store(0, boost::memory_order_relaxed);
+	level.store(NORMAL, boost::memory_order_relaxed);
+}
+
+boost::uint64_t Memory::get_budget()
+{
+	return budget.load(boost::memory_order_relaxed);
+}
+
+void Memory::add(Category category, size_t bytes)
+{
+	adjust(category, (boost::int64_t)bytes);
+}
+
+void Memory::release(Category category, size_t bytes)
+{
+	adjust(category, -(boost::int64_t)bytes);
+}
+
+boost::uint64_t Memory::usage(Category category)
+{
+	boost::uint64_t totals[CATEGORY_COUNT];
+	sum(totals);
+	return totals[category];
+}
+
+boost::uint64_t Memory::total()
+{
+	boost::uint64_t totals[CATEGORY_COUNT];
+	sum(totals);
+
+	boost::uint64_t bytes = 0;
+	for(int i = 0; i < CATEGORY_COUNT; i++)
+	{
+		bytes += totals[i];
+	}
+	return bytes;
+}
+
+Memory::Pressure Memory::pressure()
+{
+	const boost::uint64_t limit = budget.load(boost::memory_order_relaxed);
+	if(limit == 0)
+		return NORMAL;
+
+	// whoever comes by first after the interval sums up, a second one doing the same does no harm
+	const boost::uint64_t now = Clock::now();
+	if(now - refreshed.load(boost::memory_order_relaxed) >= REFRESH_INTERVAL)
+	{
+		refreshed.store(now, boost::memory_order_relaxed);
+
+		const boost::uint64_t bytes = total();
+
+		Pressure current = NORMAL;
+		if(bytes * 100 >= limit * SHED_PERCENT)
+			current = SHED;
+		else if(bytes * 100 >= limit * THROTTLE_PERCENT)
+			current = THROTTLE;
+		else if(bytes * 100 >= limit * SHRINK_PERCENT)
+			current = SHRINK;
+		level.store(current, boost::memory_order_relaxed);
+	}
+
+	return (Pressure)level.load(boost::memory_order_relaxed);
+}
+
+boost::uint64_t Memory::excess()
+{
+	const boost::uint64_t limit = budget.load(boost::memory_order_relaxed);
+	if(limit == 0)
+		return 0;
+
+	// summed up afresh, what was just freed mustn't be freed twice
+	const boost::uint64_t target = limit / 100 * SHRINK_TARGET_PERCENT;
+	const boost::uint64_t bytes = total();
+	return bytes > target ? bytes - target : 0;
+}
+
+bool Memory::throttle(boost::uint64_t max_wait)
+{
+	if(pressure() < THROTTLE)
+		return false;
+
+	// what we don't read stays in the socket buffer, TCP slows the sender down
+	const boost::uint64_t start = Clock::now();
+	do
+	{
+		boost::this_thread::sleep(boost::posix_time::milliseconds(THROTTLE_STEP));
+	}
+	while(pressure() >= THROTTLE && Clock::now() - start < max_wait);
+
+	return true;
+}
+
+void Memory::report(std::ostream& out)
+{
+	boost::uint64_t totals[CATEGORY_COUNT];
+	sum(totals);
+
+	boost::uint64_t bytes = 0;
+	for(int i = 0; i < CATEGORY_COUNT; i++)
+	{
+		out << "memory_" << NAMES[i] << ' ' << totals[i] << '\n';
+		bytes += totals[i];
+	}
+	out << "memory_used " << bytes << '\n'
+	    << "memory_budget " << get_budget() << '\n'
+	    << "memory_pressure " << LEVELS[pressure()] << '\n';
+}
+
+void Memory::Charge::resize(size_t bytes)
+{
+	if(bytes > this->bytes)
+		Memory::add(this->category, bytes - this->bytes);
+	else if(bytes < this->bytes)
+		Memory::release(this->category, this->bytes - bytes);
+	this->bytes = bytes;
+}
@@ -0,0 +1,85 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+// Process wide memory budget, split by what the memory is used for
+// Every thread counts into a slot of its own, the totals are only summed up when
+// somebody asks for them (at most once per REFRESH_INTERVAL for pressure()).
+// Bytes may be released on another thread than they were added on, a slot
+// alone can go negative, the sums can't.
+class Memory
+{
+public:
+
+	enum Category
+	{
+		IO_BUFFERS, // relay buffers, bodies kept for sharing, compressing or scanning
+		HEADERS,    // request and response headers held by connections
+		CACHE,
+		LOGGING,    // access log lines waiting to be written
+
+		CATEGORY_COUNT
+	};
+
+	// what to do about it, each level includes the ones before it
+	enum Pressure
+	{
+		NORMAL,
+		SHRINK,   // evict from caches, flush logs early
+		THROTTLE, // hold back reading from producers
+		SHED      // turn new connections away
+	};
+
+	static const boost::uint64_t REFRESH_INTERVAL = 10000U; // microseconds
+	// share of the budget (percent) at which each level kicks in
+	static const unsigned int SHRINK_PERCENT = 80U;
+	static const unsigned int THROTTLE_PERCENT = 90U;
+	static const unsigned int SHED_PERCENT = 100U;
+	static const unsigned int SHRINK_TARGET_PERCENT = 70U; // shrinking goes down to this
+
+	// bytes, 0 for no limit
+	static void set_budget(boost::uint64_t bytes);
+	static boost::uint64_t get_budget();
+
+	static void add(Category category, size_t bytes);
+	static void release(Category category, size_t bytes);
+
+	static boost::uint64_t usage(Category category);
+	static boost::uint64_t total();
+
+	static Pressure pressure();
+	// bytes above SHRINK_TARGET_PERCENT right now, 0 below it
+	static boost::uint64_t excess();
+
+	// waits while the pressure is at THROTTLE or above, at most max_wait microseconds
+	// returns true if it waited at all
+	static bool throttle(boost::uint64_t max_wait = 1000000U);
+
+	// "memory_..." lines for the status page
+	static void report(std::ostream& out);
+
+	// bytes of a category held for as long as it lives
+	class Charge : boost::noncopyable
+	{
+	public:
+
+		explicit Charge(Category category, size_t bytes = 0) : category(category), bytes(0) { this->resize(bytes); }
+		~Charge() { this->resize(0); }
+
+		void resize(size_t bytes);
+		size_t size() const { return this->bytes; }
+
+	private:
+
+		Category category;
+		size_t bytes;
+	};
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "Prefetch.h"
+
+#include <cstring>
+#include <cctype>
+#include "Stats.h"
+
+namespace
+{
+	std::string lower(const std::string& s)
+	{
+		std::string result = s;
+		for(size_t i = 0; i < result.size(); i++)
+		{
+			result[i] = (char)std::tolower((unsigned char)result[i]);
+		}
+		return result;
+	}
+
+	bool space(char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+	}
+
+	// "http://host" part of an absolute URL, empty if it isn't one
+	std::string origin(const std::string& url)
+	{
+		if(url.size() < 8 || lower(url.substr(0, 7)) != "http://")
+			return std::string();
+		const size_t end = url.find_first_of("/?#", 7);
+		return lower(url.substr(0, end));
+	}
+
+	// removes "." and ".." segments of an absolute path, the query is left alone
+	std::string normalize(const std::string& path)
+	{
+		const size_t query = path.find('?');
+		const std::string segments = path.substr(0, query);
+
+		std::vector<std::string> kept;
+		size_t pos = 1;
+		while(pos <= segments.size())
+		{
+			size_t end = segments.find('/', pos);
+			if(end == std::string::npos)
+				end = segments.size();
+
+			const std::string segment = segments.substr(pos, end - pos);
+			if(segment == "..")
+			{
+				if(!kept.empty())
+					kept.pop_back();
+				if(end == segments.size())
+					kept.push_back(std::string()); // "a/.." ends in a directory
+			}
+			else if(segment == ".")
+			{
+				if(end == segments.size())
+					kept.push_back(std::string());
+			}
+			else
+			{
+				kept.push_back(segment);
+			}
+			pos = end + 1;
+		}
+
+		std::string result;
+		for(size_t i = 0; i < kept.size(); i++)
+		{
+			result += '/' + kept[i];
+		}
+		if(result.empty())
+			result = "/";
+
+		return query == std::string::npos ? result : result + path.substr(query);
+	}
+}
+
+LinkScanner::LinkScanner(bool gzip) : ready(true), gzip(gzip), scanned(0), in_tag(false), quote(0)
+{
+	if(gzip)
+	{
+#ifdef HAVE_ZLIB
+		std::memset(&this->stream, 0, sizeof(this->stream));
+		this->ready = inflateInit2(&this->stream, 15 + 16) == Z_OK; // gzip wrapper only
+#else
+		this->ready = false;
+#endif
+	}
+}
+
+LinkScanner::~LinkScanner()
+{
+#ifdef HAVE_ZLIB
+	if(this->gzip && this->ready)
+	{
+		inflateEnd(&this->stream);
+	}
+#endif
+}
+
+void LinkScanner::feed(const char* data, size_t size)
+{
+	if(this->done())
+		return;
+
+	if(!this->gzip)
+	{
+		this->scan(data, size);
+		return;
+	}
+
+#ifdef HAVE_ZLIB
+	char out[4096];
+	this->stream.next_in = (Bytef*)data;
+	this->stream.avail_in = (uInt)size;
+	while(this->stream.avail_in > 0 && !this->done())
+	{
+		this->stream.next_out = (Bytef*)out;
+		this->stream.avail_out = sizeof(out);
+
+		const int result = inflate(&this->stream, Z_NO_FLUSH);
+		this->scan(out, sizeof(out) - this->stream.avail_out);
+
+		if(result != Z_OK)
+		{
+			// end of the stream, or garbage
+			inflateEnd(&this->stream);
+			this->ready = false;
+			break;
+		}
+	}
+#endif
+}
+
+void LinkScanner::scan(const char* data, size_t size)
+{
+	if(size > MAX_SCAN - this->scanned)
+		size = MAX_SCAN - this->scanned;
+	this->scanned += size;
+
+	for(size_t i = 0; i < size && this->links.size() < MAX_LINKS; i++)
+	{
+		const char c = data[i];
+		if(!this->in_tag)
+		{
+			if(c == '<')
+			{
+				this->in_tag = true;
+				this->quote = 0;
+				this->tag.clear();
+			}
+		}
+		else if(c == '>' && this->quote == 0)
+		{
+			this->in_tag = false;
+			this->parse_tag();
+		}
+		else if(this->tag.size() < MAX_TAG)
+		{
+			// attribute values may contain '>'
+			if(c == '"' || c == '\'')
+				this->quote = this->quote == 0 ? c : (this->quote == c ? 0 : this->quote);
+			this->tag += c;
+		}
+		else
+		{
+			this->in_tag = false; // not a tag we care about
+		}
+	}
+}
+
+void LinkScanner::parse_tag()
+{
+	size_t pos = 0;
+	while(pos < this->tag.size() && !space(this->tag[pos]) && this->tag[pos] != '/')
+		pos++;
+	const std::string name = lower(this->tag.substr(0, pos));
+
+	if(name != "link" && name != "script" && name != "img")
+		return;
+
+	// attribute names and values, unquoted ones end at whitespace
+	std::map<std::string, std::string> attributes;
+	while(pos < this->tag.size())
+	{
+		while(pos < this->tag.size() && (space(this->tag[pos]) || this->tag[pos] == '/'))
+			pos++;
+		const size_t name_start = pos;
+		while(pos < this->tag.size() && !space(this->tag[pos]) && this->tag[pos] != '=' && this->tag[pos] != '/')
+			pos++;
+		const std::string attribute = lower(this->tag.substr(name_start, pos - name_start));
+
+		while(pos < this->tag.size() && space(this->tag[pos]))
+			pos++;
+		std::string value;
+		if(pos < this->tag.size() && this->tag[pos] == '=')
+		{
+			pos++;
+			while(pos < this->tag.size() && space(this->tag[pos]))
+				pos++;
+			if(pos < this->tag.size() && (this->tag[pos] == '"' || this->tag[pos] == '\''))
+			{
+				const char quote = this->tag[pos++];
+				const size_t end = this->tag.find(quote, pos);
+				if(end == std::string::npos)
+					return; // broken
+				value = this->tag.substr(pos, end - pos);
+				pos = end + 1;
+			}
+			else
+			{
+				const size_t value_start = pos;
+				while(pos < this->tag.size() && !space(this->tag[pos]))
+					pos++;
+				value = this->tag.substr(value_start, pos - value_start);
+			}
+		}
+		if(!attribute.empty())
+		{
+			attributes.insert(std::make_pair(attribute, value));
+		}
+		else if(pos < this->tag.size())
+		{
+			pos++; // stray character
+		}
+	}
+
+	std::string link;
+	if(name == "link")
+	{
+		// rel is a list of keywords, "preload" goes with as= for anything
+		std::string rel = ' ' + lower(attributes["rel"]) + ' ';
+		for(size_t i = 0; i < rel.size(); i++)
+		{
+			if(space(rel[i]))
+				rel[i] = ' ';
+		}
+		if(rel.find(" stylesheet ") != std::string::npos || rel.find(" preload ") != std::string::npos)
+		{
+			link = attributes["href"];
+		}
+	}
+	else
+	{
+		link = attributes["src"];
+	}
+
+	// the only entity that's common in URLs
+	size_t amp = link.find("&amp;");
+	while(amp != std::string::npos)
+	{
+		link.replace(amp, 5, "&");
+		amp = link.find("&amp;", amp + 1);
+	}
+
+	if(!link.empty())
+	{
+		for(size_t i = 0; i < this->links.size(); i++)
+		{
+			if(this->links[i] == link)
+				return;
+		}
+		this->links.push_back(link);
+	}
+}
+
+std::string LinkScanner::resolve(const std::string& page, const std::string& link)
+{
+	const std::string page_origin = origin(page);
+	if(page_origin.empty())
+		return std::string();
+
+	size_t first = 0;
+	size_t last = link.size();
+	while(first < last && space(link[first]))
+		first++;
+	while(last > first && space(link[last - 1]))
+		last--;
+	std::string target = link.substr(first, last - first);
+	target = target.substr(0, target.find('#'));
+	if(target.empty())
+		return std::string();
+
+	for(size_t i = 0; i < target.size(); i++)
+	{
+		// would need escaping on the request line, leave it to the client
+		if((unsigned char)target[i] <= ' ' || (unsigned char)target[i] >= 0x7f)
+			return std::string();
+	}
+
+	std::string url;
+	const size_t scheme = target.find(':');
+	if(target.compare(0, 2, "//") == 0)
+	{
+		url = "http:" + target;
+	}
+	else if(scheme != std::string::npos && scheme < target.find_first_of("/?"))
+	{
+		url = target; // https:, data: and friends don't match below
+	}
+	else if(target[0] == '/')
+	{
+		url = page_origin + target;
+	}
+	else
+	{
+		// relative to the page's directory
+		const std::string path = page.substr(page_origin.size(), page.find_first_of("?#", page_origin.size()) - page_origin.size());
+		const size_t slash = path.rfind('/');
+		url = page_origin + (slash == std::string::npos ? "/" : path.substr(0, slash + 1)) + target;
+	}
+
+	if(origin(url) != page_origin)
+		return std::string();
+
+	const std::string path = url.substr(page_origin.size());
+	return page_origin + normalize(path.empty() || path[0] != '/' ? '/' + path : path);
+}
+
+PrefetchTracker::PrefetchTracker()
+{
+}
+
+void PrefetchTracker::fetched(const std::string& key)
+{
+	const time_t now = std::time(NULL);
+
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	std::map<std::string, Slot>::iterator it = this->slots.find(key);
+	if(it != this->slots.end())
+	{
+		this->order.erase(it->second.order);
+		this->slots.erase(it);
+		Stats::increment(Stats::PREFETCH_WASTED); // fetched again before anybody wanted it
+	}
+
+	Slot slot;
+	slot.fetched = now;
+	slot.order = this->order.insert(this->order.end(), key);
+	this->slots.insert(std::make_pair(key, slot));
+
+	this->expire(now);
+}
+
+bool PrefetchTracker::claim(const std::string& key)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	this->expire(std::time(NULL));
+
+	std::map<std::string, Slot>::iterator it = this->slots.find(key);
+	if(it == this->slots.end())
+		return false;
+
+	this->order.erase(it->second.order);
+	this->slots.erase(it);
+	Stats::increment(Stats::PREFETCH_USED);
+	return true;
+}
+
+void PrefetchTracker::expire(time_t now)
+{
+	while(!this->order.empty())
+	{
+		std::map<std::string, Slot>::iterator it = this->slots.find(this->order.front());
+		if(this->slots.size() <= MAX_TRACKED && now - it->second.fetched < WINDOW)
+			break;
+
+		this->slots.erase(it);
+		this->order.pop_front();
+		Stats::increment(Stats::PREFETCH_WASTED);
+	}
+}
@@ -0,0 +1,95 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <list>
+#include <ctime>
+#include <boost/thread/mutex.hpp>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// Picks subresource URLs out of an HTML body as it streams past:
+// <link rel=stylesheet/preload href>, <script src> and <img src>
+// A gzip body is inflated first, that needs HAVE_ZLIB.
+class LinkScanner
+{
+public:
+
+	static const size_t MAX_LINKS = 16U;
+	static const size_t MAX_SCAN = 256U * 1024U; // decoded bytes, links further down are left to the client
+	static const size_t MAX_TAG = 1024U;         // longer tags are skipped
+
+	explicit LinkScanner(bool gzip = false);
+	~LinkScanner();
+
+	// false if a gzip body can't be decoded here
+	bool usable() const { return this->ready; }
+
+	void feed(const char* data, size_t size);
+	bool done() const { return !this->ready || this->scanned >= MAX_SCAN || this->links.size() >= MAX_LINKS; }
+
+	// as they appear in the page, duplicates removed
+	const std::vector<std::string>& get_links() const { return this->links; }
+
+	// absolute "http://host/path" URL of a link on the page's origin, empty for anything else
+	static std::string resolve(const std::string& page, const std::string& link);
+
+private:
+
+	bool ready;
+	bool gzip;
+	size_t scanned;
+	bool in_tag;
+	char quote; // inside an attribute value in quotes
+	std::string tag;
+	std::vector<std::string> links;
+
+#ifdef HAVE_ZLIB
+	z_stream stream;
+#endif
+
+	void scan(const char* data, size_t size);
+	void parse_tag();
+};
+
+// Keeps prefetched cache keys until a client asks for them (used) or they
+// sat there unclaimed for WINDOW seconds (wasted)
+class PrefetchTracker
+{
+public:
+
+	static const long WINDOW = 60;           // seconds
+	static const size_t MAX_TRACKED = 4096U; // beyond that the oldest count as wasted
+
+	PrefetchTracker();
+
+	void fetched(const std::string& key);
+	// true the first time a prefetched key is asked for
+	bool claim(const std::string& key);
+
+private:
+
+	typedef std::list<std::string> Order;
+
+	struct Slot
+	{
+		time_t fetched;
+		Order::iterator order;
+	};
+
+	std::map<std::string, Slot> slots;
+	Order order; // oldest first
+
+	boost::mutex guard;
+
+	// lock held
+	void expire(time_t now);
+};
+
+#endif
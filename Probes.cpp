@@ -0,0 +1,25 @@
+#include "Probes.h"
+
+#include <boost/thread/tss.hpp>
+
+namespace
+{
+	boost::thread_specific_ptr<boost::uint64_t> current;
+}
+
+void Probes::set_connection(boost::uint64_t id)
+{
+	if(!current.get())
+	{
+		current.reset(new boost::uint64_t(id));
+	}
+	else
+	{
+		*current = id;
+	}
+}
+
+boost::uint64_t Probes::connection()
+{
+	return current.get() ? *current : 0;
+}
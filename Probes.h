@@ -0,0 +1,57 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+#pragma once
+
+#include <boost/cstdint.hpp>
+
+// USDT (SystemTap/DTrace style) static probes, provider "http_proxy"
+// Built with HAVE_SDT (needs systemtap's sys/sdt.h) a probe is a single nop
+// until a tracer attaches to it, without HAVE_SDT the macros expand to nothing.
+// Every probe's first argument is the id of the client connection the calling
+// thread is working on (0 outside of one). See probes/*.bt for bpftrace scripts.
+//
+//  accept            (conn, queued)           accepted and queued
+//  dequeue           (conn, sojourn_us)       picked up by a worker thread
+//  auth              (conn, ok)               Proxy-Authorization checked
+//  dns_start         (conn)
+//  dns_end           (conn, ok)
+//  connect_start     (conn)
+//  connect_end       (conn, failure)          CircuitBreaker::Failure, 0 is success
+//  header_complete   (conn, response, bytes)  response is 0 for requests, 1 for responses
+//  first_body_byte   (conn, response)
+//  message_complete  (conn, response, bytes)  header and body relayed, complete or not
+//  close             (conn, requests)         done with the client connection
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define PROXY_PROBE(name) \
+	DTRACE_PROBE1(http_proxy, name, Probes::connection())
+#define PROXY_PROBE1(name, a) \
+	DTRACE_PROBE2(http_proxy, name, Probes::connection(), a)
+#define PROXY_PROBE2(name, a, b) \
+	DTRACE_PROBE3(http_proxy, name, Probes::connection(), a, b)
+#define PROXY_PROBE_CONNECTION(id) \
+	Probes::set_connection(id)
+
+#else
+
+#define PROXY_PROBE(name)
+#define PROXY_PROBE1(name, a)
+#define PROXY_PROBE2(name, a, b)
+#define PROXY_PROBE_CONNECTION(id)
+
+#endif
+
+class Probes
+{
+public:
+
+	// the client connection the calling thread is working on
+	static void set_connection(boost::uint64_t id);
+	static boost::uint64_t connection();
+};
+
+#endif
@@ -5,13 +5,192 @@
 #include <string>
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <cctype>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
 #include "Message.h"
+#include "Stats.h"
+#include "Clock.h"
+#include "Probes.h"
+#include <ctime>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+const char* const Proxy::DEFAULT_STATUS_PATH = "/roxy-status";
+
+namespace
+{
+	// HTTP/2 has no reason phrases, HTTP/1.1 allows them to be empty
+	const char* reason_phrase(int status)
+	{
+		switch(status)
+		{
+		case 200: return "OK";
+		case 201: return "Created";
+		case 204: return "No Content";
+		case 206: return "Partial Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 303: return "See Other";
+		case 304: return "Not Modified";
+		case 307: return "Temporary Redirect";
+		case 308: return "Permanent Redirect";
+		case 400: return "Bad Request";
+		case 401: return "Unauthorized";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 429: return "Too Many Requests";
+		case 500: return "Internal Server Error";
+		case 502: return "Bad Gateway";
+		case 503: return "Service Unavailable";
+		case 504: return "Gateway Timeout";
+		default:  return "";
+		}
+	}
+
+	std::string lower(const std::string& s)
+	{
+		std::string result = s;
+		for(size_t i = 0; i < result.size(); i++)
+		{
+			result[i] = (char)std::tolower((unsigned char)result[i]);
+		}
+		return result;
+	}
+}
 
-Proxy::Proxy(SocketAddress::port_t port, const std::vector<Authentication>& auth)
+Proxy::Proxy(SocketAddress::port_t port, const std::vector<Authentication>& auth) :
+	incoming_connections(FAIR_QUANTUM),
+	incoming_codel(CODEL_TARGET, CODEL_INTERVAL)
 {
 	this->port = port;
+	this->workers = 0;
 	this->auth = auth;
 	this->stop_listening = false;
+	this->pipeline_depth = 1;
+	this->compress_min_size = 0;
+	this->slice_size = 0;
+	this->trace_start = 0;
+
+	this->incoming_connections.set_capacity(DEFAULT_MAX_QUEUED);
+	this->shed_response = true;
+
+	this->hedge_percentile = 0.0;
+	this->hedge_budget = 0.0;
+	this->hedge_tokens = 0.0;
+
+	// Nagle only delays our already buffered writes
+	this->listener_tuning.no_delay = true;
+	this->listener_tuning.reuse_address = true;
+	this->listener_tuning.defer_accept = KEEPALIVE_TIMEOUT; // wake up accept() once the request arrives
+	this->listener_tuning.accept_flags = Socket::CLOEXEC;
+
+	this->upstream_tuning.no_delay = true;
+}
+
+void Proxy::enable_cache(size_t capacity, long grace)
+{
+	// finish refreshes and prefetches against the old cache first
+	const bool prefetching = this->prefetcher.get() != NULL;
+	const bool slicing = this->slicer.get() != NULL;
+	this->slicer.reset();
+	this->prefetcher.reset();
+	this->refresher.reset();
+	this->cache.reset(new Cache(capacity, grace));
+	this->inflight.set_limit(this->cache->max_entry()); // whatever is bigger can't be stored
+	this->refresher.reset(new WorkerPool(REFRESH_THREADS, REFRESH_QUEUE));
+	if(prefetching)
+	{
+		this->prefetcher.reset(new WorkerPool(PREFETCH_THREADS, PREFETCH_QUEUE));
+	}
+	if(slicing)
+	{
+		this->slicer.reset(new WorkerPool(SLICE_THREADS, SLICE_QUEUE));
+	}
+}
+
+void Proxy::enable_slicing(size_t slice_size)
+{
+	this->slice_size = slice_size;
+	this->slicer.reset(slice_size > 0 ? new WorkerPool(SLICE_THREADS, SLICE_QUEUE) : NULL);
+}
+
+bool Proxy::enable_prefetch()
+{
+	if(!this->cache)
+	{
+		Message::warning() << "prefetching needs the cache, it stays off" << '\n';
+		return false;
+	}
+
+	this->prefetcher.reset(new WorkerPool(PREFETCH_THREADS, PREFETCH_QUEUE));
+	return true;
+}
+
+bool Proxy::enable_compression(size_t min_size)
+{
+	if(!Compressor::available())
+	{
+		Message::warning() << "built without zlib, compression stays off" << '\n';
+		return false;
+	}
+
+	this->compress_min_size = min_size > 0 ? min_size : 1;
+	return true;
+}
+
+bool Proxy::enable_tls(const TlsSettings& settings)
+{
+	if(!TlsClient::available())
+	{
+		Message::warning() << "built without OpenSSL, TLS upstreams are unreachable" << '\n';
+		return false;
+	}
+
+	boost::scoped_ptr<TlsClient> client(new TlsClient);
+	if(!client->init(settings))
+	{
+		return false;
+	}
+
+	this->tls.swap(client);
+	return true;
+}
+
+bool Proxy::enable_access_log(const std::string& path)
+{
+	boost::scoped_ptr<AccessLog> log(new AccessLog);
+	if(!log->open(path))
+	{
+		Message::error() << "can't open access log " << path << '\n';
+		return false;
+	}
+
+	this->access_log.swap(log);
+	return true;
+}
+
+bool Proxy::enable_capture(const std::string& path, size_t capacity)
+{
+	boost::scoped_ptr<TraceFile> file(new TraceFile);
+	if(!file->create(path, capacity))
+	{
+		Message::error() << "can't create trace " << path << '\n';
+		return false;
+	}
+
+	this->trace_start = Clock::now();
+	this->trace.swap(file);
+	return true;
 }
 
 bool Proxy::listen(unsigned int max_incoming)
@@ -24,6 +203,11 @@ bool Proxy::listen(unsigned int max_incoming)
 		return false;
 	}
 
+	if(!s_server.tune(this->listener_tuning, true))
+	{
+		Message::warning() << "some listener socket options are unsupported" << '\n';
+	}
+
 	SocketAddress server_addr(SocketAddress::INET, Address() /*INADDR_ANY*/, this->port);
 
 	// Assign address and port to socket
@@ -57,7 +241,15 @@ bool Proxy::listen(unsigned int max_incoming)
 	std::cout << "Listening at " << hostIP << ":" << this->port << '\n';
 	std::cout << "CTRL+C to exit" << '\n' << '\n';
 
+	if(this->workers > 0 && !this->prefork())
+	{
+		// the master is done, its workers are gone
+		s_server.close();
+		return true;
+	}
+
 	boost::thread_group threads;
+	boost::uint64_t accepted = 0;
 	for(int i = 0; i < max_incoming; i++)
 	{
 		threads.create_thread(boost::bind(&Proxy::thread_handle_connection, this, i+1));
@@ -66,10 +258,36 @@ bool Proxy::listen(unsigned int max_incoming)
 	while(!this->stop_listening)
 	{
 		// wait for incoming connections and pass them to the worker threads
-		Socket s_connection = s_server.accept();
+		SocketAddress client_addr;
+		Socket s_connection = s_server.accept(&client_addr, this->listener_tuning.accept_flags);
 		if(s_connection.valid())
 		{
-			this->enqueue_incoming(s_connection);
+			// accepted sockets don't reliably inherit TCP level options
+			if(this->listener_tuning.no_delay)
+				s_connection.set_no_delay(true);
+			if(this->listener_tuning.keep_alive)
+				s_connection.set_keep_alive(true);
+
+			accepted++;
+			PROXY_PROBE_CONNECTION(accepted);
+
+			// what the cache gives up may be enough, otherwise new connections wait until memory is back
+			const Memory::Pressure pressure = Memory::pressure();
+			if(pressure >= Memory::SHRINK)
+			{
+				this->relieve_memory();
+			}
+			if(pressure == Memory::SHED)
+			{
+				Stats::increment(Stats::SHED_MEMORY);
+				this->shed(s_connection);
+			}
+			else if(!this->enqueue_incoming(s_connection, accepted, client_addr.getAddress().toPresentation()))
+			{
+				// hard limit, the queue is full
+				Stats::increment(Stats::SHED_QUEUE_FULL);
+				this->shed(s_connection);
+			}
 		}
 	}
 
@@ -87,43 +305,251 @@ void Proxy::interrupt()
 	this->stop_listening = true;
 }
 
+bool Proxy::prefork()
+{
+#ifdef _WIN32
+	Message::warning() << "no worker processes on Windows, serving from this one" << '\n';
+	return true;
+#else
+	// only the forking thread makes it into a worker, the workers start their own pools
+	const bool refreshing = this->refresher.get() != NULL;
+	const bool prefetching = this->prefetcher.get() != NULL;
+	const bool slicing = this->slicer.get() != NULL;
+	this->slicer.reset();
+	this->prefetcher.reset();
+	this->refresher.reset();
+
+	if(!Stats::share())
+	{
+		Message::warning() << "counters can't be shared, every worker keeps its own" << '\n';
+	}
+	if(this->cache && !this->cache->share())
+	{
+		Message::warning() << "the cache can't be shared, every worker keeps its own" << '\n';
+	}
+	if(this->cache)
+	{
+		this->inflight.set_limit(this->cache->max_entry());
+	}
+	if(this->trace)
+	{
+		// the file's write position is per process, workers would overwrite each other's records
+		Message::warning() << "capturing stays off with worker processes" << '\n';
+		this->trace.reset();
+	}
+
+	const pid_t master = ::getpid();
+	std::map<pid_t, boost::uint64_t> running; // Clock::now() when started
+
+	while(!this->stop_listening)
+	{
+		while(running.size() < this->workers)
+		{
+			const pid_t pid = ::fork();
+			if(pid == 0)
+			{
+#ifdef __linux__
+				::prctl(PR_SET_PDEATHSIG, SIGTERM); // don't outlive the master
+#endif
+				if(::getppid() != master)
+				{
+					::_exit(EXIT_SUCCESS); // it's gone already
+				}
+
+				if(refreshing)
+					this->refresher.reset(new WorkerPool(REFRESH_THREADS, REFRESH_QUEUE));
+				if(prefetching)
+					this->prefetcher.reset(new WorkerPool(PREFETCH_THREADS, PREFETCH_QUEUE));
+				if(slicing)
+					this->slicer.reset(new WorkerPool(SLICE_THREADS, SLICE_QUEUE));
+				return true;
+			}
+			if(pid < 0)
+			{
+				Message::error() << "fork failed" << '\n';
+				break; // try again later
+			}
+
+			running[pid] = Clock::now();
+			Message::info() << "worker " << pid << " started" << '\n';
+		}
+
+		int status = 0;
+		const pid_t pid = ::waitpid(-1, &status, WNOHANG);
+		if(pid <= 0)
+		{
+			boost::this_thread::sleep(boost::posix_time::milliseconds(WORKER_POLL));
+			continue;
+		}
+
+		std::map<pid_t, boost::uint64_t>::iterator it = running.find(pid);
+		if(it == running.end())
+			continue;
+
+		const boost::uint64_t uptime = Clock::now() - it->second;
+		running.erase(it);
+
+		if(WIFSIGNALED(status))
+			Message::error() << "worker " << pid << " killed by signal " << WTERMSIG(status) << '\n';
+		else
+			Message::warning() << "worker " << pid << " exited with " << WEXITSTATUS(status) << '\n';
+
+		// one that dies right away most likely dies again, don't spin on it
+		if(uptime < WORKER_MIN_UPTIME)
+		{
+			boost::this_thread::sleep(boost::posix_time::milliseconds(WORKER_RESTART_DELAY));
+		}
+	}
+
+	for(std::map<pid_t, boost::uint64_t>::const_iterator it = running.begin(); it != running.end(); ++it)
+	{
+		::kill(it->first, SIGTERM);
+	}
+	for(std::map<pid_t, boost::uint64_t>::const_iterator it = running.begin(); it != running.end(); ++it)
+	{
+		::waitpid(it->first, NULL, 0);
+	}
+
+	return false;
+#endif
+}
+
 bool Proxy::thread_handle_connection(int tid)
 {
 	while(true)
 	{
-		Socket s_client, s_server;
+		FairQueue::Item incoming;
 
 		try
 		{
-			s_client = this->request_incoming();
+			incoming = this->request_incoming();
 		}
 		catch(boost::thread_interrupted)
 		{
 			break;
 		}
 
-		http::Request request;
-		http::Response response;
+		const boost::uint64_t start = Clock::now();
+
+		PROXY_PROBE_CONNECTION(incoming.id);
+		PROXY_PROBE1(dequeue, start - incoming.enqueued);
+
+		this->handle_connection(incoming.socket, incoming.id, incoming.client);
 
-		bool keep_alive = false;
+		incoming.socket.close();
 
-		do
+		PROXY_PROBE_CONNECTION(0);
+
+		this->finish_incoming(incoming.client, Clock::now() - start);
+	}
+
+	return true;
+}
+
+void Proxy::handle_connection(Socket s_client, boost::uint64_t id, const std::string& client)
+{
+	Socket s_server;
+	std::string server_host;
+
+	// latest TCP_INFO of both sides, resampled at most once per Telemetry::SAMPLE_INTERVAL
+	const std::string client_subnet = Telemetry::subnet(client);
+	TcpInfo client_tcp, origin_tcp;
+	boost::uint64_t client_sampled = 0, origin_sampled = 0;
+
+	// unshaped connections skip pacing altogether
+	Shaper::Flow flow;
+	const bool shaped = this->shaper.enabled();
+	if(shaped)
+	{
+		this->shaper.open(flow);
+	}
+
+	CapturingRequest request;
+	CapturingResponse response;
+
+	// requests forwarded upstream and still waiting for their response, oldest first
+	std::deque<PendingRequest> pending;
+
+	std::string request_header;
+	bool request_ready = false; // parsed but not forwarded yet
+	bool request_denied = false; // by the ACL
+	bool client_open = true;
+	bool keep_alive = true;
+	unsigned int requests = 0;
+	boost::uint64_t received = 0; // Clock::now() when the request header was in
+
+	// the headers this connection holds on to, recounted every round
+	Memory::Charge headers(Memory::HEADERS);
+
+	while(keep_alive)
+	{
+		size_t header_bytes = request_header.size();
+		for(std::deque<PendingRequest>::const_iterator it = pending.begin(); it != pending.end(); ++it)
+		{
+			header_bytes += it->header.size();
+		}
+		headers.resize(header_bytes);
+
+		if(!request_ready && client_open)
 		{
-			std::string request_header = this->receive_message_header(request, s_client);
-			if(!request.headers_complete())
+			// with requests in flight only pick up what the client already pipelined
+			bool read_ahead = pending.empty() ||
+				(pending.size() < this->pipeline_depth && pending.back().keep_alive && s_client.select_read(0));
+
+			if(read_ahead)
 			{
-				Message::error() << "Invalid request header" << '\n';
-				//std::ofstream file("invalid_request.txt");
-				//file << request_header << std::endl;
-				break;
+				// HTTP/2 upstreams get the body in DATA frames, so it has to be decoded
+				request.capture(!this->http2_origins.empty());
+				request_header = this->receive_message_header(request, s_client);
+				if(request.headers_complete())
+				{
+					request_ready = true;
+					received = Clock::now();
+					request_denied = this->acl_denies(request);
+				}
+				else
+				{
+					client_open = false;
+					if(pending.empty())
+					{
+						Message::error() << "Invalid request header" << '\n';
+						//std::ofstream file("invalid_request.txt");
+						//file << request_header << std::endl;
+						break;
+					}
+				}
 			}
+		}
+
+		// forward proxy: the Host header, reverse proxy: a backend of the route's pool
+		BackendPtr backend;
+		std::string host;
+		if(request_ready)
+		{
+			host = this->upstream_host(request, backend);
+		}
 
+		// a request that can't join the pipeline waits until everything before it is answered
+		if(request_ready && (pending.empty() || (pending.back().pipelined && this->pipelinable(request) && host == server_host && !request_denied)))
+		{
 			if(!this->check_authorization(request))
 			{
 				this->send_invalid_authorization_response(request, s_client);
 				break;
 			}
 
+			if(request_denied)
+			{
+				Stats::increment(Stats::ACL_DENIED);
+				if(!this->send_error_response(request, s_client, 403, "Forbidden"))
+				{
+					break;
+				}
+				keep_alive = request.should_keep_alive() && request.complete();
+				request_ready = false;
+				continue;
+			}
+
 			if(request.upgrade())
 			{
 				// protocol upgrade requested
@@ -140,208 +566,2403 @@ bool Proxy::thread_handle_connection(int tid)
 				break;
 			}
 
-			if(!s_server.valid())
+			Stats::increment(Stats::REQUESTS);
+			requests++;
+
+			if(this->status_request(request))
 			{
-				std::string host = extract_host(request);
-				s_server = connect(host);
-				if(!s_server.valid())
+				if(!this->send_status_response(request, s_client))
 				{
-					Message::error() << "Can't connect to host " << host << '\n';
 					break;
 				}
+				keep_alive = request.should_keep_alive();
+				request_ready = false;
+				continue;
 			}
-			
-			if(!this->forward_message(request_header, request, s_client, s_server))
+
+			if(host.empty())
 			{
-				Message::error() << "Forwarding request failed" << '\n';
-				break;
+				// reverse proxy without a route (or backends) for this URL
+				if(!this->send_error_response(request, s_client, 404, "Not Found"))
+				{
+					break;
+				}
+				keep_alive = request.should_keep_alive() && request.complete();
+				request_ready = false;
+				continue;
 			}
 
-			if(!request.should_keep_alive())
+			// Range requests are put together from cached slices of the object
+			if(pending.empty() && this->sliceable(request, host))
 			{
-				s_server.shutdown(false, true); // signal EOF (we're done writing)
+				RangeResult result = this->serve_range(request, request_header, host, s_client);
+				if(result == RANGE_FAILED)
+				{
+					Message::error() << "Range response failed" << '\n';
+					break;
+				}
+				if(result == RANGE_SERVED)
+				{
+					keep_alive = request.should_keep_alive();
+					request_ready = false;
+					continue;
+				}
 			}
 
-			std::string response_header = this->receive_message_header(response, s_server);
-			if(!response.headers_complete())
+			// responses we may share between clients are looked up by this key, served
+			// in order only, so not while earlier requests are still waiting upstream
+			const bool shared_request = pending.empty() && this->collapsible(request);
+			const std::string key = shared_request ? cache_key(request) : std::string();
+
+			// answer from the cache if we can, stale copies get refreshed in the background
+			Cache::EntryPtr stale;
+			if(shared_request && this->cache)
 			{
-				Message::error() << "Invalid response header" << '\n';
-				//std::ofstream file("invalid_response.txt");
-				//file << request_header << std::endl;
-				break;
+				const time_t now = std::time(NULL);
+				Cache::EntryPtr cached = this->cache->lookup(key);
+				Cache::Freshness freshness = cached ? this->cache->freshness(*cached, now) : Cache::EXPIRED;
+
+				// a reload (or a client wanting it younger) goes to the origin, the new response replaces ours
+				if(cached && freshness != Cache::EXPIRED && Cache::refuses(request, (long)(now - cached->stored)))
+				{
+					freshness = Cache::EXPIRED;
+				}
+
+				if(freshness == Cache::FRESH || freshness == Cache::STALE)
+				{
+					if(freshness == Cache::STALE)
+					{
+						this->schedule_refresh(key, cached);
+					}
+
+					Stats::increment(freshness == Cache::FRESH ? Stats::CACHE_HITS : Stats::CACHE_STALE_HITS);
+					if(this->prefetcher)
+					{
+						this->prefetched.claim(key);
+					}
+					if(!this->serve_cached(*cached, s_client))
+					{
+						break;
+					}
+					this->telemetry.sample(Telemetry::CLIENT, client_subnet, s_client, client_tcp, client_sampled);
+					if(this->access_log)
+					{
+						// "HTTP/1.1 200 OK"
+						const int status = cached->response.size() > 9 ? std::atoi(cached->response.c_str() + 9) : 0;
+						this->log_access(id, client, request_header, host, status, received, 0, client_tcp, TcpInfo());
+					}
+					if(this->trace)
+					{
+						const size_t header_end = cached->response.find("\r\n\r\n");
+						TraceRecord record;
+						record.time = received;
+						record.connection = id;
+						record.duration = (boost::uint32_t)(Clock::now() - received);
+						record.request_body = request.body_size;
+						record.response_header = (boost::uint32_t)(header_end == std::string::npos ? cached->response.size() : header_end + 4);
+						record.response_body = cached->response.size() - record.response_header;
+						record.status = cached->response.size() > 9 ? (boost::uint16_t)std::atoi(cached->response.c_str() + 9) : 0;
+						record.flags = TraceRecord::CACHED | (request.should_keep_alive() ? TraceRecord::KEEP_ALIVE : 0);
+						record.request_header = request_header;
+						this->record_trace(record);
+					}
+					keep_alive = request.should_keep_alive();
+					request_ready = false;
+					continue;
+				}
+
+				if(freshness == Cache::STALE_IF_ERROR)
+				{
+					stale = cached; // our fallback if the origin fails
+				}
+
+				Stats::increment(Stats::CACHE_MISSES);
 			}
 
-			if(request.method() != http::Method::head()) //if(!(request.flags() & http::Flags::skipbody()))
+			// identical requests already on their way to the origin are streamed from there
+			boost::shared_ptr<InflightFetch> fetch;
+			if(shared_request)
 			{
-				if(!this->forward_message(response_header, response, s_server, s_client))
+				bool leader = false;
+				fetch = this->inflight.join(key, leader);
+				if(!leader)
 				{
-					Message::error() << "Forwarding response failed" << '\n';
-					break;
+					CollapseResult result = this->serve_collapsed(*fetch, s_client);
+					if(result == COLLAPSE_FAILED)
+					{
+						Message::error() << "Collapsed response failed" << '\n';
+						break;
+					}
+					if(result == COLLAPSE_SERVED)
+					{
+						if(this->prefetcher)
+						{
+							this->prefetched.claim(key); // the prefetch was still on its way
+						}
+						keep_alive = request.should_keep_alive() && fetch->get_keep_alive();
+						request_ready = false;
+						continue;
+					}
+					fetch.reset(); // fetch it ourselves
 				}
 			}
 
-			keep_alive = request.should_keep_alive() && response.should_keep_alive();
-		}
-		while(keep_alive);
+			if(this->http2_origin(host))
+			{
+				// the body goes out in DATA frames right away, so we ask for it ourselves
+				if(this->expects_continue(request) && !request.complete())
+				{
+					request_header = set_header(request_header, "Expect", "");
+					if(!this->send_continue(request, s_client))
+					{
+						break;
+					}
+				}
 
-		s_server.close();
-		s_client.close();
-	}
+				keep_alive = request.should_keep_alive();
+				UpstreamResult result = this->forward_http2(request_header, request, host, backend, s_client, fetch, shaped ? &flow : NULL, keep_alive);
+				if(result == UPSTREAM_BROKEN)
+				{
+					Message::error() << "Forwarding HTTP/2 response failed" << '\n';
+					break;
+				}
 
-	return true;
-}
+				if(result == UPSTREAM_FAILED)
+				{
+					if(fetch)
+						this->inflight.complete(fetch, false);
+					if(stale && this->serve_cached(*stale, s_client))
+					{
+						Stats::increment(Stats::CACHE_STALE_IF_ERROR);
+						keep_alive = request.should_keep_alive();
+						request_ready = false;
+						continue;
+					}
+					if(!this->send_error_response(request, s_client, 502, "Bad Gateway"))
+					{
+						break;
+					}
+					keep_alive = request.should_keep_alive() && request.complete();
+				}
 
-std::string Proxy::extract_host(const http::Request& request)
-{
-	std::string host;
+				request_ready = false;
+				continue;
+			}
 
-	if(request.has_header("Host"))
-	{
-		host = request.header("Host");
-	}
-	else
-	{
-		host = request.url();
-	}
+			request.capture(false); // the body is relayed as is
 
-	return host;
-}
+			if(s_server.valid() && host != server_host)
+			{
+				s_server.close();
+			}
 
-Socket Proxy::connect(const std::string& host)
-{
-	Socket socket;
+			if(!s_server.valid())
+			{
+				CircuitBreaker::Failure failure = CircuitBreaker::NONE;
+				s_server = connect(host, failure);
+				server_host = host;
+				origin_sampled = 0;
+				origin_tcp = TcpInfo();
+				if(!s_server.valid())
+				{
+					Message::error() << "Can't connect to host " << host << '\n';
+					if(backend)
+						backend->report_failure();
+					if(fetch)
+						this->inflight.complete(fetch, false);
+					if(stale && this->serve_cached(*stale, s_client))
+					{
+						Stats::increment(Stats::CACHE_STALE_IF_ERROR);
+						keep_alive = request.should_keep_alive();
+						request_ready = false;
+						continue;
+					}
+
+					bool timeout = failure == CircuitBreaker::TIMEOUT;
+					if(!this->send_error_response(request, s_client, timeout ? 504 : 502, timeout ? "Gateway Timeout" : "Bad Gateway"))
+					{
+						break;
+					}
+					keep_alive = request.should_keep_alive() && request.complete();
+					request_ready = false;
+					continue;
+				}
+			}
 
-	http::Url url(host);
-	//if(url.has_host()) // somehow this doesn't work for URLs without schema
-	{
-		SocketAddress::port_t port = 80;
-		if(url.has_port())
-		{
-			port = atoi(url.port().c_str());
-		}
+			const std::string user = shaped ? this->authenticated_user(request, client) : std::string();
+			if(shaped)
+			{
+				this->shaper.bind(flow, user, host);
+			}
 
-		Address addr = Address::fromHost(host);
-		if(!addr.isAny())
-		{
-			socket = Socket(Socket::INET, Socket::STREAM);
-			SocketAddress sock_addr(SocketAddress::INET, addr, port);
-			if(!socket.connect(sock_addr))
+			// ask for gzip or nothing, so the cache variants stay gzip and identity
+			const bool gzip = this->negotiate_gzip(request);
+			if(gzip)
 			{
-				socket.close();
+				request_header = set_header(request_header, "Accept-Encoding", "gzip");
 			}
-		}
-	}
 
-	return socket;
-}
+			const boost::uint64_t sent = Clock::now();
+			const bool client_11 = request.major_version() > 1 || (request.major_version() == 1 && request.minor_version() >= 1);
 
-std::string Proxy::receive_message_header(http::Message& message, Socket socket)
-{
-	assert(socket.valid());
+			// the body of an upload that expects 100-continue waits until the origin asks for it
+			// (or the client stops waiting), the origin may turn it down with a final status instead
+			bool relayed = true;
+			ContinueResult expectation = CONTINUE_BODY;
+			if(this->expects_continue(request) && !request.complete())
+			{
+				relayed = s_server.send(request_header.data(), request_header.size()) == request_header.size();
+				expectation = relayed ? this->await_continue(s_client, s_server, client_11) : CONTINUE_FAILED;
+				if(expectation == CONTINUE_BODY)
+				{
+					relayed = this->forward_message(std::string(), request, s_client, s_server, NULL, shaped ? &flow : NULL);
+				}
+				else if(expectation == CONTINUE_REJECTED)
+				{
+					Stats::increment(Stats::EXPECT_REJECTED);
+				}
+				relayed = relayed && expectation != CONTINUE_FAILED;
+			}
+			else
+			{
+				relayed = this->forward_message(request_header, request, s_client, s_server, NULL, shaped ? &flow : NULL);
+			}
+
+			if(!relayed)
+			{
+				Message::error() << "Forwarding request failed" << '\n';
+				if(fetch)
+					this->inflight.complete(fetch, false);
+				break;
+			}
+
+			PendingRequest forwarded;
+			forwarded.header = request_header;
+			forwarded.head = request.method() == http::Method::head();
+			// the body we didn't read is still in the way, the connection ends after the response
+			forwarded.keep_alive = request.should_keep_alive() && expectation != CONTINUE_REJECTED;
+			forwarded.interim = client_11;
+			forwarded.pipelined = this->pipelinable(request);
+			forwarded.replayed = false;
+			forwarded.fetch = fetch;
+			forwarded.stale = stale;
+			forwarded.backend = backend;
+			forwarded.received = received;
+			forwarded.sent = sent;
+			forwarded.body_size = request.body_size;
+			forwarded.url = request.url();
+			forwarded.user = user;
+			forwarded.gzip = gzip;
+			forwarded.hedgeable = (request.method() == http::Method::get() || request.method() == http::Method::head()) && request.complete();
+			if(this->prefetcher && this->collapsible(request))
+			{
+				forwarded.page_key = shared_request ? key : this->cache_key(request);
+			}
+			pending.push_back(forwarded);
+
+			if(backend)
+			{
+				backend->acquire();
+			}
+
+			if(!forwarded.keep_alive)
+			{
+				s_server.shutdown(false, true); // signal EOF (we're done writing)
+			}
+			if(expectation == CONTINUE_REJECTED)
+			{
+				client_open = false;
+			}
+
+			request_ready = false;
+			continue;
+		}
+
+		if(pending.empty())
+		{
+			break;
+		}
+
+		// answer the oldest request in flight, asking a second upstream if the first one is slow
+		if(this->hedge_percentile > 0.0 && pending.size() == 1 && pending.front().hedgeable)
+		{
+			this->hedge(pending.front(), s_server, server_host);
+		}
+
+		// the body that arrives with the header is needed again for compressing or scanning it
+		response.capture(pending.front().gzip || !pending.front().page_key.empty());
+		std::string response_header = this->receive_message_header(response, s_server);
+
+		// interim responses (100 Continue nobody waited for, 103 Early Hints) go ahead of the final one
+		bool interim_failed = false;
+		while(response.headers_complete() && response.status() >= 100 && response.status() < 200 && response.status() != 101)
+		{
+			if(pending.front().interim && s_client.send(response_header.data(), response_header.size()) != response_header.size())
+			{
+				interim_failed = true;
+				break;
+			}
+			response_header = this->receive_message_header(response, s_server);
+		}
+		if(interim_failed)
+		{
+			break;
+		}
+
+		// the upstream dropped the connection before answering, idempotent requests can be replayed once
+		if(!response.headers_complete() && pending.front().pipelined && !pending.front().replayed &&
+		   this->replay_pending(pending, s_server, server_host))
+		{
+			continue;
+		}
+
+		PendingRequest& answered = pending.front();
+
+		const boost::uint64_t latency = Clock::now() - answered.sent;
+		if(response.headers_complete())
+		{
+			this->upstream_latency.record(latency);
+		}
+
+		if(response.headers_complete() && response.status() < 500)
+		{
+			this->breaker.report_success(server_host);
+			if(answered.backend)
+				answered.backend->report_success(latency);
+		}
+		else
+		{
+			this->breaker.report_failure(server_host, CircuitBreaker::RESPONSE);
+			if(answered.backend)
+				answered.backend->report_failure();
+		}
+
+		// stale-if-error, the origin's answer is dropped along with its connection
+		bool origin_failed = !response.headers_complete() || response.status() >= 500;
+		if(origin_failed && answered.stale && pending.size() == 1)
+		{
+			s_server.close();
+			if(answered.fetch)
+			{
+				this->inflight.complete(answered.fetch, false);
+				answered.fetch.reset();
+			}
+
+			if(!this->serve_cached(*answered.stale, s_client))
+			{
+				break;
+			}
+			Stats::increment(Stats::CACHE_STALE_IF_ERROR);
+
+			keep_alive = answered.keep_alive;
+			if(answered.backend)
+			{
+				answered.backend->release();
+			}
+			pending.pop_front();
+			continue;
+		}
+
+		if(!response.headers_complete())
+		{
+			Message::error() << "Invalid response header" << '\n';
+			//std::ofstream file("invalid_response.txt");
+			//file << request_header << std::endl;
+			if(pending.size() == 1)
+			{
+				this->send_error_response(request, s_client, 502, "Bad Gateway");
+			}
+			break;
+		}
+
+		if(answered.fetch)
+		{
+			// let waiting followers either stream along or fetch on their own
+			bool shared = this->shareable(response);
+			answered.fetch->start(shared, response.should_keep_alive());
+			if(!shared)
+			{
+				this->inflight.complete(answered.fetch, false);
+				answered.fetch.reset();
+			}
+		}
+
+		if(!answered.head) //if(!(request.flags() & http::Flags::skipbody()))
+		{
+			if(shaped)
+			{
+				this->shaper.bind(flow, answered.user, server_host);
+			}
+
+			// pages are scanned for their subresources as they stream past
+			boost::scoped_ptr<LinkScanner> scanner;
+			if(!answered.page_key.empty() && response.status() == 200 && response.has_header("Content-Type") &&
+			   lower(response.header("Content-Type")).compare(0, 9, "text/html") == 0)
+			{
+				const std::string encoding = response.has_header("Content-Encoding") ? lower(response.header("Content-Encoding")) : std::string();
+				if(encoding.empty() || encoding == "identity" || encoding == "gzip")
+				{
+					scanner.reset(new LinkScanner(encoding == "gzip"));
+				}
+				if(scanner && scanner->usable())
+				{
+					scanner->feed(response.body.data(), response.body.size());
+					response.scan(scanner.get());
+				}
+				else
+				{
+					scanner.reset();
+				}
+			}
+
+			bool relayed;
+			if(answered.gzip && this->should_compress(response))
+			{
+				relayed = this->forward_compressed(response_header, response, s_server, s_client, answered.fetch.get(), shaped ? &flow : NULL);
+			}
+			else
+			{
+				response.capture(false);
+				relayed = this->forward_message(response_header, response, s_server, s_client, answered.fetch.get(), shaped ? &flow : NULL);
+			}
+			response.scan(NULL);
+
+			if(!relayed)
+			{
+				Message::error() << "Forwarding response failed" << '\n';
+				break;
+			}
+
+			if(scanner)
+			{
+				this->schedule_prefetches(answered, server_host, scanner->get_links());
+			}
+		}
+
+		if(answered.fetch)
+		{
+			// store before completing, so nobody slips into a miss in between
+			// a response that outgrew the fetch's limit wasn't kept
+			if(answered.fetch->get_state() == InflightFetch::SHARED)
+			{
+				this->store_response(answered.fetch->get_key(), answered.header, server_host, response, answered.fetch->get_data());
+			}
+			this->inflight.complete(answered.fetch, true);
+		}
+
+		// network conditions on both sides, to tell them apart from our own share of the latency
+		this->telemetry.sample(Telemetry::CLIENT, client_subnet, s_client, client_tcp, client_sampled);
+		if(this->telemetry.sample(Telemetry::ORIGIN, server_host, s_server, origin_tcp, origin_sampled) && answered.backend)
+		{
+			answered.backend->report_rtt(origin_tcp.rtt);
+		}
+
+		if(this->access_log)
+		{
+			this->log_access(id, client, answered.header, server_host, response.status(), answered.sent, latency, client_tcp, origin_tcp);
+		}
+
+		if(this->trace)
+		{
+			TraceRecord record;
+			record.time = answered.received;
+			record.connection = id;
+			record.ttfb = (boost::uint32_t)latency;
+			record.duration = (boost::uint32_t)(Clock::now() - answered.received);
+			record.request_body = answered.body_size;
+			record.response_header = (boost::uint32_t)response_header.size();
+			record.response_body = response.body_size;
+			record.status = (boost::uint16_t)response.status();
+			record.flags = (answered.keep_alive ? TraceRecord::KEEP_ALIVE : 0) | (answered.head ? TraceRecord::HEAD : 0);
+			record.request_header = answered.header;
+			this->record_trace(record);
+		}
+
+		keep_alive = answered.keep_alive && response.should_keep_alive();
+		if(answered.backend)
+		{
+			answered.backend->release();
+		}
+		pending.pop_front();
+	}
+
+	// fetches we were leading are lost with the connection
+	for(std::deque<PendingRequest>::iterator it = pending.begin(); it != pending.end(); ++it)
+	{
+		if(it->fetch)
+		{
+			this->inflight.complete(it->fetch, false);
+		}
+		if(it->backend)
+		{
+			it->backend->release();
+		}
+	}
+
+	this->telemetry.sample(Telemetry::CLIENT, client_subnet, s_client, client_tcp, client_sampled, true);
+	if(s_server.valid())
+	{
+		this->telemetry.sample(Telemetry::ORIGIN, server_host, s_server, origin_tcp, origin_sampled, true);
+	}
+
+	s_server.close();
+
+	PROXY_PROBE1(close, requests);
+}
+
+bool Proxy::pipelinable(const http::Request& request) const
+{
+	// only bodiless GETs are safe to replay when the upstream drops a pipelined connection
+	return this->pipeline_depth > 1 &&
+	       request.method() == http::Method::get() &&
+	       request.complete() &&
+	       request.should_keep_alive() &&
+	       !request.upgrade() &&
+	       !this->status_request(request) &&
+	       this->check_authorization(request);
+}
+
+std::string Proxy::cache_key(const http::Request& request) const
+{
+	std::string key = request.url();
+	if(!key.empty() && key[0] == '/')
+	{
+		key = "http://" + extract_host(request) + key;
+	}
+
+	// HTTP/1.0 clients can't read the chunked responses 1.1 clients are sent, they share among themselves
+	if(request.major_version() < 1 || (request.major_version() == 1 && request.minor_version() == 0))
+	{
+		key += "\nHTTP/1.0";
+	}
+
+	// we don't store Vary, but Accept-Encoding is the one origins commonly vary on
+	// with compression on, everyone accepting gzip shares the gzip variant
+	if(this->negotiate_gzip(request))
+	{
+		key += "\ngzip";
+	}
+	else if(request.has_header("Accept-Encoding"))
+	{
+		key += '\n' + request.header("Accept-Encoding");
+	}
+
+	return key;
+}
+
+bool Proxy::collapsible(const http::Request& request)
+{
+	// requests whose response depends on more than the URL fetch on their own
+	return request.method() == http::Method::get() &&
+	       request.complete() &&
+	       !request.has_header("Authorization") &&
+	       !request.has_header("Range") &&
+	       !request.has_header("If-None-Match") &&
+	       !request.has_header("If-Modified-Since");
+}
+
+bool Proxy::shareable(const http::Response& response)
+{
+	switch(response.status())
+	{
+		case 200: case 203: case 204: case 300: case 301: case 404: case 410:
+			break;
+		default:
+			return false;
+	}
+
+	if(response.has_header("Set-Cookie"))
+		return false;
+
+	if(response.has_header("Cache-Control"))
+	{
+		const std::string cache_control = response.header("Cache-Control");
+		if(cache_control.find("private")  != std::string::npos ||
+		   cache_control.find("no-store") != std::string::npos)
+		{
+			return false;
+		}
+	}
+
+	if(response.has_header("Vary") && response.header("Vary") != "Accept-Encoding")
+		return false;
+
+	// followers can only tell where the response ends if it's length delimited
+	return response.should_keep_alive();
+}
+
+void Proxy::store_response(const std::string& key, const std::string& request_header, const std::string& host, const http::Response& response, const std::string& data)
+{
+	if(!this->cache)
+		return;
+
+	boost::shared_ptr<Cache::Entry> entry(new Cache::Entry);
+	if(!Cache::lifetime(response, entry->max_age, entry->stale_while_revalidate, entry->stale_if_error, entry->must_revalidate))
+		return;
+
+	entry->request = request_header;
+	entry->host = host;
+	entry->response = data;
+	entry->stored = std::time(NULL) - Cache::received_age(response);
+
+	this->cache->store(key, entry);
+
+	if(Memory::pressure() >= Memory::SHRINK)
+	{
+		this->relieve_memory();
+	}
+}
+
+bool Proxy::serve_cached(const Cache::Entry& entry, Socket s_client)
+{
+	const size_t header_end = entry.response.find("\r\n\r\n");
+	if(header_end == std::string::npos)
+		return false;
+
+	// our age replaces the one it arrived with, stored counts that in already
+	std::ostringstream age;
+	age << (long)(std::time(NULL) - entry.stored);
+	const std::string header = set_header(entry.response.substr(0, header_end + 4), "Age", age.str());
+
+	const Socket::Buffer parts[] =
+	{
+		{ header.data(), header.size() },
+		{ entry.response.data() + header_end + 4, entry.response.size() - header_end - 4 }
+	};
+
+	return s_client.send(parts, 2) == header.size() + entry.response.size() - header_end - 4;
+}
+
+void Proxy::schedule_refresh(const std::string& key, const Cache::EntryPtr& entry)
+{
+	if(!this->cache->begin_refresh(key))
+		return; // already on it
+
+	if(!this->refresher->submit(boost::bind(&Proxy::refresh, this, key, entry)))
+	{
+		Stats::increment(Stats::REFRESHES_DROPPED);
+		this->cache->end_refresh(key);
+	}
+}
+
+void Proxy::refresh(const std::string& key, const Cache::EntryPtr& entry)
+{
+	Stats::increment(Stats::REFRESHES);
+
+	bool leader = false;
+	if(!this->fetch_into_cache(key, entry->request, entry->host, leader))
+	{
+		Stats::increment(Stats::REFRESH_FAILURES);
+	}
+
+	this->cache->end_refresh(key);
+}
+
+bool Proxy::fetch_into_cache(const std::string& key, const std::string& request_header, const std::string& host, bool& leader)
+{
+	// register like a client would, so misses arriving meanwhile collapse onto us
+	leader = false;
+	boost::shared_ptr<InflightFetch> fetch = this->inflight.join(key, leader);
+	if(!leader)
+	{
+		return true; // somebody is fetching it already
+	}
+
+	bool success = false;
+	Socket s_server = this->connect(host);
+	if(s_server.valid() && s_server.send(request_header.data(), request_header.size()) == request_header.size())
+	{
+		// the gzip variant is stored compressed, like the client side would have
+		const bool gzip = gzip_variant(key);
+
+		CapturingResponse response;
+		response.capture(gzip);
+		std::string response_header = this->receive_message_header(response, s_server);
+
+		// an error keeps the stale copy around
+		if(response.headers_complete() && response.status() < 500)
+		{
+			bool shared = this->shareable(response);
+			fetch->start(shared, response.should_keep_alive());
+
+			bool relayed = false;
+			if(shared && gzip && this->should_compress(response))
+			{
+				relayed = this->forward_compressed(response_header, response, s_server, Socket(), fetch.get());
+			}
+			else if(shared)
+			{
+				response.capture(false);
+				relayed = this->forward_message(response_header, response, s_server, Socket(), fetch.get());
+			}
+
+			// a response that outgrew the fetch's limit wasn't kept
+			if(relayed && fetch->get_state() == InflightFetch::SHARED)
+			{
+				success = true;
+				this->store_response(key, request_header, host, response, fetch->get_data());
+			}
+		}
+	}
+	s_server.close();
+
+	this->inflight.complete(fetch, success);
+	return success;
+}
+
+void Proxy::schedule_prefetches(const PendingRequest& page, const std::string& host, const std::vector<std::string>& links)
+{
+	// "http://host/path\n<variant>"
+	const size_t variant = page.page_key.find('\n');
+	const std::string url = page.page_key.substr(0, variant);
+	const std::string suffix = variant == std::string::npos ? std::string() : page.page_key.substr(variant);
+
+	// the rest of the page's request goes along, minus whatever was specific to the page
+	const size_t line_end = page.header.find("\r\n");
+	if(line_end == std::string::npos)
+		return;
+	// the key's variant may be the HTTP/1.0 one, so the request goes out in the page's version
+	const size_t version = page.header.rfind(' ', line_end);
+	if(version == std::string::npos)
+		return;
+	const std::string http_version = page.header.substr(version, line_end - version);
+
+	std::string header = page.header;
+	const char* const DROPPED[] = { "Range", "If-Range", "If-None-Match", "If-Modified-Since", "Content-Length", "Transfer-Encoding", "Expect", "Upgrade" };
+	for(size_t i = 0; i < sizeof(DROPPED) / sizeof(DROPPED[0]); i++)
+	{
+		header = set_header(header, DROPPED[i], "");
+	}
+	header = set_header(header, "Referer", url);
+	const std::string fields = header.substr(header.find("\r\n"));
+
+	const time_t now = std::time(NULL);
+	for(size_t i = 0; i < links.size(); i++)
+	{
+		const std::string link = LinkScanner::resolve(url, links[i]);
+		if(link.empty() || link == url)
+			continue;
+
+		const std::string key = link + suffix;
+		Cache::EntryPtr cached = this->cache->lookup(key);
+		if(cached && this->cache->freshness(*cached, now) <= Cache::STALE)
+			continue;
+
+		// same form of the target as the page's, the origin part is the page's
+		const std::string path = link.substr(link.find('/', 7));
+		const std::string target = !page.url.empty() && page.url[0] == '/' ? path : link;
+
+		std::string upstream = host;
+		if(!this->routes.empty())
+		{
+			BackendPoolPtr pool = this->find_route(target);
+			BackendPtr backend = pool ? pool->select(target) : BackendPtr();
+			if(!backend)
+				continue;
+			upstream = backend->get_address();
+		}
+
+		// at most one of them in the queue, refreshes of the same key included
+		if(!this->cache->begin_refresh(key))
+			continue;
+
+		const std::string request_header = "GET " + target + http_version + fields;
+		if(!this->prefetcher->submit(boost::bind(&Proxy::prefetch, this, key, request_header, upstream)))
+		{
+			Stats::increment(Stats::PREFETCH_DROPPED, links.size() - i);
+			this->cache->end_refresh(key);
+			break;
+		}
+	}
+}
+
+void Proxy::prefetch(const std::string& key, const std::string& request_header, const std::string& host)
+{
+	// the client may have been quicker
+	Cache::EntryPtr cached = this->cache->lookup(key);
+	if(!cached || this->cache->freshness(*cached, std::time(NULL)) > Cache::STALE)
+	{
+		bool leader = false;
+		if(this->fetch_into_cache(key, request_header, host, leader) && leader && this->cache->lookup(key))
+		{
+			Stats::increment(Stats::PREFETCHES);
+			this->prefetched.fetched(key);
+		}
+	}
+
+	this->cache->end_refresh(key);
+}
+
+Proxy::CollapseResult Proxy::serve_collapsed(InflightFetch& fetch, Socket s_client)
+{
+	InflightFetch::State state = fetch.wait_start(COLLAPSE_TIMEOUT);
+	if(state != InflightFetch::SHARED && state != InflightFetch::DONE)
+	{
+		Stats::increment(Stats::COLLAPSE_FALLBACKS);
+		return COLLAPSE_FALLBACK;
+	}
+
+	Stats::increment(Stats::COLLAPSED);
+
+	size_t offset = 0;
+	std::string chunk;
+	while(fetch.read(offset, chunk, COLLAPSE_TIMEOUT))
+	{
+		if(s_client.send(chunk.data(), chunk.size()) != chunk.size())
+		{
+			return COLLAPSE_FAILED;
+		}
+		offset += chunk.size();
+	}
+
+	state = fetch.get_state();
+	if(state == InflightFetch::PRIVATE && offset == 0)
+	{
+		// it outgrew the limit before we sent anything, we can still fetch it ourselves
+		Stats::increment(Stats::COLLAPSE_FALLBACKS);
+		return COLLAPSE_FALLBACK;
+	}
+
+	return state == InflightFetch::DONE ? COLLAPSE_SERVED : COLLAPSE_FAILED;
+}
+
+bool Proxy::sliceable(const http::Request& request, const std::string& host) const
+{
+	// If-Range would need the validator before we know it, the origin can sort that out
+	return this->slice_size > 0 && this->cache &&
+	       request.method() == http::Method::get() &&
+	       request.complete() &&
+	       request.has_header("Range") &&
+	       !request.has_header("If-Range") &&
+	       !request.has_header("Authorization") &&
+	       !this->http2_origin(host);
+}
+
+Proxy::RangeResult Proxy::serve_range(const http::Request& request, const std::string& request_header, const std::string& host, Socket s_client)
+{
+	ByteRanges requested;
+	if(!requested.parse(request.header("Range")))
+	{
+		return RANGE_FALLBACK;
+	}
+
+	Stats::increment(Stats::RANGE_REQUESTS);
+
+	// slices are the identity encoding, one connection each
+	std::string slice_request = set_header(request_header, "Accept-Encoding", "");
+	slice_request = set_header(slice_request, "Connection", "close");
+
+	std::string base = request.url();
+	if(!base.empty() && base[0] == '/')
+	{
+		base = "http://" + extract_host(request) + base;
+	}
+	const std::string meta_key = base + "\nslices";
+
+	// the object's length, type and validator, kept as the header of a slice
+	Cache::EntryPtr meta = this->cache->lookup(meta_key);
+	if(meta && this->cache->freshness(*meta, std::time(NULL)) > Cache::STALE)
+	{
+		meta.reset();
+	}
+
+	// suffix ranges start with the tail, we learn the length from it without fetching anything else
+	Cache::EntryPtr first;
+	boost::uint64_t first_index = requested.first_offset() / this->slice_size;
+	if(!meta)
+	{
+		first = this->fetch_slice(slice_request, host, base, first_index, requested.suffix_only());
+		if(!first)
+		{
+			return RANGE_FALLBACK; // no range support, or it's failing, either way it's the origin's call
+		}
+
+		boost::shared_ptr<Cache::Entry> header(new Cache::Entry(*first));
+		header->response.erase(header->response.find("\r\n\r\n") + 4);
+		if(header->max_age > 0)
+		{
+			this->cache->store(meta_key, header);
+		}
+		meta = header;
+	}
+
+	const std::string object = meta->response;
+	const std::string version = validator(object);
+	boost::uint64_t unused_first, unused_last, total;
+	if(!ByteRanges::parse_content_range(header_field(object, "Content-Range"), unused_first, unused_last, total))
+	{
+		return RANGE_FALLBACK;
+	}
+
+	std::vector<ByteRanges::Range> ranges;
+	requested.resolve(total, ranges);
+
+	std::ostringstream head;
+	head << "HTTP/" << request.major_version() << '.' << request.minor_version();
+	if(ranges.empty())
+	{
+		head << " 416 Range Not Satisfiable\r\n"
+		     << "Content-Range: bytes */" << total << "\r\n"
+		     << "Content-Length: 0\r\n"
+		     << "\r\n";
+		const std::string str = head.str();
+		return s_client.send(str.data(), str.size()) == str.size() ? RANGE_SERVED : RANGE_FAILED;
+	}
+
+	// multiple ranges go out as multipart/byteranges, every part with a header of its own
+	const std::string content_type = header_field(object, "Content-Type");
+	std::ostringstream boundary_str;
+	boundary_str << "slice" << std::hex << Clock::now();
+	const std::string boundary = boundary_str.str();
+
+	std::vector<std::string> part_headers;
+	boost::uint64_t length = 0;
+	for(size_t i = 0; i < ranges.size(); i++)
+	{
+		length += ranges[i].last - ranges[i].first + 1;
+		if(ranges.size() > 1)
+		{
+			std::ostringstream part;
+			part << "--" << boundary << "\r\n";
+			if(!content_type.empty())
+				part << "Content-Type: " << content_type << "\r\n";
+			part << "Content-Range: bytes " << ranges[i].first << '-' << ranges[i].last << '/' << total << "\r\n"
+			     << "\r\n";
+			part_headers.push_back(part.str());
+			length += part_headers.back().size() + 2; // the part ends with CRLF
+		}
+	}
+	const std::string closing = "--" + boundary + "--\r\n";
+	if(ranges.size() > 1)
+	{
+		length += closing.size();
+	}
+
+	head << " 206 Partial Content\r\n";
+	if(ranges.size() > 1)
+	{
+		head << "Content-Type: multipart/byteranges; boundary=" << boundary << "\r\n";
+	}
+	else
+	{
+		if(!content_type.empty())
+			head << "Content-Type: " << content_type << "\r\n";
+		head << "Content-Range: bytes " << ranges[0].first << '-' << ranges[0].last << '/' << total << "\r\n";
+	}
+	const char* const COPIED[] = { "ETag", "Last-Modified", "Cache-Control" };
+	for(size_t i = 0; i < sizeof(COPIED) / sizeof(COPIED[0]); i++)
+	{
+		const std::string value = header_field(object, COPIED[i]);
+		if(!value.empty())
+			head << COPIED[i] << ": " << value << "\r\n";
+	}
+	head << "Accept-Ranges: bytes\r\n"
+	     << "Content-Length: " << length << "\r\n";
+	if(!request.should_keep_alive())
+	{
+		head << "Connection: close\r\n";
+	}
+	head << "\r\n";
+
+	const std::string head_str = head.str();
+	if(s_client.send(head_str.data(), head_str.size(), true) != head_str.size())
+	{
+		return RANGE_FAILED;
+	}
+
+	// every slice of every range in the order it's sent, overlapping ranges may repeat one
+	struct Piece
+	{
+		size_t range;
+		boost::uint64_t index;
+	};
+	std::vector<Piece> plan;
+	for(size_t i = 0; i < ranges.size(); i++)
+	{
+		for(boost::uint64_t index = ranges[i].first / this->slice_size; index <= ranges[i].last / this->slice_size; index++)
+		{
+			Piece piece = { i, index };
+			plan.push_back(piece);
+		}
+	}
+
+	// missing slices are fetched up to SLICE_PARALLEL pieces ahead of the one being sent
+	std::vector<Cache::EntryPtr> slices(plan.size());
+	std::vector<SliceJobPtr> jobs(plan.size());
+	size_t looked_up = 0;
+
+	for(size_t p = 0; p < plan.size(); p++)
+	{
+		for(; looked_up < plan.size() && looked_up < p + SLICE_PARALLEL; looked_up++)
+		{
+			const boost::uint64_t index = plan[looked_up].index;
+			if(looked_up > 0 && plan[looked_up - 1].index == index)
+				continue; // same slice as the piece before
+			if(first && index == first_index)
+			{
+				slices[looked_up] = first;
+				continue;
+			}
+
+			slices[looked_up] = this->cached_slice(base, index, version);
+			if(!slices[looked_up])
+			{
+				// with the pool busy this one is fetched here once it's due
+				SliceJobPtr job(new SliceJob);
+				if(this->slicer->submit(boost::bind(&Proxy::run_slice_job, this, job, slice_request, host, base, index)))
+				{
+					jobs[looked_up] = job;
+				}
+			}
+		}
+
+		if(p > 0 && plan[p - 1].index == plan[p].index)
+		{
+			slices[p] = slices[p - 1];
+		}
+		else if(!slices[p])
+		{
+			if(jobs[p])
+			{
+				slices[p] = jobs[p]->wait();
+				jobs[p].reset();
+			}
+			else
+			{
+				boost::uint64_t index = plan[p].index;
+				slices[p] = this->fetch_slice(slice_request, host, base, index);
+			}
+
+			if(slices[p] && validator(slices[p]->response) != version)
+			{
+				// the object changed under us, start over with the next request
+				this->cache->remove(meta_key);
+				slices[p].reset();
+			}
+		}
+
+		if(!slices[p])
+		{
+			return RANGE_FAILED; // jobs still queued finish on their own, into the cache
+		}
+
+		const ByteRanges::Range& range = ranges[plan[p].range];
+		if(ranges.size() > 1 && (p == 0 || plan[p - 1].range != plan[p].range))
+		{
+			const std::string& part = part_headers[plan[p].range];
+			if(s_client.send(part.data(), part.size(), true) != part.size())
+				return RANGE_FAILED;
+		}
+
+		// the slice's share of the range
+		const boost::uint64_t slice_first = plan[p].index * this->slice_size;
+		const boost::uint64_t from = range.first > slice_first ? range.first : slice_first;
+		const boost::uint64_t to = range.last < slice_first + this->slice_size - 1 ? range.last : slice_first + this->slice_size - 1;
+		const size_t body = slices[p]->response.find("\r\n\r\n") + 4;
+		if(body + (to - slice_first) >= slices[p]->response.size())
+		{
+			return RANGE_FAILED; // shorter than the length promised
+		}
+
+		const bool last_piece = p + 1 == plan.size();
+		const size_t size = (size_t)(to - from + 1);
+		if(s_client.send(slices[p]->response.data() + body + (from - slice_first), size, !last_piece || ranges.size() > 1) != size)
+		{
+			return RANGE_FAILED;
+		}
+
+		if(ranges.size() > 1 && (last_piece || plan[p + 1].range != plan[p].range))
+		{
+			const std::string part_end = last_piece ? "\r\n" + closing : "\r\n";
+			if(s_client.send(part_end.data(), part_end.size()) != part_end.size())
+				return RANGE_FAILED;
+		}
+
+		// sent, only the next piece may still need it
+		if(p > 0)
+		{
+			slices[p - 1].reset();
+		}
+	}
+
+	return RANGE_SERVED;
+}
+
+Cache::EntryPtr Proxy::cached_slice(const std::string& base, boost::uint64_t index, const std::string& validator)
+{
+	Cache::EntryPtr slice = this->cache->lookup(slice_key(base, index));
+	if(!slice || this->cache->freshness(*slice, std::time(NULL)) > Cache::STALE || Proxy::validator(slice->response) != validator)
+	{
+		return Cache::EntryPtr();
+	}
+
+	Stats::increment(Stats::SLICE_HITS);
+	return slice;
+}
+
+Cache::EntryPtr Proxy::fetch_slice(const std::string& request_header, const std::string& host, const std::string& base, boost::uint64_t& index, bool tail)
+{
+	const boost::uint64_t first = index * this->slice_size;
+	std::ostringstream range;
+	if(tail)
+		range << "bytes=-" << this->slice_size;
+	else
+		range << "bytes=" << first << '-' << first + this->slice_size - 1;
+	const std::string slice_request = set_header(request_header, "Range", range.str());
+
+	Cache::EntryPtr slice;
+
+	Socket s_server = this->connect(host);
+	if(s_server.valid() && s_server.send(slice_request.data(), slice_request.size()) == slice_request.size())
+	{
+		CapturingResponse response;
+		response.capture(true);
+		std::string response_header = this->receive_message_header(response, s_server);
+
+		boost::uint64_t slice_first, slice_last, total;
+		if(response.headers_complete() && response.status() == 206 && response.has_header("Content-Range") &&
+		   ByteRanges::parse_content_range(response.header("Content-Range"), slice_first, slice_last, total) &&
+		   (tail ? slice_last + 1 == total : slice_first == first) && slice_last - slice_first < this->slice_size)
+		{
+			while(!response.complete() && feed_message(response, s_server) > 0)
+			{
+			}
+
+			// the suffix covers the whole last slice, whatever comes before it is cut off
+			const boost::uint64_t last_first = (total - 1) / this->slice_size * this->slice_size;
+			const bool usable = response.complete() && response.body.size() == slice_last - slice_first + 1 &&
+			                    (!tail || last_first >= slice_first);
+			if(usable && tail)
+			{
+				response.body.erase(0, (size_t)(last_first - slice_first));
+				slice_first = last_first;
+				index = last_first / this->slice_size;
+
+				std::ostringstream content_range;
+				content_range << "bytes " << slice_first << '-' << slice_last << '/' << total;
+				response_header = set_header(response_header, "Content-Range", content_range.str());
+			}
+
+			if(usable)
+			{
+				Stats::increment(Stats::SLICE_FETCHES);
+
+				// stored decoded, with the length up front
+				boost::shared_ptr<Cache::Entry> entry(new Cache::Entry);
+				response_header = set_header(response_header, "Transfer-Encoding", "");
+				std::ostringstream length;
+				length << response.body.size();
+				response_header = set_header(response_header, "Content-Length", length.str());
+				entry->request = slice_request;
+				entry->host = host;
+				entry->response = response_header + response.body;
+				entry->stored = std::time(NULL) - Cache::received_age(response);
+				if(Cache::lifetime(response, entry->max_age, entry->stale_while_revalidate, entry->stale_if_error, entry->must_revalidate))
+				{
+					this->cache->store(slice_key(base, index), entry);
+				}
+				else
+				{
+					entry->max_age = 0; // serves this request only
+				}
+				slice = entry;
+			}
+		}
+	}
+	s_server.close();
+
+	return slice;
+}
+
+void Proxy::run_slice_job(const SliceJobPtr& job, const std::string& request_header, const std::string& host, const std::string& base, boost::uint64_t index)
+{
+	Cache::EntryPtr entry = this->fetch_slice(request_header, host, base, index);
+
+	boost::unique_lock<boost::mutex> lock(job->guard);
+	job->entry = entry;
+	job->done = true;
+	job->finished.notify_all();
+}
+
+std::string Proxy::slice_key(const std::string& base, boost::uint64_t index)
+{
+	std::ostringstream key;
+	key << base << "\nslice " << index;
+	return key.str();
+}
+
+std::string Proxy::validator(const std::string& header)
+{
+	const std::string etag = header_field(header, "ETag");
+	return etag.empty() ? header_field(header, "Last-Modified") : etag;
+}
+
+bool Proxy::expects_continue(const http::Request& request)
+{
+	// HTTP/1.0 clients don't know 1xx responses, their expectation is ignored
+	return (request.major_version() > 1 || (request.major_version() == 1 && request.minor_version() >= 1)) &&
+	       request.has_header("Expect") && lower(request.header("Expect")) == "100-continue";
+}
+
+Proxy::ContinueResult Proxy::await_continue(Socket s_client, Socket s_server, bool relay)
+{
+	// whoever moves first, the origin with a response or the client with the body
+	// one deadline for all of it, an origin trickling out its status line mustn't keep us polling
+	const Socket sockets[] = { s_server, s_client };
+	const boost::uint64_t deadline = Clock::now() + KEEPALIVE_TIMEOUT * 1000000ULL;
+	for(;;)
+	{
+		const boost::uint64_t now = Clock::now();
+		if(now >= deadline)
+		{
+			return CONTINUE_FAILED;
+		}
+
+		const boost::uint64_t left = deadline - now;
+		const int ready = Socket::select_read(sockets, 2, (long)(left / 1000000U), (long)(left % 1000000U));
+		if(ready < 0)
+		{
+			return CONTINUE_FAILED;
+		}
+		if(ready == 1)
+		{
+			return CONTINUE_BODY; // the client stopped waiting
+		}
+
+		// "HTTP/1.1 100", interim responses are taken off the socket, a final one is left for the response path
+		char status[12];
+		const int read = s_server.recv(status, sizeof(status), Socket::PEEK);
+		if(read <= 0)
+		{
+			return CONTINUE_REJECTED; // the response path reports the dropped connection
+		}
+		if(read < (int)sizeof(status))
+		{
+			boost::this_thread::sleep(boost::posix_time::milliseconds(1)); // rest of the status line on its way
+			continue;
+		}
+		if(status[9] != '1' || (status[10] == '0' && status[11] == '1'))
+		{
+			return CONTINUE_REJECTED;
+		}
+
+		http::Response interim;
+		const std::string header = receive_message_header(interim, s_server);
+		if(!interim.headers_complete())
+		{
+			return CONTINUE_FAILED;
+		}
+		if(relay && s_client.send(header.data(), header.size()) != header.size())
+		{
+			return CONTINUE_FAILED;
+		}
+		if(interim.status() == 100)
+		{
+			Stats::increment(Stats::EXPECT_CONTINUED);
+			return CONTINUE_BODY;
+		}
+	}
+}
+
+bool Proxy::send_continue(const http::Request& request, Socket s_client)
+{
+	std::ostringstream response;
+	response << "HTTP/" << request.major_version() << '.' << request.minor_version() << " 100 Continue\r\n"
+	         << "\r\n";
+
+	const std::string str = response.str();
+	return s_client.send(str.data(), str.size()) == str.size();
+}
+
+bool Proxy::replay_pending(std::deque<PendingRequest>& pending, Socket& s_server, const std::string& host)
+{
+	s_server.close();
+	s_server = connect(host);
+	if(!s_server.valid())
+	{
+		return false;
+	}
+
+	for(std::deque<PendingRequest>::iterator it = pending.begin(); it != pending.end(); ++it)
+	{
+		bool more = (it + 1) != pending.end();
+		if(s_server.send(it->header.data(), it->header.size(), more) != it->header.size())
+		{
+			return false;
+		}
+		it->replayed = true;
+	}
+
+	return true;
+}
+
+void Proxy::add_backend_pool(const std::string& name, const std::vector<std::string>& backends, BackendPool::Policy policy)
+{
+	BackendPoolPtr pool = this->find_pool(name);
+	if(!pool)
+	{
+		pool.reset(new BackendPool(name, policy));
+		this->pools.push_back(pool);
+	}
+	pool->set_backends(backends);
+}
+
+bool Proxy::add_route(const std::string& prefix, const std::string& pool_name)
+{
+	BackendPoolPtr pool = this->find_pool(pool_name);
+	if(!pool)
+	{
+		Message::error() << "unknown backend pool " << pool_name << '\n';
+		return false;
+	}
+
+	// longest prefix first
+	Route route;
+	route.prefix = prefix;
+	route.pool = pool;
+
+	std::vector<Route>::iterator it = this->routes.begin();
+	while(it != this->routes.end() && it->prefix.size() >= prefix.size())
+	{
+		++it;
+	}
+	this->routes.insert(it, route);
+	return true;
+}
+
+BackendPoolPtr Proxy::find_pool(const std::string& name) const
+{
+	for(size_t i = 0; i < this->pools.size(); i++)
+	{
+		if(this->pools[i]->get_name() == name)
+			return this->pools[i];
+	}
+	return BackendPoolPtr();
+}
+
+BackendPoolPtr Proxy::find_route(const std::string& url) const
+{
+	for(size_t i = 0; i < this->routes.size(); i++)
+	{
+		if(url.compare(0, this->routes[i].prefix.size(), this->routes[i].prefix) == 0)
+			return this->routes[i].pool;
+	}
+	return BackendPoolPtr();
+}
+
+std::string Proxy::upstream_host(const http::Request& request, BackendPtr& backend) const
+{
+	if(this->routes.empty())
+	{
+		return extract_host(request);
+	}
+
+	BackendPoolPtr pool = this->find_route(request.url());
+	if(pool)
+	{
+		// hash the whole URL so every object sticks to one backend's cache
+		backend = pool->select(request.url());
+	}
+
+	return backend ? backend->get_address() : std::string();
+}
+
+void Proxy::enable_hedging(double percentile, double budget)
+{
+	this->hedge_percentile = percentile;
+	this->hedge_budget = budget;
+	this->hedge_tokens = HEDGE_BURST;
+}
+
+void Proxy::hedge(PendingRequest& answered, Socket& s_server, std::string& server_host)
+{
+	// every eligible request earns a fraction of a hedge, that caps the extra load
+	{
+		boost::unique_lock<boost::mutex> lock(this->hedge_guard);
+		this->hedge_tokens += this->hedge_budget;
+		if(this->hedge_tokens > HEDGE_BURST)
+			this->hedge_tokens = HEDGE_BURST;
+	}
+
+	if(this->upstream_latency.count() < HEDGE_MIN_SAMPLES)
+		return;
+
+	// the response has until the chosen latency percentile before we ask somebody else as well
+	const boost::uint64_t delay = this->upstream_latency.percentile(this->hedge_percentile);
+	const boost::uint64_t waited = Clock::now() - answered.sent;
+	if(waited < delay)
+	{
+		const boost::uint64_t remaining = delay - waited;
+		if(s_server.select_read((long)(remaining / 1000000), (long)(remaining % 1000000)))
+			return;
+	}
+
+	{
+		boost::unique_lock<boost::mutex> lock(this->hedge_guard);
+		if(this->hedge_tokens < 1.0)
+			return;
+		this->hedge_tokens -= 1.0;
+	}
+
+	// another backend of the pool if there is one, otherwise another connection to the same upstream
+	BackendPtr backend;
+	std::string host = server_host;
+	if(answered.backend)
+	{
+		BackendPoolPtr pool = this->find_route(answered.url);
+		if(pool)
+		{
+			backend = pool->select(answered.url, answered.backend);
+		}
+		if(backend)
+		{
+			host = backend->get_address();
+		}
+	}
+
+	Socket s_hedge = this->connect(host);
+	if(!s_hedge.valid() || s_hedge.send(answered.header.data(), answered.header.size()) != answered.header.size())
+	{
+		s_hedge.close();
+		return;
+	}
+	if(!answered.keep_alive)
+	{
+		s_hedge.shutdown(false, true);
+	}
+
+	Stats::increment(Stats::HEDGES);
+	const boost::uint64_t hedge_sent = Clock::now();
+
+	// first response wins, closing the other connection cancels its request
+	const Socket candidates[] = { s_server, s_hedge };
+	if(Socket::select_read(candidates, 2, KEEPALIVE_TIMEOUT) == 1)
+	{
+		Stats::increment(Stats::HEDGE_WINS);
+
+		s_server.close();
+		s_server = s_hedge;
+		server_host = host;
+
+		if(answered.backend)
+			answered.backend->release();
+		if(backend)
+			backend->acquire();
+		answered.backend = backend;
+		answered.sent = hedge_sent;
+	}
+	else
+	{
+		s_hedge.close();
+	}
+}
+
+std::string Proxy::extract_host(const http::Request& request)
+{
+	std::string host;
+
+	if(request.has_header("Host"))
+	{
+		host = request.header("Host");
+	}
+	else
+	{
+		host = request.url();
+	}
+
+	return host;
+}
+
+Socket Proxy::connect(const std::string& host)
+{
+	CircuitBreaker::Failure failure;
+	return this->connect(host, failure);
+}
+
+Socket Proxy::connect(const std::string& host, CircuitBreaker::Failure& failure)
+{
+	Socket socket;
+
+	// known to be down, don't even try
+	failure = CircuitBreaker::NONE;
+	if(!this->breaker.allow(host, failure))
+	{
+		return socket;
+	}
+	failure = CircuitBreaker::RESOLVE;
+
+	// "name[:port]", http::Url can't parse that without a schema
+	const bool secure = !this->tls_origins.empty() && this->tls_origins.count(host) > 0;
+
+	std::string name = host;
+	size_t colon = host.rfind(':');
+	{
+		SocketAddress::port_t port = secure ? 443 : 80;
+		if(colon != std::string::npos)
+		{
+			name = host.substr(0, colon);
+			port = atoi(host.c_str() + colon + 1);
+		}
+
+		PROXY_PROBE(dns_start);
+		Address addr = Address::fromHost(name);
+		PROXY_PROBE1(dns_end, !addr.isAny());
+		if(!addr.isAny())
+		{
+			socket = Socket(Socket::INET, Socket::STREAM);
+			socket.tune(this->upstream_tuning); // buffer sizes and TFO have to be set before connecting
+			SocketAddress sock_addr(SocketAddress::INET, addr, port);
+
+			PROXY_PROBE(connect_start);
+			Socket::ConnectStatus status = socket.connect(sock_addr, CONNECT_TIMEOUT);
+			if(status == Socket::CONNECTED)
+			{
+				failure = CircuitBreaker::NONE;
+
+				// sessions are cached per origin, so a reconnect is an abbreviated handshake
+				if(secure)
+				{
+					std::vector<std::string> alpn(1, this->http2_origin(host) ? "h2" : "http/1.1");
+					std::string negotiated;
+					if(!this->tls || !this->tls->connect(socket, host, name, alpn, negotiated, CONNECT_TIMEOUT) ||
+					   (alpn[0] == "h2" && negotiated != "h2"))
+					{
+						failure = CircuitBreaker::HANDSHAKE;
+						socket.close();
+					}
+				}
+			}
+			else
+			{
+				failure = status == Socket::TIMED_OUT ? CircuitBreaker::TIMEOUT : CircuitBreaker::REFUSED;
+				socket.close();
+			}
+		}
+	}
+
+	PROXY_PROBE1(connect_end, failure);
+
+	if(failure != CircuitBreaker::NONE)
+	{
+		this->breaker.report_failure(host, failure);
+	}
+
+	return socket;
+}
+
+std::string Proxy::receive_message_header(http::Message& message, Socket socket)
+{
+	assert(socket.valid());
 
 	std::string content;
 
-	message.clear();
+	message.clear();
+
+	if(!socket.select_read(KEEPALIVE_TIMEOUT))
+	{
+		Message::error() << "select failed" << '\n';
+		return content;
+	}
+
+	const size_t BUF_SIZE = 4096;
+	char buf[BUF_SIZE];
+
+	do 
+	{
+		int read = socket.recv(buf, sizeof(buf), Socket::PEEK);
+		if(read < 0)
+		{
+			Message::error() << "recv < 0" << '\n';
+			break;
+		}
+
+		size_t parsed = 0;
+
+		try
+		{
+			parsed = message.feed(buf, read);
+		}
+		catch (const http::Error& e)
+		{
+			Message::error() << e.what() << '\n';
+			break;
+		}
+
+		if(parsed == 0)
+		{
+			// EOF (read is 0)
+			Message::warning() << "eof" << '\n';
+			break;
+		}
+
+		socket.recv(buf, parsed); // remove from queue
+		content.append(buf, parsed);
+	}
+	while(!message.headers_complete());
+
+	PROXY_PROBE2(header_complete, dynamic_cast<const http::Response*>(&message) != NULL, content.size());
+
+	return content;
+}
+
+bool Proxy::forward_message(const std::string& header, http::Message& message, Socket from, Socket to, InflightFetch* tee, const Shaper::Flow* flow)
+{
+	assert(message.headers_complete());
+	assert(from.valid());
+	assert(to.valid() || tee); // no destination is fine if we only fill the tee
+
+	// hold the header back if body bytes are already waiting, so both leave in one
+	// sendmsg() and ideally one segment. Otherwise don't delay it on a slow sender.
+	// An empty header went out already (100-continue), only the body is left.
+	bool header_pending = !header.empty() && to.valid() && !message.complete() && from.select_read(0);
+	if(!header_pending && !header.empty() && to.valid())
+	{
+		if(to.send(header.data(), header.size()) != header.size())
+		{
+			return false;
+		}
+	}
+
+	if(tee && !header.empty())
+	{
+		tee->append(header.data(), header.size());
+	}
+
+	const size_t BUF_SIZE = 4096;
+	char buf[BUF_SIZE];
+	Memory::Charge buffer(Memory::IO_BUFFERS, BUF_SIZE);
+	size_t body = 0;
+
+	while(!message.complete())
+	{
+		// short on memory, leave the data with the sender for a bit
+		if(Memory::throttle())
+		{
+			Stats::increment(Stats::MEMORY_THROTTLES);
+		}
+
+		int read = from.recv(buf, sizeof(buf), Socket::PEEK);
+		if(read < 0)
+		{
+			Message::error() << "recv < 0" << '\n';
+			break;
+		}
+
+		size_t parsed = 0;
+
+		try
+		{
+			parsed = message.feed(buf, read);
+		}
+		catch(const http::Error& e)
+		{
+			Message::error() << e.what() << '\n';
+			break;
+		}
+
+		// with pipelining, bytes past the end of this message belong to the next one
+		// and stay queued on the socket since we only peeked at them
+
+		if(parsed == 0)
+		{
+			// EOF (read is 0)
+			Message::warning() << "eof" << '\n';
+			break;
+		}
+
+		from.recv(buf, parsed);
+
+		if(body == 0)
+		{
+			PROXY_PROBE1(first_body_byte, dynamic_cast<const http::Response*>(&message) != NULL);
+		}
+		body += parsed;
+
+		// waiting here leaves the rest in the socket buffer, so TCP slows the sender down for us
+		if(flow)
+		{
+			Shaper::pace(*flow, parsed);
+		}
+
+		if(tee)
+		{
+			tee->append(buf, parsed);
+		}
+
+		// a full buffer means the socket most likely has more queued up
+		bool more = !message.complete() && read == sizeof(buf);
+
+		if(header_pending)
+		{
+			const Socket::Buffer parts[] = { { header.data(), header.size() }, { buf, parsed } };
+			if(to.send(parts, 2, more) != header.size() + parsed)
+			{
+				return false;
+			}
+			header_pending = false;
+		}
+		else if(to.valid())
+		{
+			to.send(buf, parsed, more);
+		}
+	}
+
+	if(header_pending)
+	{
+		// the body never arrived, the header still has to go out
+		to.send(header.data(), header.size());
+	}
+
+	PROXY_PROBE2(message_complete, dynamic_cast<const http::Response*>(&message) != NULL, header.size() + body);
+
+	return message.complete();
+}
+
+bool Proxy::negotiate_gzip(const http::Request& request) const
+{
+	// chunked responses need HTTP/1.1
+	return this->compress_min_size > 0 &&
+	       request.method() == http::Method::get() &&
+	       (request.major_version() > 1 || (request.major_version() == 1 && request.minor_version() >= 1)) &&
+	       request.has_header("Accept-Encoding") &&
+	       Compressor::accepts(request.header("Accept-Encoding"));
+}
+
+bool Proxy::gzip_variant(const std::string& key)
+{
+	const std::string suffix = "\ngzip";
+	return key.size() >= suffix.size() && key.compare(key.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+bool Proxy::should_compress(const http::Response& response) const
+{
+	if(this->compress_min_size == 0 ||
+	   response.status() != 200 ||
+	   response.upgrade() ||
+	   response.has_header("Content-Encoding") ||
+	   !response.has_header("Content-Type") ||
+	   !Compressor::compressible(response.header("Content-Type")))
+	{
+		return false;
+	}
+
+	// tiny bodies grow rather than shrink
+	if(response.has_header("Content-Length") &&
+	   std::strtoul(response.header("Content-Length").c_str(), NULL, 10) < this->compress_min_size)
+	{
+		return false;
+	}
+
+	return !response.has_header("Cache-Control") ||
+	       Cache::directive(response.header("Cache-Control"), "no-transform") < 0;
+}
+
+bool Proxy::forward_compressed(const std::string& header, CapturingResponse& message, Socket from, Socket to, InflightFetch* tee, const Shaper::Flow* flow)
+{
+	assert(message.headers_complete());
+	assert(from.valid());
+	assert(to.valid() || tee);
+
+	Compressor* compressor = Compressor::local();
+	if(!compressor || !compressor->begin())
+	{
+		Message::error() << "no compressor" << '\n';
+		return false;
+	}
+
+	// body bytes read along with the header are in message.body already
+	const size_t header_end = header.find("\r\n\r\n");
+	if(header_end == std::string::npos)
+	{
+		return false;
+	}
+
+	std::string out = compressed_header(header.substr(0, header_end + 4), message);
+	std::string compressed;
+
+	while(true)
+	{
+		const bool complete = message.complete();
+		bool more = false;
+
+		if(!message.body.empty() || complete)
+		{
+			// flush whenever the origin pauses, so streamed responses aren't held back
+			Compressor::Flush flush = complete ? Compressor::FINISH : (from.select_read(0) ? Compressor::NONE : Compressor::SYNC);
+			more = flush == Compressor::NONE;
+
+			compressed.clear();
+			if(!compressor->compress(message.body.data(), message.body.size(), compressed, flush))
+			{
+				Message::error() << "compression failed" << '\n';
+				return false;
+			}
+			message.body.clear();
+
+			if(!compressed.empty())
+			{
+				std::ostringstream chunk_size;
+				chunk_size << std::hex << compressed.size() << "\r\n";
+				out += chunk_size.str();
+				out += compressed;
+				out += "\r\n";
+			}
+
+			if(complete)
+			{
+				out += "0\r\n\r\n";
+			}
+		}
+
+		if(!out.empty())
+		{
+			if(to.valid() && to.send(out.data(), out.size(), more) != out.size())
+			{
+				return false;
+			}
+			if(tee)
+			{
+				tee->append(out.data(), out.size());
+			}
+			out.clear();
+		}
+
+		if(complete)
+		{
+			return true;
+		}
+
+		if(Memory::throttle())
+		{
+			Stats::increment(Stats::MEMORY_THROTTLES);
+		}
+
+		const size_t parsed = feed_message(message, from);
+		if(parsed == 0)
+		{
+			// a body delimited by the connection closing is complete at EOF,
+			// once more around finishes the stream and sends the last chunk
+			if(!message.complete())
+			{
+				return false;
+			}
+			continue;
+		}
+
+		if(flow)
+		{
+			Shaper::pace(*flow, parsed);
+		}
+	}
+}
+
+std::string Proxy::compressed_header(const std::string& header, const http::Response& response)
+{
+	std::string result = set_header(header, "Content-Length", "");
+	result = set_header(result, "Transfer-Encoding", "chunked");
+	result = set_header(result, "Content-Encoding", "gzip");
+
+	// the encoded body is a different representation, its validator can only be weak
+	if(response.has_header("ETag"))
+	{
+		const std::string etag = response.header("ETag");
+		if(etag.compare(0, 2, "W/") != 0)
+		{
+			result = set_header(result, "ETag", "W/" + etag);
+		}
+	}
+
+	std::string vary = response.has_header("Vary") ? response.header("Vary") : std::string();
+	if(vary != "*")
+	{
+		result = set_header(result, "Vary", vary.empty() ? "Accept-Encoding" : vary + ", Accept-Encoding");
+	}
+
+	return result;
+}
+
+std::string Proxy::set_header(const std::string& header, const std::string& name, const std::string& value)
+{
+	size_t end = header.find("\r\n\r\n");
+	if(end == std::string::npos)
+	{
+		return header;
+	}
+	end += 2; // keep the last field's line break
+
+	std::string result;
+	result.reserve(header.size() + name.size() + value.size() + 4);
+
+	// status/request line first, then every field but the one we replace
+	size_t pos = header.find("\r\n") + 2;
+	result.append(header, 0, pos);
+
+	while(pos < end)
+	{
+		size_t line_end = header.find("\r\n", pos) + 2;
+
+		bool match = line_end - pos > name.size() && header[pos + name.size()] == ':';
+		for(size_t i = 0; match && i < name.size(); i++)
+		{
+			match = std::tolower((unsigned char)header[pos + i]) == std::tolower((unsigned char)name[i]);
+		}
+
+		if(!match)
+		{
+			result.append(header, pos, line_end - pos);
+		}
+		pos = line_end;
+	}
+
+	if(!value.empty())
+	{
+		result += name + ": " + value + "\r\n";
+	}
+
+	// the empty line and whatever body bytes followed
+	result.append(header, end, std::string::npos);
+	return result;
+}
+
+std::string Proxy::header_field(const std::string& header, const std::string& name)
+{
+	const size_t end = header.find("\r\n\r\n");
+	size_t pos = header.find("\r\n");
+	while(pos != std::string::npos && pos < end)
+	{
+		pos += 2;
+		const size_t line_end = header.find("\r\n", pos);
+
+		bool match = line_end - pos > name.size() && header[pos + name.size()] == ':';
+		for(size_t i = 0; match && i < name.size(); i++)
+		{
+			match = std::tolower((unsigned char)header[pos + i]) == std::tolower((unsigned char)name[i]);
+		}
+
+		if(match)
+		{
+			size_t value = pos + name.size() + 1;
+			while(value < line_end && (header[value] == ' ' || header[value] == '\t'))
+				value++;
+			return header.substr(value, line_end - value);
+		}
+		pos = line_end;
+	}
+	return std::string();
+}
+
+size_t Proxy::feed_message(http::Message& message, Socket socket)
+{
+	const size_t BUF_SIZE = 4096;
+	char buf[BUF_SIZE];
+
+	int read = socket.recv(buf, sizeof(buf), Socket::PEEK);
+	if(read < 0)
+	{
+		Message::error() << "recv < 0" << '\n';
+		return 0;
+	}
+
+	size_t parsed = 0;
+
+	try
+	{
+		parsed = message.feed(buf, read);
+	}
+	catch(const http::Error& e)
+	{
+		Message::error() << e.what() << '\n';
+		return 0;
+	}
+
+	if(parsed == 0)
+	{
+		// EOF (read is 0)
+		Message::warning() << "eof" << '\n';
+		return 0;
+	}
+
+	socket.recv(buf, parsed); // remove from queue
+	return parsed;
+}
+
+Http2ConnectionPtr Proxy::http2_connection(const std::string& host)
+{
+	Http2ConnectionPtr best;
+	std::vector<Http2ConnectionPtr> retired; // their last streams may close them, not under our lock
+
+	{
+		boost::unique_lock<boost::mutex> lock(this->http2_guard);
+
+		// connections that got a GOAWAY or broke leave the pool, running streams keep them alive
+		std::vector<Http2ConnectionPtr>& connections = this->http2_connections[host];
+		for(size_t i = 0; i < connections.size(); )
+		{
+			if(!connections[i]->usable())
+			{
+				retired.push_back(connections[i]);
+				connections.erase(connections.begin() + i);
+				continue;
+			}
+
+			if(!best || connections[i]->get_streams() < best->get_streams())
+			{
+				best = connections[i];
+			}
+			i++;
+		}
 
-	if(!socket.select_read(KEEPALIVE_TIMEOUT))
+		if(best && (best->get_streams() < HTTP2_SPREAD || connections.size() >= HTTP2_CONNECTIONS))
+		{
+			return best;
+		}
+	}
+
+	Socket socket = this->connect(host);
+	if(!socket.valid())
 	{
-		Message::error() << "select failed" << '\n';
-		return content;
+		return best;
 	}
 
-	const size_t BUF_SIZE = 4096;
-	char buf[BUF_SIZE];
+	Http2ConnectionPtr connection(new Http2Connection(socket));
+	if(!connection->start())
+	{
+		return best;
+	}
+	Stats::increment(Stats::HTTP2_CONNECTIONS);
 
-	do 
+	boost::unique_lock<boost::mutex> lock(this->http2_guard);
+	this->http2_connections[host].push_back(connection);
+	return connection;
+}
+
+Proxy::UpstreamResult Proxy::forward_http2(const std::string& request_header, CapturingRequest& request, const std::string& host, const BackendPtr& backend, Socket s_client, const boost::shared_ptr<InflightFetch>& fetch, const Shaper::Flow* flow, bool& keep_alive)
+{
+	Hpack::HeaderList fields;
+	http2_request_fields(request_header, host, this->tls_origins.count(host) ? "https" : "http", fields);
+
+	if(backend)
 	{
-		int read = socket.recv(buf, sizeof(buf), Socket::PEEK);
-		if(read < 0)
+		backend->acquire();
+	}
+
+	// a refused stream (GOAWAY or REFUSED_STREAM) was never processed, bodiless requests get another try
+	const bool bodiless = request.complete() && request.body.empty();
+	const boost::uint64_t sent = Clock::now();
+
+	Http2ConnectionPtr connection;
+	Http2StreamPtr stream;
+	int status = 0;
+	Hpack::HeaderList response_fields;
+
+	for(int attempt = 0; attempt < 2 && status == 0; attempt++)
+	{
+		connection = this->http2_connection(host);
+		if(!connection)
 		{
-			Message::error() << "recv < 0" << '\n';
 			break;
 		}
 
-		size_t parsed = 0;
-
-		try
+		stream = connection->open(fields, bodiless, KEEPALIVE_TIMEOUT);
+		if(!stream)
 		{
-			parsed = message.feed(buf, read);
+			Stats::increment(Stats::HTTP2_RETRIES);
+			continue;
 		}
-		catch (const http::Error& e)
+		Stats::increment(Stats::HTTP2_STREAMS);
+
+		if((bodiless || send_http2_body(*connection, stream, request, s_client)) &&
+		   connection->wait_response(stream, KEEPALIVE_TIMEOUT, status, response_fields))
 		{
-			Message::error() << e.what() << '\n';
 			break;
 		}
 
-		if(parsed == 0)
+		const bool retry = bodiless && connection->refused(stream);
+		connection->close(stream);
+		status = 0;
+
+		if(!retry)
 		{
-			// EOF (read is 0)
-			Message::warning() << "eof" << '\n';
 			break;
 		}
+		Stats::increment(Stats::HTTP2_RETRIES);
+	}
 
-		socket.recv(buf, parsed); // remove from queue
-		content.append(buf, parsed);
+	const boost::uint64_t latency = Clock::now() - sent;
+
+	if(status == 0 || status >= 500)
+	{
+		// connect() reported it already if we never got a connection
+		if(connection)
+			this->breaker.report_failure(host, CircuitBreaker::RESPONSE);
+		if(backend)
+			backend->report_failure();
+	}
+	else
+	{
+		this->upstream_latency.record(latency);
+		this->breaker.report_success(host);
+		if(backend)
+			backend->report_success(latency);
 	}
-	while(!message.headers_complete());
 
-	return content;
-}
+	if(status == 0)
+	{
+		if(backend)
+			backend->release();
+		return UPSTREAM_FAILED;
+	}
 
-bool Proxy::forward_message(const std::string& header, http::Message& message, Socket from, Socket to)
-{
-	assert(header.length() > 0);
-	assert(message.headers_complete());
-	assert(from.valid());
-	assert(to.valid());
+	// translate the response header, HTTP/1.1 needs to know where the body ends
+	const bool head = request.method() == http::Method::head();
+	const bool no_body = head || status == 204 || status == 304 || (status >= 100 && status < 200);
+	const bool client_11 = request.major_version() > 1 || (request.major_version() == 1 && request.minor_version() >= 1);
 
-	if(to.send(header.data(), header.size()) != header.size())
+	std::ostringstream header_stream;
+	header_stream << "HTTP/1.1 " << status << ' ' << reason_phrase(status) << "\r\n";
+
+	bool has_length = false;
+	for(size_t i = 0; i < response_fields.size(); i++)
 	{
-		return false;
+		const Hpack::Header& field = response_fields[i];
+		if(!field.first.empty() && field.first[0] == ':')
+			continue;
+		if(field.first == "content-length")
+			has_length = true;
+		header_stream << field.first << ": " << field.second << "\r\n";
 	}
 
-	const size_t BUF_SIZE = 4096;
-	char buf[BUF_SIZE];
+	bool chunked = false;
+	if(!has_length && !no_body)
+	{
+		if(connection->finished(stream))
+		{
+			header_stream << "Content-Length: 0\r\n";
+		}
+		else if(client_11)
+		{
+			header_stream << "Transfer-Encoding: chunked\r\n";
+			chunked = true;
+		}
+		else
+		{
+			keep_alive = false; // delimited by closing the connection
+		}
+	}
 
-	while(!message.complete())
+	if(!client_11)
 	{
-		int read = from.recv(buf, sizeof(buf), Socket::PEEK);
-		if(read < 0)
+		header_stream << (keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+	}
+	header_stream << "\r\n";
+
+	const std::string header = header_stream.str();
+
+	// parsed again for the cache and the followers
+	http::Response response;
+	try
+	{
+		response.feed(header.data(), header.size());
+	}
+	catch(const http::Error& e)
+	{
+		Message::error() << e.what() << '\n';
+	}
+
+	boost::shared_ptr<InflightFetch> tee = fetch;
+	if(tee)
+	{
+		bool shared = response.headers_complete() && this->shareable(response);
+		tee->start(shared, keep_alive);
+		if(!shared)
 		{
-			Message::error() << "recv < 0" << '\n';
-			break;
+			this->inflight.complete(tee, false);
+			tee.reset();
 		}
+	}
 
-		size_t parsed = 0;
+	bool relayed = s_client.send(header.data(), header.size()) == header.size();
+	if(tee)
+	{
+		tee->append(header.data(), header.size());
+	}
 
-		try
+	std::string chunk;
+	std::string out;
+	while(relayed && !no_body && connection->read(stream, chunk, KEEPALIVE_TIMEOUT))
+	{
+		if(flow)
 		{
-			parsed = message.feed(buf, read);
+			Shaper::pace(*flow, chunk.size());
 		}
-		catch(const http::Error& e)
+
+		out.clear();
+		if(chunked)
 		{
-			Message::error() << e.what() << '\n';
-			break;
+			std::ostringstream chunk_size;
+			chunk_size << std::hex << chunk.size() << "\r\n";
+			out = chunk_size.str() + chunk + "\r\n";
+		}
+		else
+		{
+			out.swap(chunk);
 		}
 
-		if(parsed < read && message.complete())
+		relayed = s_client.send(out.data(), out.size()) == out.size();
+		if(tee)
 		{
-			Message::error() << "read too much" << '\n';
-			break;
+			tee->append(out.data(), out.size());
 		}
+	}
 
-		if(parsed == 0)
+	const bool complete = relayed && (no_body || connection->finished(stream));
+	connection->close(stream);
+
+	if(complete && chunked)
+	{
+		const char LAST_CHUNK[] = "0\r\n\r\n";
+		s_client.send(LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
+		if(tee)
 		{
-			// EOF (read is 0)
-			Message::warning() << "eof" << '\n';
-			break;
+			tee->append(LAST_CHUNK, sizeof(LAST_CHUNK) - 1);
 		}
+	}
 
-		from.recv(buf, parsed);
-		to.send(buf, parsed);
+	if(tee)
+	{
+		if(complete && tee->get_state() == InflightFetch::SHARED)
+		{
+			this->store_response(tee->get_key(), request_header, host, response, tee->get_data());
+		}
+		this->inflight.complete(tee, complete);
 	}
 
-	return message.complete();
+	if(backend)
+	{
+		backend->release();
+	}
+
+	return complete ? UPSTREAM_DONE : UPSTREAM_BROKEN;
+}
+
+bool Proxy::send_http2_body(Http2Connection& connection, const Http2StreamPtr& stream, CapturingRequest& request, Socket s_client)
+{
+	// body bytes read along with the header are in request.body already
+	while(true)
+	{
+		const bool complete = request.complete();
+
+		if(!request.body.empty() || complete)
+		{
+			if(!connection.send_data(stream, request.body.data(), request.body.size(), complete, KEEPALIVE_TIMEOUT))
+			{
+				return false;
+			}
+			request.body.clear();
+		}
+
+		if(complete)
+		{
+			return true;
+		}
+
+		if(feed_message(request, s_client) == 0)
+		{
+			return false;
+		}
+	}
+}
+
+void Proxy::http2_request_fields(const std::string& request_header, const std::string& host, const std::string& scheme, Hpack::HeaderList& fields)
+{
+	const size_t header_end = request_header.find("\r\n\r\n");
+	const size_t line_end = request_header.find("\r\n");
+
+	// "METHOD target HTTP/1.x", a proxy gets absolute targets
+	const std::string line = request_header.substr(0, line_end);
+	const size_t method_end = line.find(' ');
+	const size_t target_end = line.rfind(' ');
+	const std::string method = line.substr(0, method_end);
+	std::string path = method_end < target_end ? line.substr(method_end + 1, target_end - method_end - 1) : std::string("/");
+
+	const size_t scheme_end = path.find("://");
+	if(scheme_end != std::string::npos && path[0] != '/')
+	{
+		const size_t path_start = path.find('/', scheme_end + 3);
+		path = path_start == std::string::npos ? std::string("/") : path.substr(path_start);
+	}
+
+	std::string authority = host;
+	Hpack::HeaderList regular;
+
+	size_t pos = line_end + 2;
+	while(pos < header_end)
+	{
+		size_t next = request_header.find("\r\n", pos);
+		const std::string field = request_header.substr(pos, next - pos);
+		pos = next + 2;
+
+		const size_t colon = field.find(':');
+		if(colon == std::string::npos)
+			continue;
+
+		std::string name = field.substr(0, colon);
+		for(size_t i = 0; i < name.size(); i++)
+		{
+			name[i] = (char)std::tolower((unsigned char)name[i]);
+		}
+
+		size_t value_start = colon + 1;
+		while(value_start < field.size() && (field[value_start] == ' ' || field[value_start] == '\t'))
+			value_start++;
+		const std::string value = field.substr(value_start);
+
+		if(name == "host")
+		{
+			authority = value;
+			continue;
+		}
+
+		// connection specific fields are forbidden in HTTP/2, our credentials aren't the origin's business
+		if(name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+		   name == "transfer-encoding" || name == "upgrade" || name == "proxy-authorization" ||
+		   (name == "te" && value != "trailers"))
+		{
+			continue;
+		}
+
+		regular.push_back(Hpack::Header(name, value));
+	}
+
+	fields.push_back(Hpack::Header(":method", method));
+	fields.push_back(Hpack::Header(":scheme", scheme));
+	fields.push_back(Hpack::Header(":authority", authority));
+	fields.push_back(Hpack::Header(":path", path));
+	fields.insert(fields.end(), regular.begin(), regular.end());
+}
+
+bool Proxy::acl_denies(const http::Request& request) const
+{
+	if(!this->acl.enabled())
+		return false;
+
+	// proxies get absolute URLs, the authority there is the one that counts
+	std::string url = request.url();
+	std::string host;
+	if(url.compare(0, 7, "http://") == 0)
+	{
+		host = url.substr(7, url.find_first_of("/?", 7) - 7);
+	}
+	else
+	{
+		host = extract_host(request);
+		if(!url.empty() && url[0] == '/')
+		{
+			url = "http://" + host + url;
+		}
+	}
+
+	return this->acl.denies(host, url);
 }
 
 bool Proxy::check_authorization(const http::Request& request) const
@@ -355,13 +2976,26 @@ bool Proxy::check_authorization(const http::Request& request) const
 		Authentication auth_val(auth_str);
 		if(this->auth.end() != std::find(this->auth.begin(), this->auth.end(), auth_val))
 		{
+			PROXY_PROBE1(auth, 1);
 			return true;
 		}
 	}
 
+	PROXY_PROBE1(auth, 0);
 	return false;
 }
 
+std::string Proxy::authenticated_user(const http::Request& request, const std::string& client) const
+{
+	// only called after check_authorization() passed
+	if(!this->auth.empty() && request.has_header("Proxy-Authorization"))
+	{
+		return Authentication(request.header("Proxy-Authorization")).get_name();
+	}
+
+	return client;
+}
+
 bool Proxy::send_invalid_authorization_response(const http::Request& request, Socket socket)
 {
 	std::ostringstream http_ver;
@@ -370,41 +3004,249 @@ bool Proxy::send_invalid_authorization_response(const http::Request& request, So
 	return(socket.send(response.data(), response.size()) == response.size());
 }
 
-void Proxy::enqueue_incoming(Socket socket)
+bool Proxy::status_request(const http::Request& request) const
+{
+	if(this->status_path.empty() || request.url() != this->status_path)
+		return false;
+
+	// as a forward proxy, origin-form requests are meant for us, as a reverse proxy they're meant for the origin
+	if(this->routes.empty())
+		return true;
+
+	return !this->status_authority.empty() && request.has_header("Host") && lower(request.header("Host")) == lower(this->status_authority);
+}
+
+bool Proxy::send_status_response(const http::Request& request, Socket socket) const
+{
+	std::ostringstream report;
+	report << Stats::report()
+	       << "upstream_latency_p50_us " << this->upstream_latency.percentile(50.0) << '\n'
+	       << "upstream_latency_p90_us " << this->upstream_latency.percentile(90.0) << '\n'
+	       << "upstream_latency_p99_us " << this->upstream_latency.percentile(99.0) << '\n'
+	       << "queue_delay_p50_us " << this->queue_delay.percentile(50.0) << '\n'
+	       << "queue_delay_p99_us " << this->queue_delay.percentile(99.0) << '\n';
+
+	const boost::uint64_t handshakes = Stats::get(Stats::TLS_HANDSHAKES);
+	if(handshakes > 0)
+	{
+		report << "tls_resumption_ratio " << (double)Stats::get(Stats::TLS_RESUMED) / handshakes << '\n';
+	}
+
+	// prefetches still waiting for their client count neither way
+	const boost::uint64_t settled = Stats::get(Stats::PREFETCH_USED) + Stats::get(Stats::PREFETCH_WASTED);
+	if(settled > 0)
+	{
+		report << "prefetch_accuracy " << (double)Stats::get(Stats::PREFETCH_USED) / settled << '\n';
+	}
+
+	Memory::report(report);
+	this->telemetry.report(report);
+
+	const std::string body = report.str();
+
+	std::ostringstream response;
+	response << "HTTP/" << request.major_version() << '.' << request.minor_version() << " 200 OK\r\n"
+	         << "Content-Type: text/plain\r\n"
+	         << "Content-Length: " << body.size() << "\r\n"
+	         << "Cache-Control: no-store\r\n"
+	         << "\r\n"
+	         << body;
+
+	const std::string str = response.str();
+	return(socket.send(str.data(), str.size()) == str.size());
+}
+
+bool Proxy::send_error_response(const http::Request& request, Socket socket, int status, const std::string& reason)
+{
+	std::ostringstream response;
+	response << "HTTP/" << request.major_version() << '.' << request.minor_version() << ' ' << status << ' ' << reason << "\r\n"
+	         << "Content-Length: 0\r\n"
+	         << "\r\n";
+
+	const std::string str = response.str();
+	return(socket.send(str.data(), str.size()) == str.size());
+}
+
+void Proxy::log_access(boost::uint64_t id, const std::string& client, const std::string& request_header, const std::string& host, int status,
+                       boost::uint64_t started, boost::uint64_t ttfb, const TcpInfo& client_tcp, const TcpInfo& origin_tcp)
+{
+	std::string request_line = request_header.substr(0, request_header.find("\r\n"));
+	for(size_t quote = request_line.find('"'); quote != std::string::npos; quote = request_line.find('"', quote))
+	{
+		request_line.replace(quote, 1, "%22");
+	}
+
+	const std::time_t now = std::time(NULL);
+	std::tm utc;
+#ifdef _WIN32
+	gmtime_s(&utc, &now);
+#else
+	gmtime_r(&now, &utc);
+#endif
+	char stamp[32];
+	std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", &utc);
+
+	// logfmt, the TCP_INFO fields of a side are 0 if it wasn't sampled
+	std::ostringstream line;
+	line << "time=" << stamp
+	     << " conn=" << id
+	     << " client=" << client
+	     << " request=\"" << request_line << '"'
+	     << " host=" << host
+	     << " status=" << status
+	     << " duration_us=" << Clock::now() - started
+	     << " ttfb_us=" << ttfb
+	     << " client_rtt_us=" << client_tcp.rtt
+	     << " client_rttvar_us=" << client_tcp.rtt_var
+	     << " client_retrans=" << client_tcp.retransmits
+	     << " client_cwnd=" << client_tcp.cwnd
+	     << " client_rate=" << client_tcp.delivery_rate
+	     << " origin_rtt_us=" << origin_tcp.rtt
+	     << " origin_rttvar_us=" << origin_tcp.rtt_var
+	     << " origin_retrans=" << origin_tcp.retransmits
+	     << " origin_cwnd=" << origin_tcp.cwnd
+	     << " origin_rate=" << origin_tcp.delivery_rate;
+
+	this->access_log->write(line.str());
+}
+
+void Proxy::record_trace(TraceRecord& record)
+{
+	record.time = record.time > this->trace_start ? record.time - this->trace_start : 0;
+	record.request_header = TraceFile::sanitize(record.request_header);
+
+	if(this->trace->append(record))
+	{
+		Stats::increment(Stats::TRACE_RECORDS);
+	}
+	else
+	{
+		Stats::increment(Stats::TRACE_DROPPED);
+	}
+}
+
+bool Proxy::enqueue_incoming(Socket socket, boost::uint64_t id, const std::string& client)
 {
 	assert(socket.valid());
 
+	FairQueue::Item incoming;
+	incoming.socket = socket;
+	incoming.id = id;
+	incoming.enqueued = Clock::now();
+	incoming.client = client;
+
 	boost::unique_lock<boost::mutex> lock(this->incoming_guard);
 
-	this->incoming_connections.push(socket);
-	this->incoming_indicator.signal();
+	if(!this->incoming_connections.push(incoming))
+	{
+		return false;
+	}
+
+	PROXY_PROBE1(accept, this->incoming_connections.size());
+
+	this->incoming_indicator.notify_one();
+	return true;
 }
 
-Socket Proxy::request_incoming()
+FairQueue::Item Proxy::request_incoming()
 {
-	// wait for a semaphore counter > 0 and automatically decrease the counter
-	this->incoming_indicator.wait();
+	while(true)
+	{
+		FairQueue::Item incoming;
+		bool drop;
+
+		{
+			boost::unique_lock<boost::mutex> lock(this->incoming_guard);
+
+			// interruption point, also wakes up when a client drops below its limit
+			while(!this->incoming_connections.pop(incoming))
+			{
+				this->incoming_indicator.wait(lock);
+			}
+
+			const boost::uint64_t now = Clock::now();
+			const boost::uint64_t sojourn = now - incoming.enqueued;
+			this->queue_delay.record(sojourn);
+
+			drop = this->incoming_codel.should_drop(sojourn, now);
+			if(drop)
+			{
+				this->incoming_connections.finish(incoming.client, 0);
+			}
+		}
+
+		assert(incoming.socket.valid());
 
+		if(!drop)
+		{
+			return incoming;
+		}
+
+		Stats::increment(Stats::SHED_DELAY);
+		PROXY_PROBE_CONNECTION(incoming.id);
+		this->shed(incoming.socket);
+	}
+}
+
+void Proxy::finish_incoming(const std::string& client, boost::uint64_t busy)
+{
 	boost::unique_lock<boost::mutex> lock(this->incoming_guard);
 
-	assert(!this->incoming_connections.empty());
+	this->incoming_connections.finish(client, busy);
+	this->incoming_indicator.notify_one();
+}
+
+void Proxy::shed(Socket socket)
+{
+	if(this->shed_response)
+	{
+		const char RESPONSE[] =
+			"HTTP/1.1 503 Service Unavailable\r\n"
+			"Retry-After: 1\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n"
+			"\r\n";
+		socket.send(RESPONSE, sizeof(RESPONSE) - 1);
+
+		// unread request bytes would turn the close into a reset, taking the response with it
+		char buf[4096];
+		while(socket.select_read(0) && socket.recv(buf, sizeof(buf)) > 0)
+		{
+		}
+	}
+
+	socket.close();
+
+	PROXY_PROBE1(close, 0);
+}
 
-	Socket incoming = this->incoming_connections.front();
-	this->incoming_connections.pop();
+void Proxy::relieve_memory()
+{
+	// a shared cache is mapped once and for all, there's nothing to give back
+	if(!this->cache || this->cache->is_shared())
+		return;
 
-	assert(incoming.valid());
+	const boost::uint64_t excess = Memory::excess();
+	if(excess == 0)
+		return;
 
-	return incoming;
+	if(this->cache->shrink((size_t)excess) > 0)
+	{
+		Stats::increment(Stats::MEMORY_SHRINKS);
+	}
 }
 
 void Proxy::close_unhandled_incoming()
 {
-	boost::unique_lock<boost::mutex> lock(this->incoming_guard);
+	std::vector<Socket> sockets;
+
+	{
+		boost::unique_lock<boost::mutex> lock(this->incoming_guard);
+		this->incoming_connections.clear(sockets);
+	}
 
-	while(!this->incoming_connections.empty())
+	for(size_t i = 0; i < sockets.size(); i++)
 	{
-		Socket socket = this->incoming_connections.front();
-		this->incoming_connections.pop();
-		socket.close();
+		sockets[i].close();
 	}
 }
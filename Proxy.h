@@ -5,12 +5,36 @@
 
 #include <vector>
 #include <queue>
+#include <deque>
+#include <set>
+#include <map>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
-#include "semaphore.hpp"
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
 #include "Socket.h"
 #include <http.hpp>
 #include "Authentication.h"
+#include "Inflight.h"
+#include "Cache.h"
+#include "WorkerPool.h"
+#include "Backend.h"
+#include "Histogram.h"
+#include "CircuitBreaker.h"
+#include "CoDel.h"
+#include "FairQueue.h"
+#include "Shaper.h"
+#include "Compressor.h"
+#include "Http2.h"
+#include "Tls.h"
+#include "Telemetry.h"
+#include "AccessLog.h"
+#include "Trace.h"
+#include "Range.h"
+#include "Prefetch.h"
+#include "Acl.h"
+#include "Memory.h"
+#include <boost/scoped_ptr.hpp>
 
 class Proxy
 {
@@ -22,32 +46,398 @@ public:
 	bool listen(unsigned int max_incoming = 4);
 	void interrupt();
 
+	// prefork mode: listen() binds the port and forks that many worker processes, each accepting
+	// and serving up to max_incoming connections at a time, crashed ones are restarted
+	// The cache and the counters are shared between workers, everything else is per worker.
+	// listen() returns in the workers too once they're done. POSIX only, set before listen()
+	void set_workers(unsigned int workers) { this->workers = workers; }
+
+	// socket profiles for the listening socket (and its accepted connections) and upstream connections
+	void set_listener_tuning(const SocketTuning& tuning) { this->listener_tuning = tuning; }
+	void set_upstream_tuning(const SocketTuning& tuning) { this->upstream_tuning = tuning; }
+
+	// max. requests in flight on one upstream connection, 1 disables upstream pipelining
+	// pipelined client requests are accepted either way and answered in order
+	void set_pipeline_depth(unsigned int depth) { this->pipeline_depth = depth > 0 ? depth : 1; }
+
+	// cache shareable responses with an explicit lifetime, capacity in bytes
+	// grace (seconds) extends stale-while-revalidate and stale-if-error if the origin gives less
+	void enable_cache(size_t capacity, long grace = 0);
+
+	// with the cache on, Range requests are answered from slice_size byte slices of the
+	// object, each fetched from the origin with a range request of its own when missing
+	void enable_slicing(size_t slice_size = DEFAULT_SLICE_SIZE);
+
+	// with the cache on, HTML passing through is scanned for stylesheets, scripts and images
+	// on the same origin, those are fetched into the cache before the client asks for them
+	bool enable_prefetch();
+
+	// requests for hosts or URLs on the list are answered with 403, see AclRules for the format
+	// call again to reload, the list is compiled on the calling thread and swapped in
+	bool load_acl(const std::string& path) { return this->acl.load(path); }
+
+	// reverse proxy mode, enabled by the first route
+	// backends are "host:port", adding an existing pool replaces its members (but not its policy)
+	void add_backend_pool(const std::string& name, const std::vector<std::string>& backends, BackendPool::Policy policy = BackendPool::CONSISTENT_HASH);
+	// requests whose URL starts with prefix go to the pool, the longest prefix wins
+	bool add_route(const std::string& prefix, const std::string& pool);
+
+	// hedge idempotent requests whose response header takes longer than the given
+	// latency percentile (0-100) by sending them to a second upstream as well
+	// budget is the max. share of extra requests, e.g. 0.05
+	void enable_hedging(double percentile, double budget = 0.05);
+
+	// admission control: new connections beyond max_queued, or while CoDel sees the queueing
+	// delay stay high, are shed with a 503 (or just closed if respond is false)
+	// connections already being served keep their worker and are never shed
+	void set_load_shedding(size_t max_queued, bool respond = true) { this->incoming_connections.set_capacity(max_queued); this->shed_response = respond; }
+
+	// waiting connections are admitted per client (source address) by deficit round robin over
+	// the worker time each client used; limit caps the connections one client has in service
+	void set_client_limit(unsigned int limit) { this->incoming_connections.set_client_limit(limit); }
+
+	// answer requests for path on the proxy itself with our counters, off by default
+	// as a forward proxy that's origin-form requests, which aren't meant for any origin;
+	// as a reverse proxy only those with authority as their Host, without one it stays off
+	void enable_status(const std::string& path = DEFAULT_STATUS_PATH, const std::string& authority = std::string()) { this->status_path = path; this->status_authority = authority; }
+
+	// process wide limit on buffers, headers, the cache and log queues, in bytes (0 for none)
+	// a cache shared between workers is fixed in size and not counted
+	// getting close to it shrinks the cache first, then holds back reads and finally sheds new connections
+	void set_memory_budget(boost::uint64_t bytes) { Memory::set_budget(bytes); }
+
+	// relayed bodies are paced to bytes per second at the given level, users are authenticated
+	// names or client addresses, origins upstream hosts; set before listen()
+	void set_bandwidth_limit(Shaper::Level level, boost::uint64_t rate, boost::uint64_t burst = 0) { this->shaper.set_limit(level, rate, burst); }
+
+	// gzip textual responses the origin sent uncompressed to clients accepting it
+	// bodies known to be smaller than min_size are left alone, false if built without zlib
+	bool enable_compression(size_t min_size = 1024);
+
+	// upstream ("host[:port]", as in Host or a backend address) that speaks HTTP/2 without TLS
+	// requests to it become streams multiplexed over a few shared connections
+	void add_http2_origin(const std::string& host) { this->http2_origins.insert(host); }
+
+	// upstreams in add_tls_origin() are reached over TLS (port 443 unless given), ALPN picks
+	// h2 for HTTP/2 origins and http/1.1 otherwise; false if built without OpenSSL
+	bool enable_tls(const TlsSettings& settings = TlsSettings());
+	void add_tls_origin(const std::string& host) { this->tls_origins.insert(host); }
+
+	// one line per answered request, with the client's and the origin's TCP_INFO
+	bool enable_access_log(const std::string& path);
+
+	// records answered requests (sanitized headers, sizes, timing) into a memory mapped
+	// trace of at most capacity bytes for tools/replay; set before listen()
+	bool enable_capture(const std::string& path, size_t capacity = 256 * 1024 * 1024);
+
 private:
 
 	static const unsigned int KEEPALIVE_TIMEOUT = 5U; // seconds
+	static const long COLLAPSE_TIMEOUT = 5L; // seconds a follower waits on an in-flight fetch
+	static const long CONNECT_TIMEOUT = 5L; // seconds
+
+	static const boost::uint64_t HEDGE_MIN_SAMPLES = 100U; // latency samples before we trust the percentile
+	static const int HEDGE_BURST = 10;                      // hedges that may be saved up
+
+	static const size_t DEFAULT_MAX_QUEUED = 1024U;
+	static const boost::uint64_t CODEL_TARGET = 20000U;    // acceptable queueing delay, microseconds
+	static const boost::uint64_t CODEL_INTERVAL = 200000U; // delay above target for that long means overload
+	static const boost::uint64_t FAIR_QUANTUM = 10000U;    // worker time per client and round, microseconds
+
+	static const size_t HTTP2_CONNECTIONS = 2U; // per origin
+	static const size_t HTTP2_SPREAD = 32U;     // streams on a connection before we open the next one
+
+	static const size_t DEFAULT_SLICE_SIZE = 1024U * 1024U;
+	static const size_t SLICE_PARALLEL = 4U; // slice fetches running ahead of what's being sent
+	static const unsigned int SLICE_THREADS = 8U; // background slice fetches, for all clients together
+	static const size_t SLICE_QUEUE = 32U;        // beyond that a client fetches its slices itself, one at a time
+
+	static const unsigned int REFRESH_THREADS = 2U;
+	static const size_t REFRESH_QUEUE = 64U; // refreshes beyond that are dropped
+
+	static const unsigned int PREFETCH_THREADS = 1U; // prefetches stay behind everything else
+	static const size_t PREFETCH_QUEUE = 32U;        // links beyond that are dropped
+
+	static const long WORKER_POLL = 100L;                      // milliseconds between looks at the workers
+	static const boost::uint64_t WORKER_MIN_UPTIME = 1000000U; // microseconds, a worker dying sooner is restarted
+	static const long WORKER_RESTART_DELAY = 1000L;            // milliseconds later
+
+	static const char* const DEFAULT_STATUS_PATH;
 
 	SocketAddress::port_t port;
+	unsigned int workers; // 0 serves from this process
 	std::vector<Authentication> auth;
+	Acl acl;
+
+	std::string status_path; // empty while the status page is off
+	std::string status_authority;
+
+	SocketTuning listener_tuning;
+	SocketTuning upstream_tuning;
+
+	boost::scoped_ptr<TlsClient> tls; // before anything holding upstream connections
+	std::set<std::string> tls_origins;
+
+	unsigned int pipeline_depth;
+
+	struct Route
+	{
+		std::string prefix;
+		BackendPoolPtr pool;
+	};
+
+	std::vector<BackendPoolPtr> pools;
+	std::vector<Route> routes; // longest prefix first
+
+	Histogram upstream_latency; // request sent to response header, microseconds
+
+	Telemetry telemetry; // network conditions by client subnet and origin
+	boost::scoped_ptr<AccessLog> access_log;
+
+	boost::scoped_ptr<TraceFile> trace;
+	boost::uint64_t trace_start; // Clock::now() when the capture started
+
+	CircuitBreaker breaker; // by upstream host
+
+	Shaper shaper;
+
+	size_t compress_min_size; // 0 disables compression
+
+	size_t slice_size; // 0 disables slicing
+
+	std::set<std::string> http2_origins;
+	std::map<std::string, std::vector<Http2ConnectionPtr> > http2_connections; // usable ones, by origin
+	boost::mutex http2_guard;
+
+	double hedge_percentile; // 0 disables hedging
+	double hedge_budget;
+	double hedge_tokens;
+	boost::mutex hedge_guard;
 
 	bool stop_listening;
 
-	std::queue<Socket> incoming_connections;
+	FairQueue incoming_connections;
 	boost::mutex incoming_guard;
-	semaphore incoming_indicator;
+	boost::condition_variable incoming_indicator;
+
+	bool shed_response;
+	CoDel incoming_codel;    // guarded by incoming_guard
+	Histogram queue_delay;   // accept to worker pickup, microseconds
+
+	InflightTable inflight;
+	boost::scoped_ptr<Cache> cache;
+	PrefetchTracker prefetched;
+	boost::scoped_ptr<WorkerPool> refresher; // declared last, its jobs use everything above
+	boost::scoped_ptr<WorkerPool> prefetcher; // same here, NULL unless prefetching is on
+	boost::scoped_ptr<WorkerPool> slicer;     // same here, NULL unless slicing is on
+
+	// a request forwarded upstream that still waits for its response
+	struct PendingRequest
+	{
+		std::string header; // kept for replaying
+		bool head;
+		bool keep_alive;
+		bool pipelined;
+		bool replayed;
+		boost::shared_ptr<InflightFetch> fetch; // set if other connections may stream the response
+		Cache::EntryPtr stale;                  // served instead if the origin fails
+		BackendPtr backend;                     // reverse proxy only
+		boost::uint64_t received;               // Clock::now() when the client's request header was in
+		boost::uint64_t sent;                   // Clock::now() when forwarding started
+		boost::uint64_t body_size;              // request body bytes forwarded
+		std::string url;
+		std::string user;                       // bandwidth is accounted to
+		bool gzip;                              // client takes gzip, compress if the origin didn't
+		bool hedgeable;                         // idempotent and bodiless
+		std::string page_key;                   // cache_key() of a GET whose HTML is scanned for links to prefetch
+		bool interim;                           // the client takes 1xx responses (HTTP/1.1)
+	};
+
+	// keeps the decoded body while capturing, so it can be encoded again
+	template<class Base>
+	class Capturing : public Base
+	{
+	public:
+		std::string body;
+		boost::uint64_t body_size; // decoded bytes seen since capture(), kept or not
+
+		Capturing() : body_size(0), capturing(false), scanner(NULL), charge(Memory::IO_BUFFERS) { }
+		void capture(bool on) { this->capturing = on; this->body.clear(); this->body_size = 0; this->charge.resize(0); }
+		// the decoded body goes through the scanner as well, NULL stops that
+		void scan(LinkScanner* scanner) { this->scanner = scanner; }
+
+	protected:
+		virtual void accept_body(const char* data, std::size_t size)
+		{
+			this->body_size += size;
+			if(this->capturing)
+			{
+				this->body.append(data, size);
+				this->charge.resize(this->body.size());
+			}
+			if(this->scanner)
+				this->scanner->feed(data, size);
+		}
+
+	private:
+		bool capturing;
+		LinkScanner* scanner;
+		Memory::Charge charge; // for body
+	};
+
+	typedef Capturing<http::Request> CapturingRequest;
+	typedef Capturing<http::Response> CapturingResponse;
+
+	enum UpstreamResult
+	{
+		UPSTREAM_DONE,   // response relayed
+		UPSTREAM_FAILED, // nothing sent to the client yet
+		UPSTREAM_BROKEN  // response broke off midway
+	};
+
+	enum CollapseResult
+	{
+		COLLAPSE_SERVED,   // response streamed to the client
+		COLLAPSE_FALLBACK, // nothing sent, fetch it ourselves
+		COLLAPSE_FAILED    // response broke off midway
+	};
+
+	enum ContinueResult
+	{
+		CONTINUE_BODY,     // send the body
+		CONTINUE_REJECTED, // the origin answered with a final status, the body stays with the client
+		CONTINUE_FAILED    // either side went away
+	};
+
+	enum RangeResult
+	{
+		RANGE_SERVED,   // answered from slices
+		RANGE_FALLBACK, // nothing sent, forward it as it is
+		RANGE_FAILED    // response broke off midway
+	};
+
+	// a slice fetched in the background on the slicer pool
+	struct SliceJob
+	{
+		SliceJob() : done(false) { }
+
+		// NULL if the fetch failed
+		Cache::EntryPtr wait()
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+			while(!this->done)
+			{
+				this->finished.wait(lock);
+			}
+			return this->entry;
+		}
+
+		Cache::EntryPtr entry;
+		bool done;
+		boost::mutex guard;
+		boost::condition_variable finished;
+	};
+
+	typedef boost::shared_ptr<SliceJob> SliceJobPtr;
+
+	// master side: forks the workers and restarts crashed ones until interrupted
+	// returns true in a worker, which serves then, false in the master once the workers are gone
+	bool prefork();
 
 	bool thread_handle_connection(int tid);
+	void handle_connection(Socket s_client, boost::uint64_t id, const std::string& client);
+
+	bool pipelinable(const http::Request& request) const;
+
+	static bool expects_continue(const http::Request& request);
+	// after the header went upstream alone, interim responses are relayed if relay is set
+	static ContinueResult await_continue(Socket s_client, Socket s_server, bool relay);
+	static bool send_continue(const http::Request& request, Socket s_client);
+	bool replay_pending(std::deque<PendingRequest>& pending, Socket& s_server, const std::string& host);
+
+	std::string cache_key(const http::Request& request) const;
+	static bool gzip_variant(const std::string& key);
+	static bool collapsible(const http::Request& request);
+	static bool shareable(const http::Response& response);
+	static CollapseResult serve_collapsed(InflightFetch& fetch, Socket s_client);
+
+	bool sliceable(const http::Request& request, const std::string& host) const;
+	RangeResult serve_range(const http::Request& request, const std::string& request_header, const std::string& host, Socket s_client);
+	// cached and from the same version of the object, NULL otherwise
+	Cache::EntryPtr cached_slice(const std::string& base, boost::uint64_t index, const std::string& validator);
+	// fetched with "Range: bytes=...", stored if the origin allows it, NULL if it didn't answer with the slice
+	// with tail set the last slice is asked for as a suffix, index is set to it once the length is known
+	Cache::EntryPtr fetch_slice(const std::string& request_header, const std::string& host, const std::string& base, boost::uint64_t& index, bool tail = false);
+	void run_slice_job(const SliceJobPtr& job, const std::string& request_header, const std::string& host, const std::string& base, boost::uint64_t index);
+	static std::string slice_key(const std::string& base, boost::uint64_t index);
+	// ETag, or Last-Modified without one
+	static std::string validator(const std::string& header);
+
+	void store_response(const std::string& key, const std::string& request_header, const std::string& host, const http::Response& response, const std::string& data);
+	static bool serve_cached(const Cache::Entry& entry, Socket s_client);
+	void schedule_refresh(const std::string& key, const Cache::EntryPtr& entry);
+	void refresh(const std::string& key, const Cache::EntryPtr& entry);
+	// fetches and stores the response unless somebody else is fetching it already (leader is false then)
+	bool fetch_into_cache(const std::string& key, const std::string& request_header, const std::string& host, bool& leader);
+
+	// links are resolved against the page and cached in its Accept-Encoding variant
+	void schedule_prefetches(const PendingRequest& page, const std::string& host, const std::vector<std::string>& links);
+	void prefetch(const std::string& key, const std::string& request_header, const std::string& host);
+
+	BackendPoolPtr find_pool(const std::string& name) const;
+	BackendPoolPtr find_route(const std::string& url) const;
+	std::string upstream_host(const http::Request& request, BackendPtr& backend) const;
+
+	void hedge(PendingRequest& answered, Socket& s_server, std::string& server_host);
 
 	static std::string extract_host(const http::Request& request);
-	static Socket connect(const std::string& host);
+	// fails right away if the breaker considers the upstream down, reports failures to it otherwise
+	Socket connect(const std::string& host);
+	Socket connect(const std::string& host, CircuitBreaker::Failure& failure);
 
 	static std::string receive_message_header(http::Message& message, Socket socket);
-	static bool forward_message(const std::string& header, http::Message& message, Socket from, Socket to);
+	// with an empty header only the body is relayed, the header went out already
+	static bool forward_message(const std::string& header, http::Message& message, Socket from, Socket to, InflightFetch* tee = NULL, const Shaper::Flow* flow = NULL);
+
+	bool negotiate_gzip(const http::Request& request) const;
+	bool should_compress(const http::Response& response) const;
+	// relays the response gzipped and chunked, the body so far has to be captured already
+	static bool forward_compressed(const std::string& header, CapturingResponse& message, Socket from, Socket to, InflightFetch* tee = NULL, const Shaper::Flow* flow = NULL);
+	static std::string compressed_header(const std::string& header, const http::Response& response);
+	// replaces (or with an empty value removes) a header field, body bytes behind the header are kept
+	static std::string set_header(const std::string& header, const std::string& name, const std::string& value);
+	// value of a header field, empty if it's missing
+	static std::string header_field(const std::string& header, const std::string& name);
+	// one more piece of the message from the socket, parsed bytes, 0 on EOF or error
+	static size_t feed_message(http::Message& message, Socket socket);
+
+	bool http2_origin(const std::string& host) const { return !this->http2_origins.empty() && this->http2_origins.count(host) > 0; }
+	Http2ConnectionPtr http2_connection(const std::string& host);
+	// the response goes to the client as HTTP/1.1, the fetch is completed unless nothing was sent
+	UpstreamResult forward_http2(const std::string& request_header, CapturingRequest& request, const std::string& host, const BackendPtr& backend, Socket s_client, const boost::shared_ptr<InflightFetch>& fetch, const Shaper::Flow* flow, bool& keep_alive);
+	static bool send_http2_body(Http2Connection& connection, const Http2StreamPtr& stream, CapturingRequest& request, Socket s_client);
+	static void http2_request_fields(const std::string& request_header, const std::string& host, const std::string& scheme, Hpack::HeaderList& fields);
 
 	bool check_authorization(const http::Request& request) const;
+	bool acl_denies(const http::Request& request) const;
+	std::string authenticated_user(const http::Request& request, const std::string& client) const;
 	static bool send_invalid_authorization_response(const http::Request& request, Socket socket);
+	bool status_request(const http::Request& request) const;
+	bool send_status_response(const http::Request& request, Socket socket) const;
+	static bool send_error_response(const http::Request& request, Socket socket, int status, const std::string& reason);
+
+	// started and ttfb (0 if not applicable) are Clock::now() values and microseconds
+	void log_access(boost::uint64_t id, const std::string& client, const std::string& request_header, const std::string& host, int status,
+	                boost::uint64_t started, boost::uint64_t ttfb, const TcpInfo& client_tcp, const TcpInfo& origin_tcp);
+	// record's time is Clock::now() when the request came in, the header gets sanitized
+	void record_trace(TraceRecord& record);
 
-	void enqueue_incoming(Socket socket);
-	Socket request_incoming();
+	bool enqueue_incoming(Socket socket, boost::uint64_t id, const std::string& client);
+	FairQueue::Item request_incoming();
+	void finish_incoming(const std::string& client, boost::uint64_t busy);
+	void shed(Socket socket);
+	// evicts from the cache what memory pressure asks for
+	void relieve_memory();
 	void close_unhandled_incoming();
 };
 
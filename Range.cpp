@@ -0,0 +1,160 @@
+#include "Range.h"
+
+#include <cstdlib>
+#include <cctype>
+
+namespace
+{
+	// digits only, false on anything else or overflow
+	bool number(const std::string& text, boost::int64_t& value)
+	{
+		if(text.empty() || text.size() > 18)
+			return false;
+
+		value = 0;
+		for(size_t i = 0; i < text.size(); i++)
+		{
+			if(!std::isdigit((unsigned char)text[i]))
+				return false;
+			value = value * 10 + (text[i] - '0');
+		}
+		return true;
+	}
+
+	std::string trim(const std::string& text)
+	{
+		const size_t first = text.find_first_not_of(" \t");
+		if(first == std::string::npos)
+			return std::string();
+		const size_t last = text.find_last_not_of(" \t");
+		return text.substr(first, last - first + 1);
+	}
+}
+
+bool ByteRanges::parse(const std::string& value)
+{
+	this->specs.clear();
+
+	const std::string trimmed = trim(value);
+	if(trimmed.compare(0, 6, "bytes=") != 0)
+		return false;
+
+	size_t pos = 6;
+	while(pos <= trimmed.size())
+	{
+		size_t end = trimmed.find(',', pos);
+		if(end == std::string::npos)
+			end = trimmed.size();
+
+		const std::string spec = trim(trimmed.substr(pos, end - pos));
+		pos = end + 1;
+		if(spec.empty())
+			continue; // "bytes=0-1,,5-6" is allowed
+
+		const size_t dash = spec.find('-');
+		if(dash == std::string::npos)
+			return false;
+
+		Spec parsed;
+		if(dash == 0)
+		{
+			// "-500", the last 500 bytes
+			parsed.first = -1;
+			if(!number(spec.substr(1), parsed.last) || parsed.last == 0)
+				return false;
+		}
+		else
+		{
+			if(!number(spec.substr(0, dash), parsed.first))
+				return false;
+			parsed.last = -1;
+			if(dash + 1 < spec.size() && (!number(spec.substr(dash + 1), parsed.last) || parsed.last < parsed.first))
+				return false;
+		}
+
+		if(this->specs.size() == MAX_RANGES)
+			return false;
+		this->specs.push_back(parsed);
+	}
+
+	return !this->specs.empty();
+}
+
+void ByteRanges::resolve(boost::uint64_t total, std::vector<Range>& ranges) const
+{
+	ranges.clear();
+
+	for(size_t i = 0; i < this->specs.size(); i++)
+	{
+		const Spec& spec = this->specs[i];
+
+		Range range;
+		if(spec.first < 0)
+		{
+			const boost::uint64_t suffix = (boost::uint64_t)spec.last;
+			range.first = suffix < total ? total - suffix : 0;
+			range.last = total - 1;
+		}
+		else
+		{
+			range.first = (boost::uint64_t)spec.first;
+			range.last = spec.last < 0 || (boost::uint64_t)spec.last >= total ? total - 1 : (boost::uint64_t)spec.last;
+		}
+
+		if(total > 0 && range.first < total)
+		{
+			ranges.push_back(range);
+		}
+	}
+}
+
+boost::uint64_t ByteRanges::first_offset() const
+{
+	bool found = false;
+	boost::uint64_t lowest = 0;
+	for(size_t i = 0; i < this->specs.size(); i++)
+	{
+		if(this->specs[i].first < 0)
+			continue;
+		if(!found || (boost::uint64_t)this->specs[i].first < lowest)
+			lowest = (boost::uint64_t)this->specs[i].first;
+		found = true;
+	}
+	return lowest;
+}
+
+bool ByteRanges::suffix_only() const
+{
+	for(size_t i = 0; i < this->specs.size(); i++)
+	{
+		if(this->specs[i].first >= 0)
+			return false;
+	}
+	return !this->specs.empty();
+}
+
+bool ByteRanges::parse_content_range(const std::string& value, boost::uint64_t& first, boost::uint64_t& last, boost::uint64_t& total)
+{
+	const std::string trimmed = trim(value);
+	if(trimmed.compare(0, 6, "bytes ") != 0)
+		return false;
+
+	const size_t dash = trimmed.find('-', 6);
+	const size_t slash = trimmed.find('/', 6);
+	if(dash == std::string::npos || slash == std::string::npos || dash > slash)
+		return false;
+
+	boost::int64_t parsed_first, parsed_last, parsed_total;
+	if(!number(trimmed.substr(6, dash - 6), parsed_first) ||
+	   !number(trimmed.substr(dash + 1, slash - dash - 1), parsed_last) ||
+	   !number(trimmed.substr(slash + 1), parsed_total) ||
+	   parsed_last < parsed_first || parsed_last >= parsed_total)
+	{
+		return false;
+	}
+
+	first = (boost::uint64_t)parsed_first;
+	last = (boost::uint64_t)parsed_last;
+	total = (boost::uint64_t)parsed_total;
+	return true;
+}
@@ -0,0 +1,48 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+
+// The byte ranges of a Range request header (RFC 7233)
+class ByteRanges
+{
+public:
+
+	static const size_t MAX_RANGES = 16U; // more than that is left to the origin
+
+	struct Range
+	{
+		boost::uint64_t first;
+		boost::uint64_t last; // inclusive
+	};
+
+	// false unless value is a "bytes=" range set we handle
+	bool parse(const std::string& value);
+
+	// ranges within a representation of total bytes, empty if none is satisfiable
+	void resolve(boost::uint64_t total, std::vector<Range>& ranges) const;
+
+	// lowest offset asked for that doesn't depend on the length, suffix ranges don't count
+	boost::uint64_t first_offset() const;
+	// true if every range is a suffix ("bytes=-500"), first_offset() means nothing then
+	bool suffix_only() const;
+
+	// "bytes first-last/total" of a 206 response
+	static bool parse_content_range(const std::string& value, boost::uint64_t& first, boost::uint64_t& last, boost::uint64_t& total);
+
+private:
+
+	struct Spec
+	{
+		boost::int64_t first; // -1 for a suffix range
+		boost::int64_t last;  // -1 if open ended, the suffix length for suffix ranges
+	};
+
+	std::vector<Spec> specs;
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include "Shaper.h"
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/locks.hpp>
+#include "Clock.h"
+#include "Stats.h"
+
+TokenBucket::TokenBucket(boost::uint64_t rate, boost::uint64_t burst)
+{
+	this->rate = rate / 1000000.0;
+	this->burst = (double)burst;
+	this->tokens = (double)burst;
+	this->updated = Clock::now();
+}
+
+boost::uint64_t TokenBucket::take(size_t bytes, boost::uint64_t now)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	if(now > this->updated)
+	{
+		this->tokens += (now - this->updated) * this->rate;
+		if(this->tokens > this->burst)
+			this->tokens = this->burst;
+		this->updated = now;
+	}
+
+	this->tokens -= bytes;
+
+	if(this->tokens >= 0.0)
+	{
+		return 0;
+	}
+
+	return (boost::uint64_t)(-this->tokens / this->rate);
+}
+
+Shaper::Shaper()
+{
+	for(size_t i = 0; i < LEVEL_COUNT; i++)
+	{
+		this->limits[i].rate = 0;
+		this->limits[i].burst = 0;
+	}
+}
+
+void Shaper::set_limit(Level level, boost::uint64_t rate, boost::uint64_t burst)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	if(burst == 0)
+	{
+		burst = rate / 10;
+	}
+
+	this->limits[level].rate = rate;
+	this->limits[level].burst = burst;
+
+	// existing connections keep their buckets
+	if(level == GLOBAL)
+		this->global = rate ? TokenBucketPtr(new TokenBucket(rate, burst)) : TokenBucketPtr();
+	else if(level == USER)
+		this->users.clear();
+	else if(level == ORIGIN)
+		this->origins.clear();
+}
+
+bool Shaper::enabled() const
+{
+	for(size_t i = 0; i < LEVEL_COUNT; i++)
+	{
+		if(this->limits[i].rate)
+			return true;
+	}
+
+	return false;
+}
+
+void Shaper::open(Flow& flow) const
+{
+	flow.buckets[GLOBAL] = this->global;
+
+	const Limit& limit = this->limits[CONNECTION];
+	if(limit.rate)
+		flow.buckets[CONNECTION].reset(new TokenBucket(limit.rate, limit.burst));
+	else
+		flow.buckets[CONNECTION].reset();
+}
+
+void Shaper::bind(Flow& flow, const std::string& user, const std::string& origin)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	flow.buckets[USER] = this->find(this->users, user, this->limits[USER]);
+	flow.buckets[ORIGIN] = this->find(this->origins, origin, this->limits[ORIGIN]);
+}
+
+void Shaper::pace(const Flow& flow, size_t bytes)
+{
+	const boost::uint64_t now = Clock::now();
+
+	boost::uint64_t wait = 0;
+	for(size_t i = 0; i < LEVEL_COUNT; i++)
+	{
+		if(flow.buckets[i])
+		{
+			boost::uint64_t level_wait = flow.buckets[i]->take(bytes, now);
+			if(level_wait > wait)
+				wait = level_wait;
+		}
+	}
+
+	if(wait > 0)
+	{
+		Stats::increment(Stats::SHAPER_WAITS);
+		boost::this_thread::sleep(boost::posix_time::microseconds(wait));
+	}
+}
+
+TokenBucketPtr Shaper::find(BucketMap& buckets, const std::string& key, const Limit& limit)
+{
+	if(!limit.rate)
+	{
+		return TokenBucketPtr();
+	}
+
+	BucketMap::iterator it = buckets.find(key);
+	if(it != buckets.end())
+	{
+		return it->second;
+	}
+
+	if(buckets.size() >= MAX_IDLE_BUCKETS)
+	{
+		// drop buckets no connection uses right now, they would be full again soon anyway
+		it = buckets.begin();
+		while(it != buckets.end())
+		{
+			if(it->second.unique())
+				buckets.erase(it++);
+			else
+				++it;
+		}
+	}
+
+	TokenBucketPtr bucket(new TokenBucket(limit.rate, limit.burst));
+	buckets[key] = bucket;
+	return bucket;
+}
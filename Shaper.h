@@ -0,0 +1,96 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Token bucket, rate in bytes per second, holds at most burst bytes
+// Takes may overdraw it, the caller then waits until the debt is refilled.
+class TokenBucket
+{
+public:
+
+	TokenBucket(boost::uint64_t rate, boost::uint64_t burst);
+
+	// microseconds to wait before sending bytes
+	boost::uint64_t take(size_t bytes, boost::uint64_t now);
+
+private:
+
+	double rate; // bytes per microsecond
+	double burst;
+	double tokens;
+	boost::uint64_t updated;
+	boost::mutex guard;
+};
+
+typedef boost::shared_ptr<TokenBucket> TokenBucketPtr;
+
+// Nested bandwidth limits: global, per user, per origin and per connection
+// A relayed byte needs tokens from every level that has a limit, so the
+// tightest one wins. Buckets of one user or origin are shared by all of
+// their connections.
+class Shaper
+{
+public:
+
+	enum Level
+	{
+		GLOBAL,
+		USER,
+		ORIGIN,
+		CONNECTION,
+
+		LEVEL_COUNT
+	};
+
+	// the buckets one transfer draws from
+	struct Flow
+	{
+		TokenBucketPtr buckets[LEVEL_COUNT];
+	};
+
+	Shaper();
+
+	// bytes per second, 0 removes the limit
+	// burst defaults to 100ms worth of rate
+	void set_limit(Level level, boost::uint64_t rate, boost::uint64_t burst = 0);
+
+	bool enabled() const;
+
+	// global and a fresh connection bucket
+	void open(Flow& flow) const;
+	// user and origin buckets, called again whenever they change
+	void bind(Flow& flow, const std::string& user, const std::string& origin);
+
+	// blocks until bytes may be sent
+	static void pace(const Flow& flow, size_t bytes);
+
+private:
+
+	static const size_t MAX_IDLE_BUCKETS = 1024;
+
+	struct Limit
+	{
+		boost::uint64_t rate;
+		boost::uint64_t burst;
+	};
+
+	typedef std::map<std::string, TokenBucketPtr> BucketMap;
+
+	Limit limits[LEVEL_COUNT];
+	TokenBucketPtr global;
+
+	BucketMap users;
+	BucketMap origins;
+	boost::mutex guard;
+
+	TokenBucketPtr find(BucketMap& buckets, const std::string& key, const Limit& limit);
+};
+
+#endif
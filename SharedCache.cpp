@@ -0,0 +1,435 @@
+#include "SharedCache.h"
+
+#ifndef _WIN32
+
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+namespace
+{
+	const size_t AVERAGE_ENTRY = 2048U; // bytes, sizes the index
+
+	struct Bucket
+	{
+		boost::uint64_t hash;
+		boost::uint64_t position; // of the record in the log + 1, 0 if the bucket is empty
+	};
+
+	// followed by the key, request, host and response
+	struct Record
+	{
+		boost::uint64_t hash; // 0 for padding up to the end of the log
+		boost::uint32_t size; // including this header, a multiple of 8
+		boost::uint32_t key_size;
+		boost::uint32_t request_size;
+		boost::uint32_t host_size;
+		boost::uint32_t must_revalidate;
+		boost::uint32_t reserved; // keeps the 64 bit fields aligned
+		boost::uint64_t response_size;
+		boost::int64_t stored;
+		boost::int64_t max_age;
+		boost::int64_t stale_while_revalidate;
+		boost::int64_t stale_if_error;
+	};
+
+	size_t align(size_t size)
+	{
+		return (size + 7) & ~(size_t)7;
+	}
+}
+
+// Lives at the start of its part of the segment, followed by the index and the log
+// Positions in the log only ever grow, the log is position % capacity.
+struct SharedCache::Shard
+{
+	pthread_mutex_t lock;
+	boost::uint32_t buckets; // power of 2
+	boost::uint32_t entries;
+	boost::uint64_t capacity; // log bytes
+	boost::uint64_t head;     // oldest record
+	boost::uint64_t tail;     // where the next one goes
+
+	// robust, the shard starts over if its last holder died with it
+	class Lock
+	{
+	public:
+		explicit Lock(Shard& shard) : shard(shard)
+		{
+			const int result = ::pthread_mutex_lock(&shard.lock);
+#ifdef __linux__
+			if(result == EOWNERDEAD)
+			{
+				// the index may be half updated, nothing in there can be trusted
+				shard.clear();
+				::pthread_mutex_consistent(&shard.lock);
+			}
+#else
+			(void)result;
+#endif
+		}
+		~Lock() { ::pthread_mutex_unlock(&this->shard.lock); }
+
+	private:
+		Shard& shard;
+	};
+
+	Bucket* index() { return reinterpret_cast<Bucket*>(reinterpret_cast<char*>(this) + align(sizeof(Shard))); }
+	char* log() { return reinterpret_cast<char*>(this->index() + this->buckets); }
+	Record* at(boost::uint64_t position) { return reinterpret_cast<Record*>(this->log() + position % this->capacity); }
+
+	void clear()
+	{
+		std::memset(this->index(), 0, this->buckets * sizeof(Bucket));
+		this->entries = 0;
+		this->head = 0;
+		this->tail = 0;
+	}
+
+	// bucket holding key, buckets if there's none
+	boost::uint32_t find(boost::uint64_t hash, const std::string& key)
+	{
+		const boost::uint32_t mask = this->buckets - 1;
+		for(boost::uint32_t i = (boost::uint32_t)hash & mask; this->index()[i].position != 0; i = (i + 1) & mask)
+		{
+			const Bucket& bucket = this->index()[i];
+			if(bucket.hash != hash)
+				continue;
+
+			const Record* record = this->at(bucket.position - 1);
+			if(record->key_size == key.size() && std::memcmp(record + 1, key.data(), key.size()) == 0)
+				return i;
+		}
+		return this->buckets;
+	}
+
+	// linear probing, later buckets of the cluster move up so lookups don't stop short
+	void erase(boost::uint32_t i)
+	{
+		const boost::uint32_t mask = this->buckets - 1;
+		this->entries--;
+
+		boost::uint32_t j = i;
+		while(true)
+		{
+			this->index()[i].position = 0;
+			while(true)
+			{
+				j = (j + 1) & mask;
+				if(this->index()[j].position == 0)
+					return;
+
+				// it stays if its home bucket lies (cyclically) in (i, j]
+				const boost::uint32_t home = (boost::uint32_t)this->index()[j].hash & mask;
+				const bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+				if(!stays)
+					break;
+			}
+			this->index()[i] = this->index()[j];
+			i = j;
+		}
+	}
+
+	void insert(boost::uint64_t hash, boost::uint64_t position)
+	{
+		const boost::uint32_t mask = this->buckets - 1;
+		boost::uint32_t i = (boost::uint32_t)hash & mask;
+		while(this->index()[i].position != 0)
+		{
+			i = (i + 1) & mask;
+		}
+		this->index()[i].hash = hash;
+		this->index()[i].position = position + 1;
+		this->entries++;
+	}
+
+	void evict_oldest()
+	{
+		// no room for a header at the end of the log, the next record started over at 0
+		const boost::uint64_t left = this->capacity - this->head % this->capacity;
+		if(left < sizeof(Record))
+		{
+			this->head += left;
+			return;
+		}
+
+		const Record* record = this->at(this->head);
+		if(record->hash != 0)
+		{
+			// unless the key was stored again since, it points to a newer record then
+			const boost::uint32_t mask = this->buckets - 1;
+			for(boost::uint32_t i = (boost::uint32_t)record->hash & mask; this->index()[i].position != 0; i = (i + 1) & mask)
+			{
+				if(this->index()[i].position == this->head + 1)
+				{
+					this->erase(i);
+					break;
+				}
+			}
+		}
+		this->head += record->size;
+	}
+
+	void make_room(boost::uint64_t size)
+	{
+		while(this->tail + size - this->head > this->capacity)
+		{
+			this->evict_oldest();
+		}
+	}
+
+	// size bytes in one piece, records never wrap around the end of the log
+	boost::uint64_t allocate(boost::uint64_t size)
+	{
+		const boost::uint64_t left = this->capacity - this->tail % this->capacity;
+		if(left < size)
+		{
+			this->make_room(left);
+			if(left >= sizeof(Record))
+			{
+				Record* padding = this->at(this->tail);
+				std::memset(padding, 0, sizeof(Record));
+				padding->size = (boost::uint32_t)left;
+			}
+			this->tail += left;
+		}
+
+		this->make_room(size);
+		const boost::uint64_t position = this->tail;
+		this->tail += size;
+		return position;
+	}
+};
+
+SharedCache::SharedCache() : segment(NULL), size(0), shard_size(0)
+{
+}
+
+SharedCache::~SharedCache()
+{
+	if(this->segment)
+	{
+		::munmap(this->segment, this->size);
+	}
+}
+
+bool SharedCache::create(size_t capacity)
+{
+	const boost::uint64_t log = (capacity / SHARDS) & ~(boost::uint64_t)7;
+	if(this->segment || log < sizeof(Record) * 2 || log > 0xFFFFFFFFU)
+		return false;
+
+	boost::uint32_t buckets = 64;
+	while(buckets < log / AVERAGE_ENTRY)
+	{
+		buckets *= 2;
+	}
+
+	this->shard_size = align(sizeof(Shard)) + buckets * sizeof(Bucket) + (size_t)log;
+	this->size = this->shard_size * SHARDS;
+
+	void* mapped = ::mmap(NULL, this->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(mapped == MAP_FAILED)
+	{
+		this->size = 0;
+		return false;
+	}
+	this->segment = static_cast<char*>(mapped);
+
+	pthread_mutexattr_t attributes;
+	::pthread_mutexattr_init(&attributes);
+	::pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+	::pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+#endif
+
+	for(size_t i = 0; i < SHARDS; i++)
+	{
+		Shard* shard = new(this->segment + i * this->shard_size) Shard;
+		::pthread_mutex_init(&shard->lock, &attributes);
+		shard->buckets = buckets;
+		shard->capacity = log;
+		shard->clear();
+	}
+
+	::pthread_mutexattr_destroy(&attributes);
+	return true;
+}
+
+SharedCache::Shard& SharedCache::shard(boost::uint64_t hash) const
+{
+	// the top bits pick the shard, the bottom ones the bucket
+	return *reinterpret_cast<Shard*>(this->segment + (size_t)(hash >> 56) % SHARDS * this->shard_size);
+}
+
+size_t SharedCache::max_entry() const
+{
+	if(!this->segment)
+		return 0;
+
+	// what store() lets in
+	const size_t half = (size_t)this->shard(0).capacity / 2;
+	return half > sizeof(Record) ? half - sizeof(Record) : 0;
+}
+
+Cache::EntryPtr SharedCache::lookup(const std::string& key)
+{
+	if(!this->segment)
+		return Cache::EntryPtr();
+
+	const boost::uint64_t h = hash(key);
+	Shard& shard = this->shard(h);
+	Shard::Lock lock(shard);
+
+	const boost::uint32_t i = shard.find(h, key);
+	if(i == shard.buckets)
+		return Cache::EntryPtr();
+
+	// copied out, the record may be overwritten as soon as the lock is gone
+	const Record* record = shard.at(shard.index()[i].position - 1);
+	const char* data = reinterpret_cast<const char*>(record + 1) + record->key_size;
+
+	boost::shared_ptr<Cache::Entry> entry(new Cache::Entry);
+	entry->request.assign(data, record->request_size);
+	data += record->request_size;
+	entry->host.assign(data, record->host_size);
+	data += record->host_size;
+	entry->response.assign(data, (size_t)record->response_size);
+	entry->stored = (time_t)record->stored;
+	entry->max_age = (long)record->max_age;
+	entry->stale_while_revalidate = (long)record->stale_while_revalidate;
+	entry->stale_if_error = (long)record->stale_if_error;
+	entry->must_revalidate = record->must_revalidate != 0;
+	return entry;
+}
+
+bool SharedCache::store(const std::string& key, const Cache::Entry& entry)
+{
+	if(!this->segment)
+		return false;
+
+	const boost::uint64_t h = hash(key);
+	Shard& shard = this->shard(h);
+
+	// a single entry mustn't push out half the shard
+	const size_t size = align(sizeof(Record) + key.size() + entry.size());
+	if(size > shard.capacity / 2)
+		return false;
+
+	Shard::Lock lock(shard);
+
+	const boost::uint32_t existing = shard.find(h, key);
+	if(existing != shard.buckets)
+	{
+		shard.erase(existing);
+	}
+
+	// the index stays at most 3/4 full
+	while(shard.entries + 1 > shard.buckets / 4 * 3 && shard.head != shard.tail)
+	{
+		shard.evict_oldest();
+	}
+
+	const boost::uint64_t position = shard.allocate(size);
+
+	Record* record = shard.at(position);
+	record->hash = h;
+	record->size = (boost::uint32_t)size;
+	record->key_size = (boost::uint32_t)key.size();
+	record->request_size = (boost::uint32_t)entry.request.size();
+	record->host_size = (boost::uint32_t)entry.host.size();
+	record->response_size = entry.response.size();
+	record->stored = entry.stored;
+	record->max_age = entry.max_age;
+	record->stale_while_revalidate = entry.stale_while_revalidate;
+	record->stale_if_error = entry.stale_if_error;
+	record->must_revalidate = entry.must_revalidate ? 1 : 0;
+	record->reserved = 0;
+
+	char* data = reinterpret_cast<char*>(record + 1);
+	std::memcpy(data, key.data(), key.size());
+	data += key.size();
+	std::memcpy(data, entry.request.data(), entry.request.size());
+	data += entry.request.size();
+	std::memcpy(data, entry.host.data(), entry.host.size());
+	data += entry.host.size();
+	std::memcpy(data, entry.response.data(), entry.response.size());
+
+	shard.insert(h, position);
+	return true;
+}
+
+void SharedCache::remove(const std::string& key)
+{
+	if(!this->segment)
+		return;
+
+	const boost::uint64_t h = hash(key);
+	Shard& shard = this->shard(h);
+	Shard::Lock lock(shard);
+
+	const boost::uint32_t i = shard.find(h, key);
+	if(i != shard.buckets)
+	{
+		shard.erase(i);
+	}
+}
+
+boost::uint64_t SharedCache::hash(const std::string& key)
+{
+	// FNV-1a, 0 is taken by padding
+	boost::uint64_t h = 14695981039346656037ULL;
+	for(size_t i = 0; i < key.size(); i++)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+	return h != 0 ? h : 1;
+}
+
+#else
+
+SharedCache::SharedCache() : segment(NULL), size(0), shard_size(0)
+{
+}
+
+SharedCache::~SharedCache()
+{
+}
+
+bool SharedCache::create(size_t capacity)
+{
+	(void)capacity;
+	return false;
+}
+
+Cache::EntryPtr SharedCache::lookup(const std::string& key)
+{
+	(void)key;
+	return Cache::EntryPtr();
+}
+
+bool SharedCache::store(const std::string& key, const Cache::Entry& entry)
+{
+	(void)key;
+	(void)entry;
+	return false;
+}
+
+size_t SharedCache::max_entry() const
+{
+	return 0;
+}
+
+void SharedCache::remove(const std::string& key)
+{
+	(void)key;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SHAREDCACHE_H
+#define SHAREDCACHE_H
+
+#pragma once
+
+#include <string>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include "Cache.h"
+
+// Cache storage in a shared memory segment, for worker processes forked after create()
+// The segment is split into SHARDS, each with its own process shared lock, a hash
+// index and a log its entries are appended to. When a shard's log is full the oldest
+// entries are dropped (first in, first out), so the segment never grows or fragments.
+// A worker dying with a shard locked costs that shard its contents.
+// POSIX only, create() fails elsewhere.
+class SharedCache : boost::noncopyable
+{
+public:
+
+	static const size_t SHARDS = 16U;
+
+	SharedCache();
+	~SharedCache();
+
+	// capacity in bytes for all shards together
+	bool create(size_t capacity);
+	size_t get_capacity() const { return this->size; }
+	// bytes of an entry, key included, that still fit into a shard
+	size_t max_entry() const;
+
+	// a copy of the stored entry, NULL if there's none
+	Cache::EntryPtr lookup(const std::string& key);
+	// false if the entry doesn't fit into a shard
+	bool store(const std::string& key, const Cache::Entry& entry);
+	void remove(const std::string& key);
+
+private:
+
+	struct Shard;
+
+	char* segment;
+	size_t size;
+	size_t shard_size; // bytes per shard, including its lock and index
+
+	Shard& shard(boost::uint64_t hash) const;
+
+	static boost::uint64_t hash(const std::string& key);
+};
+
+#endif
@@ -1,6 +1,36 @@
 #include "Socket.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <vector>
+#ifdef _WIN32
+#include <mstcpip.h>
+#else
+#include <signal.h>
+#endif
+
+#if defined(__linux__) && defined(TCP_INFO)
+namespace
+{
+	// glibc's tcp_info ends at tcpi_total_retrans, newer kernels append (linux/tcp.h)
+	struct tcp_info_ext
+	{
+		tcp_info base;
+		uint64_t pacing_rate;
+		uint64_t max_pacing_rate;
+		uint64_t bytes_acked;
+		uint64_t bytes_received;
+		uint32_t segs_out;
+		uint32_t segs_in;
+		uint32_t notsent_bytes;
+		uint32_t min_rtt;
+		uint32_t data_segs_in;
+		uint32_t data_segs_out;
+		uint64_t delivery_rate;
+	};
+}
+#endif
 
 Socket::Socket(Domain domain, Type type, Protocol protocol)
 {
@@ -17,19 +47,38 @@ bool Socket::listen(unsigned int max)
 	return ::listen(this->socket, max) == 0;
 }
 
-Socket Socket::accept(SocketAddress* addr)
+Socket Socket::accept(SocketAddress* addr, int flags)
 {
 socket_t nsock;
+SocketAddress naddr;
+socklen_t nlen = sizeof(naddr.saddr);
+sockaddr* paddr = addr ? (sockaddr*)&naddr.saddr : NULL;
+socklen_t* plen = addr ? &nlen : NULL;
+
+#if defined(__linux__)
+	int native = 0;
+	if(flags & NONBLOCK)
+		native |= SOCK_NONBLOCK;
+	if(flags & CLOEXEC)
+		native |= SOCK_CLOEXEC;
+	nsock = ::accept4(this->socket, paddr, plen, native);
+	flags = 0; // handled by accept4
+#else
+	nsock = ::accept(this->socket, paddr, plen);
+#endif
 
 	if(addr) {
-		SocketAddress naddr;
-		int nlen = sizeof(naddr.saddr);
-		nsock = ::accept(this->socket, (sockaddr*)&naddr.saddr, &nlen);
 		*addr = naddr;
-	} else {
-		nsock = ::accept(this->socket, NULL, 0);
 	}
-	return Socket(nsock);
+
+	Socket accepted(nsock);
+	if(accepted.valid()) {
+		if(flags & NONBLOCK)
+			accepted.set_nonblocking(true);
+		if(flags & CLOEXEC)
+			accepted.set_cloexec(true);
+	}
+	return accepted;
 }
 
 bool Socket::connect(SocketAddress addr)
@@ -37,10 +86,233 @@ bool Socket::connect(SocketAddress addr)
 	return ::connect(this->socket, (const sockaddr*)&addr.saddr, sizeof(addr.saddr)) == 0;
 }
 
+Socket::ConnectStatus Socket::connect(SocketAddress addr, long seconds)
+{
+	if(!this->set_nonblocking(true))
+	{
+		return this->connect(addr) ? CONNECTED : REFUSED;
+	}
+
+	ConnectStatus status = REFUSED;
+
+	if(::connect(this->socket, (const sockaddr*)&addr.saddr, sizeof(addr.saddr)) == 0)
+	{
+		status = CONNECTED;
+	}
+	else
+	{
+#ifdef _WIN32
+		bool in_progress = ::WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+		bool in_progress = errno == EINPROGRESS;
+#endif
+		if(in_progress)
+		{
+			if(this->select_write(seconds))
+			{
+				int error = 0;
+				if(this->get_option(SOL_SOCKET, SO_ERROR, error))
+				{
+#ifdef _WIN32
+					status = error == 0 ? CONNECTED : (error == WSAETIMEDOUT ? TIMED_OUT : REFUSED);
+#else
+					status = error == 0 ? CONNECTED : (error == ETIMEDOUT ? TIMED_OUT : REFUSED);
+#endif
+				}
+			}
+			else
+			{
+				status = TIMED_OUT;
+			}
+		}
+	}
+
+	this->set_nonblocking(false);
+	return status;
+}
+
+bool Socket::set_no_delay(bool enable)
+{
+	return this->set_option(IPPROTO_TCP, TCP_NODELAY, enable ? 1 : 0);
+}
+
+bool Socket::set_keep_alive(bool enable)
+{
+	return this->set_option(SOL_SOCKET, SO_KEEPALIVE, enable ? 1 : 0);
+}
+
+bool Socket::set_reuse_address(bool enable)
+{
+	return this->set_option(SOL_SOCKET, SO_REUSEADDR, enable ? 1 : 0);
+}
+
+bool Socket::set_defer_accept(int seconds)
+{
+#ifdef TCP_DEFER_ACCEPT
+	return this->set_option(IPPROTO_TCP, TCP_DEFER_ACCEPT, seconds);
+#else
+	return false;
+#endif
+}
+
+bool Socket::set_fast_open(int queue_length)
+{
+#ifdef TCP_FASTOPEN
+	return this->set_option(IPPROTO_TCP, TCP_FASTOPEN, queue_length);
+#else
+	return false;
+#endif
+}
+
+bool Socket::set_fast_open_connect(bool enable)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+	return this->set_option(IPPROTO_TCP, TCP_FASTOPEN_CONNECT, enable ? 1 : 0);
+#else
+	return false;
+#endif
+}
+
+bool Socket::set_receive_buffer(int bytes)
+{
+	return this->set_option(SOL_SOCKET, SO_RCVBUF, bytes);
+}
+
+bool Socket::set_send_buffer(int bytes)
+{
+	return this->set_option(SOL_SOCKET, SO_SNDBUF, bytes);
+}
+
+bool Socket::set_nonblocking(bool enable)
+{
+#ifdef _WIN32
+	u_long mode = enable ? 1 : 0;
+	return ::ioctlsocket(this->socket, FIONBIO, &mode) == 0;
+#else
+	int flags = ::fcntl(this->socket, F_GETFL, 0);
+	if(flags < 0)
+		return false;
+	flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+	return ::fcntl(this->socket, F_SETFL, flags) == 0;
+#endif
+}
+
+bool Socket::set_cloexec(bool enable)
+{
+#ifdef _WIN32
+	return ::SetHandleInformation((HANDLE)this->socket, HANDLE_FLAG_INHERIT, enable ? 0 : HANDLE_FLAG_INHERIT) != 0;
+#else
+	int flags = ::fcntl(this->socket, F_GETFD, 0);
+	if(flags < 0)
+		return false;
+	flags = enable ? (flags | FD_CLOEXEC) : (flags & ~FD_CLOEXEC);
+	return ::fcntl(this->socket, F_SETFD, flags) == 0;
+#endif
+}
+
+bool Socket::get_tcp_info(TcpInfo& info) const
+{
+	info = TcpInfo();
+
+#if defined(__linux__) && defined(TCP_INFO)
+	tcp_info_ext raw;
+	std::memset(&raw, 0, sizeof(raw));
+	socklen_t length = sizeof(raw);
+	if(::getsockopt(this->socket, IPPROTO_TCP, TCP_INFO, &raw, &length) != 0)
+		return false;
+
+	info.rtt = raw.base.tcpi_rtt;
+	info.rtt_var = raw.base.tcpi_rttvar;
+	info.retransmits = raw.base.tcpi_total_retrans;
+	info.cwnd = raw.base.tcpi_snd_cwnd;
+
+	// older kernels fill in less
+	if(length >= offsetof(tcp_info_ext, segs_in))
+		info.segments_out = raw.segs_out;
+	if(length >= sizeof(raw))
+		info.delivery_rate = raw.delivery_rate;
+	return true;
+#elif defined(_WIN32) && defined(SIO_TCP_INFO)
+	DWORD version = 0;
+	TCP_INFO_v0 raw;
+	DWORD length = 0;
+	if(::WSAIoctl(this->socket, SIO_TCP_INFO, &version, sizeof(version), &raw, sizeof(raw), &length, NULL, NULL) != 0)
+		return false;
+
+	// Windows counts bytes rather than segments, has no RTT variance and no delivery
+	// rate, the window per round trip is what the connection can move at best
+	const ULONG mss = raw.Mss > 0 ? raw.Mss : 1;
+	info.rtt = raw.RttUs;
+	info.retransmits = (uint32_t)(raw.BytesRetrans / mss);
+	info.segments_out = (uint32_t)(raw.BytesOut / mss);
+	info.cwnd = raw.Cwnd / mss;
+	if(raw.RttUs > 0)
+		info.delivery_rate = (uint64_t)raw.Cwnd * 1000000 / raw.RttUs;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool Socket::tune(const SocketTuning& tuning, bool listener)
+{
+	bool success = true;
+
+	if(tuning.no_delay)
+		success &= this->set_no_delay(true);
+	if(tuning.keep_alive)
+		success &= this->set_keep_alive(true);
+	if(tuning.receive_buffer > 0)
+		success &= this->set_receive_buffer(tuning.receive_buffer);
+	if(tuning.send_buffer > 0)
+		success &= this->set_send_buffer(tuning.send_buffer);
+
+	if(listener)
+	{
+		if(tuning.reuse_address)
+			success &= this->set_reuse_address(true);
+		if(tuning.defer_accept > 0)
+			success &= this->set_defer_accept(tuning.defer_accept);
+		if(tuning.fast_open > 0)
+			success &= this->set_fast_open(tuning.fast_open);
+	}
+	else
+	{
+		if(tuning.fast_open > 0)
+			success &= this->set_fast_open_connect(true);
+	}
+
+	return success;
+}
+
+bool Socket::set_option(int level, int name, int value)
+{
+	return ::setsockopt(this->socket, level, name, (const char*)&value, sizeof(value)) == 0;
+}
+
+bool Socket::get_option(int level, int name, int& value) const
+{
+	socklen_t length = sizeof(value);
+	return ::getsockopt(this->socket, level, name, (char*)&value, &length) == 0;
+}
+
 int Socket::recv(char* buf, size_t max_size, RecvFlag flags, bool force)
 {
 	assert(buf != NULL);
 
+	if(this->layer) {
+		int read = this->layer->read(buf, max_size, flags == PEEK);
+		if(force) {
+			int total = read;
+			while(read > 0 && total < max_size) {
+				read = this->layer->read(buf + total, max_size - total, false);
+				total += read;
+			}
+			return total;
+		}
+		return read;
+	}
+
 	int read = ::recv(this->socket, buf, max_size, flags);
 
 	if(force) {
@@ -54,13 +326,34 @@ int Socket::recv(char* buf, size_t max_size, RecvFlag flags, bool force)
 	return read;
 }
 
-size_t Socket::send(const char* buf, size_t size)
+size_t Socket::send(const char* buf, size_t size, bool more)
 {
 	assert(buf != NULL);
 
+	if(this->layer) {
+		size_t total = 0;
+		while(total < size) {
+			int sent = this->layer->write(buf + total, size - total);
+			if(sent <= 0) {
+				break;
+			}
+			total += sent;
+		}
+		return total;
+	}
+
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL; // a peer that's gone is an error, not a reason to die
+#endif
+#ifdef MSG_MORE
+	if(more)
+		flags |= MSG_MORE;
+#endif
+
 	size_t total = 0;
 	while(total < size) {
-		int sent = ::send(this->socket, buf + total, size-total, 0);
+		int sent = ::send(this->socket, buf + total, size-total, flags);
 		if(sent == SOCKET_ERROR) {
 			break;
 		}
@@ -69,8 +362,86 @@ size_t Socket::send(const char* buf, size_t size)
 	return total;
 }
 
+size_t Socket::send(const Buffer* buffers, size_t count, bool more)
+{
+	assert(buffers != NULL || count == 0);
+
+	size_t size = 0;
+	for(size_t i = 0; i < count; i++)
+		size += buffers[i].size;
+
+	// one record instead of one per fragment
+	if(this->layer) {
+		std::string joined;
+		joined.reserve(size);
+		for(size_t i = 0; i < count; i++)
+			joined.append(buffers[i].data, buffers[i].size);
+		return size > 0 ? this->send(joined.data(), joined.size(), more) : 0;
+	}
+
+	size_t total = 0;
+	size_t first = 0;   // first buffer not completely sent
+	size_t offset = 0;  // bytes of it already sent
+
+	while(total < size) {
+#ifdef _WIN32
+		std::vector<WSABUF> parts;
+		for(size_t i = first; i < count; i++) {
+			WSABUF part;
+			part.buf = const_cast<char*>(buffers[i].data) + (i == first ? offset : 0);
+			part.len = (ULONG)(buffers[i].size - (i == first ? offset : 0));
+			parts.push_back(part);
+		}
+		DWORD bytes = 0;
+		if(::WSASend(this->socket, &parts[0], (DWORD)parts.size(), &bytes, 0, NULL, NULL) == SOCKET_ERROR) {
+			break;
+		}
+		size_t sent = bytes;
+#else
+		std::vector<iovec> parts;
+		for(size_t i = first; i < count; i++) {
+			iovec part;
+			part.iov_base = const_cast<char*>(buffers[i].data) + (i == first ? offset : 0);
+			part.iov_len = buffers[i].size - (i == first ? offset : 0);
+			parts.push_back(part);
+		}
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &parts[0];
+		msg.msg_iovlen = parts.size();
+
+		int flags = 0;
+#ifdef MSG_NOSIGNAL
+		flags |= MSG_NOSIGNAL;
+#endif
+#ifdef MSG_MORE
+		if(more)
+			flags |= MSG_MORE;
+#endif
+		ssize_t result = ::sendmsg(this->socket, &msg, flags);
+		if(result == SOCKET_ERROR) {
+			break;
+		}
+		size_t sent = result;
+#endif
+		total += sent;
+
+		// skip what went out, partial writes resume mid-buffer
+		sent += offset;
+		while(first < count && sent >= buffers[first].size) {
+			sent -= buffers[first].size;
+			first++;
+		}
+		offset = sent;
+	}
+	return total;
+}
+
 bool Socket::select_read(long seconds, long microseconds) const
 {
+	if(this->layer && this->layer->pending())
+		return true;
+
 	fd_set wait;
 	timeval time;
 	timeval* time_ptr = &time;
@@ -91,8 +462,46 @@ bool Socket::select_write(long seconds, long microseconds) const
 	return ret == 1;
 }
 
+int Socket::select_read(const Socket* sockets, size_t count, long seconds, long microseconds)
+{
+	assert(sockets != NULL);
+
+	for(size_t i = 0; i < count; i++) {
+		if(sockets[i].layer && sockets[i].layer->pending())
+			return (int)i;
+	}
+
+	fd_set wait;
+	FD_ZERO(&wait);
+
+	socket_t highest = 0;
+	for(size_t i = 0; i < count; i++) {
+		FD_SET(sockets[i].socket, &wait);
+		if(sockets[i].socket > highest)
+			highest = sockets[i].socket;
+	}
+
+	timeval time;
+	time.tv_sec = seconds;
+	time.tv_usec = microseconds;
+
+	int ret = ::select((int)highest + 1, &wait, NULL, NULL, seconds >= 0 ? &time : NULL);
+	if(ret <= 0)
+		return -1;
+
+	for(size_t i = 0; i < count; i++) {
+		if(FD_ISSET(sockets[i].socket, &wait))
+			return (int)i;
+	}
+	return -1;
+}
+
 bool Socket::shutdown(int how)
 {
+	// TLS can't half-close, the peer would see a truncated stream
+	if(this->layer && how == 1)
+		return true;
+
 	return ::shutdown(this->socket, how) == 0;
 }
 
@@ -114,6 +523,11 @@ bool Socket::shutdown(bool receive, bool send)
 
 bool Socket::close()
 {
+	if(this->layer) {
+		this->layer->close();
+		this->layer.reset();
+	}
+
 	this->shutdown(true, true);
 	bool success = ::closesocket(this->socket) == 0;
 	if(success)
@@ -152,7 +566,9 @@ bool Socket::startup()
 	WSADATA wsad;
 	return ::WSAStartup(WSVERSION, &wsad) == 0;
 #else
-	return true;
+	// writes to a reset connection fail with EPIPE instead of killing the process,
+	// also where MSG_NOSIGNAL is missing and for writes we don't make ourselves (TLS)
+	return ::signal(SIGPIPE, SIG_IGN) != SIG_ERR;
 #endif
 }
 
@@ -9,12 +9,22 @@
 #else
 //#include <sys/types.h>
 #include <sys/socket.h>
-//#include <netinet/in.h>
-//#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h> 
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR   (-1)
+#define closesocket    close
 #endif
 #include <string>
 #include <cstdint>
+#include <boost/shared_ptr.hpp>
 
 class Address
 {
@@ -66,6 +76,59 @@ private:
 	sockaddr_storage saddr;
 };
 
+// Per-socket tuning profile, applied with Socket::tune()
+// Zero values leave the system default untouched
+struct SocketTuning
+{
+	SocketTuning() :
+		no_delay(false), keep_alive(false), reuse_address(false),
+		defer_accept(0), fast_open(0), receive_buffer(0), send_buffer(0),
+		accept_flags(0) { }
+
+	bool no_delay;      // TCP_NODELAY, disables Nagle's algorithm
+	bool keep_alive;    // SO_KEEPALIVE
+	bool reuse_address; // SO_REUSEADDR, listener only
+
+	int defer_accept;   // TCP_DEFER_ACCEPT in seconds, listener only (Linux)
+	int fast_open;      // listener: TFO queue length, upstream: > 0 enables TCP_FASTOPEN_CONNECT (Linux)
+	int receive_buffer; // SO_RCVBUF in bytes, set before listen/connect to affect window scaling
+	int send_buffer;    // SO_SNDBUF in bytes
+
+	int accept_flags;   // Socket::AcceptFlag mask for accepted connections, listener only
+};
+
+// The kernel's view of a TCP connection, see Socket::get_tcp_info()
+// Zero if the platform doesn't report it
+struct TcpInfo
+{
+	TcpInfo() :
+		rtt(0), rtt_var(0), retransmits(0), segments_out(0), cwnd(0), delivery_rate(0) { }
+
+	uint32_t rtt;           // smoothed round trip time, microseconds
+	uint32_t rtt_var;       // microseconds
+	uint32_t retransmits;   // segments retransmitted so far
+	uint32_t segments_out;  // segments sent so far
+	uint32_t cwnd;          // congestion window, segments
+	uint64_t delivery_rate; // recent goodput, bytes per second
+};
+
+// Transforms what goes over a connected socket (TLS), see Socket::set_layer
+// Calls may come from several threads at once, the layer has to cope with that.
+class SocketLayer
+{
+public:
+	virtual ~SocketLayer() { }
+
+	// like recv/send on a blocking socket
+	virtual int read(char* buf, size_t size, bool peek) = 0;
+	virtual int write(const char* buf, size_t size) = 0;
+	// decoded bytes are waiting, select() can't see those
+	virtual bool pending() = 0;
+	virtual void close() = 0;
+};
+
+typedef boost::shared_ptr<SocketLayer> SocketLayerPtr;
+
 class Socket
 {
 public:
@@ -75,42 +138,89 @@ public:
 
 	enum RecvFlag { NONE = 0, PEEK = MSG_PEEK, OOB = MSG_OOB };
 
+	// accept4() flags, emulated where accept4 isn't available
+	enum AcceptFlag { NONBLOCK = 1 << 0, CLOEXEC = 1 << 1 };
+
 #ifdef _WIN32
 	typedef SOCKET socket_t;
 #else
 	typedef int socket_t;
 #endif
 
+	// one fragment of a gathered send
+	struct Buffer
+	{
+		const char* data;
+		size_t size;
+	};
+
 	Socket(socket_t socket = INVALID_SOCKET) : socket(socket) { }
 	Socket(Domain domain, Type type, Protocol protocol = DEFAULT);
 
 	bool bind(SocketAddress addr);
 	bool listen(unsigned int max = 5);
-	Socket accept(SocketAddress* addr = NULL);
+	Socket accept(SocketAddress* addr = NULL, int flags = 0);
 	bool connect(SocketAddress addr);
 
+	enum ConnectStatus { CONNECTED, REFUSED, TIMED_OUT };
+	// gives up after the timeout instead of waiting for the system's
+	ConnectStatus connect(SocketAddress addr, long seconds);
+
+	// socket options, false if unsupported on this platform or setsockopt failed
+	bool set_no_delay(bool enable);
+	bool set_keep_alive(bool enable);
+	bool set_reuse_address(bool enable);
+	bool set_defer_accept(int seconds);
+	bool set_fast_open(int queue_length);
+	bool set_fast_open_connect(bool enable);
+	bool set_receive_buffer(int bytes);
+	bool set_send_buffer(int bytes);
+	bool set_nonblocking(bool enable);
+	bool set_cloexec(bool enable);
+
+	// TCP_INFO (Linux) or SIO_TCP_INFO (Windows), false if unavailable
+	bool get_tcp_info(TcpInfo& info) const;
+
+	// apply every option set in the profile, returns false if any of them failed
+	// listener-only options are skipped unless listener is true
+	bool tune(const SocketTuning& tuning, bool listener = false);
+
 	int recv(char* buf, size_t max_size, RecvFlag flags = NONE, bool force = false);
-	size_t send(const char* buf, size_t size);
+	// more = true hints that further data follows immediately (MSG_MORE), so
+	// the kernel can merge it into full segments instead of pushing it out now
+	size_t send(const char* buf, size_t size, bool more = false);
+	size_t send(const Buffer* buffers, size_t count, bool more = false);
 
 	// seconds < 0 -> infinite
 	bool select_read(long seconds, long microseconds = 0) const;
 	bool select_write(long seconds, long microseconds = 0) const;
+	// index of the first readable socket, -1 on timeout or error
+	static int select_read(const Socket* sockets, size_t count, long seconds, long microseconds = 0);
 
 	bool shutdown(int how);
 	bool shutdown(bool read = true, bool write = true);
 	bool close();
 
+	// once per process before any socket is used, ignores SIGPIPE on POSIX
 	static bool startup();
 	static bool unload();
 
 	socket_t get() const { return this->socket; }
 	bool valid() const { return this->socket != INVALID_SOCKET; }
 
+	// from now on recv/send go through the layer, copies of this socket don't see it
+	void set_layer(const SocketLayerPtr& layer) { this->layer = layer; }
+	bool has_layer() const { return this->layer.get() != NULL; }
+
 	operator bool() const { return this->valid(); }
 	operator socket_t() const { return this->get(); }
 
 private:
 	socket_t socket;
+	SocketLayerPtr layer;
+
+	bool set_option(int level, int name, int value);
+	bool get_option(int level, int name, int& value) const;
 
 	void prepare_select(long seconds, long microseconds, fd_set* fd_desc, timeval** timeval_ptr) const;
 };
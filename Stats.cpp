@@ -0,0 +1,107 @@
+#include "Stats.h"
+
+#include <sstream>
+#include <new>
+#include <boost/atomic.hpp>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+namespace
+{
+	boost::atomic<boost::uint64_t> local[Stats::COUNTER_COUNT];
+	boost::atomic<boost::uint64_t>* counters = local; // or in shared memory, see share()
+
+	const char* const NAMES[Stats::COUNTER_COUNT] =
+	{
+		"requests",
+		"collapsed",
+		"collapse_fallbacks",
+		"cache_hits",
+		"cache_stale_hits",
+		"cache_stale_if_error",
+		"cache_misses",
+		"refreshes",
+		"refresh_failures",
+		"refreshes_dropped",
+		"backend_ejections",
+		"hedges",
+		"hedge_wins",
+		"breaker_opens",
+		"breaker_rejects",
+		"negative_cache_hits",
+		"shed_queue_full",
+		"shed_delay",
+		"shed_memory",
+		"shaper_waits",
+		"http2_connections",
+		"http2_streams",
+		"http2_retries",
+		"tls_handshakes",
+		"tls_resumed",
+		"tls_failures",
+		"ktls_connections",
+		"trace_records",
+		"trace_dropped",
+		"range_requests",
+		"slice_hits",
+		"slice_fetches",
+		"prefetches",
+		"prefetch_used",
+		"prefetch_wasted",
+		"prefetch_dropped",
+		"acl_denied",
+		"expect_continued",
+		"expect_rejected",
+		"memory_shrinks",
+		"memory_throttles",
+	};
+}
+
+void Stats::increment(Counter counter, boost::uint64_t amount)
+{
+	counters[counter].fetch_add(amount, boost::memory_order_relaxed);
+}
+
+boost::uint64_t Stats::get(Counter counter)
+{
+	return counters[counter].load(boost::memory_order_relaxed);
+}
+
+bool Stats::share()
+{
+#if defined(_WIN32) || BOOST_ATOMIC_INT64_LOCK_FREE != 2
+	// a lock inside the atomic would be a different one in every process
+	return false;
+#else
+	if(counters != local)
+		return true;
+
+	void* mapped = ::mmap(NULL, sizeof(local), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(mapped == MAP_FAILED)
+		return false;
+
+	boost::atomic<boost::uint64_t>* shared = static_cast<boost::atomic<boost::uint64_t>*>(mapped);
+	for(int i = 0; i < COUNTER_COUNT; i++)
+	{
+		new(&shared[i]) boost::atomic<boost::uint64_t>(local[i].load(boost::memory_order_relaxed));
+	}
+	counters = shared;
+	return true;
+#endif
+}
+
+std::string Stats::report()
+{
+	std::ostringstream out;
+	for(int i = 0; i < COUNTER_COUNT; i++)
+	{
+		out << NAMES[i] << ' ' << counters[i].load(boost::memory_order_relaxed) << '\n';
+	}
+	return out.str();
+}
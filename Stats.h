@@ -0,0 +1,86 @@
+#ifndef STATS_H
+#define STATS_H
+
+#pragma once
+
+#include <string>
+#include <boost/cstdint.hpp>
+
+// Process wide counters, served as plain text by the proxy's status page
+class Stats
+{
+public:
+
+	enum Counter
+	{
+		REQUESTS,
+		COLLAPSED,          // served from another connection's in-flight fetch
+		COLLAPSE_FALLBACKS, // waited for an in-flight fetch, then fetched on our own
+
+		CACHE_HITS,
+		CACHE_STALE_HITS,     // served stale while refreshing in the background
+		CACHE_STALE_IF_ERROR, // served stale because the origin failed
+		CACHE_MISSES,
+		REFRESHES,
+		REFRESH_FAILURES,
+		REFRESHES_DROPPED,    // refresh queue was full
+
+		BACKEND_EJECTIONS,
+
+		HEDGES,     // second requests sent
+		HEDGE_WINS, // second requests answered first
+
+		BREAKER_OPENS,
+		BREAKER_REJECTS,     // requests failed fast by an open breaker
+		NEGATIVE_CACHE_HITS, // requests failed fast by a cached resolve/connect failure
+
+		SHED_QUEUE_FULL, // connections rejected, accept queue at its limit
+		SHED_DELAY,      // connections rejected by CoDel, queueing delay too high
+		SHED_MEMORY,     // connections rejected, memory budget used up
+
+		SHAPER_WAITS, // relayed chunks held back by a bandwidth limit
+
+		HTTP2_CONNECTIONS,
+		HTTP2_STREAMS,
+		HTTP2_RETRIES, // streams refused (GOAWAY, REFUSED_STREAM) and sent again
+
+		TLS_HANDSHAKES,
+		TLS_RESUMED,      // handshakes that resumed a cached session
+		TLS_FAILURES,
+		KTLS_CONNECTIONS, // the kernel took over encryption
+
+		TRACE_RECORDS,
+		TRACE_DROPPED, // the capture file was full
+
+		RANGE_REQUESTS, // handed to slicing
+		SLICE_HITS,
+		SLICE_FETCHES,
+
+		PREFETCHES,       // subresources fetched into the cache ahead of the client
+		PREFETCH_USED,    // ... and asked for by a client later
+		PREFETCH_WASTED,  // ... and never asked for
+		PREFETCH_DROPPED, // the prefetch queue was full
+
+		ACL_DENIED,
+
+		EXPECT_CONTINUED, // the origin asked for an upload's body
+		EXPECT_REJECTED,  // the origin turned an upload down before its body
+
+		MEMORY_SHRINKS,   // cache evictions forced by memory pressure
+		MEMORY_THROTTLES, // reads held back by memory pressure
+
+		COUNTER_COUNT
+	};
+
+	static void increment(Counter counter, boost::uint64_t amount = 1);
+	static boost::uint64_t get(Counter counter);
+
+	// one "name value" line per counter
+	static std::string report();
+
+	// moves the counters into shared memory, processes forked later count into the same ones
+	// call before any other thread runs, false where that isn't possible
+	static bool share();
+};
+
+#endif
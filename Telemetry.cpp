@@ -0,0 +1,107 @@
+#include "Telemetry.h"
+
+#include <boost/thread/locks.hpp>
+#include "Clock.h"
+
+const char* const Telemetry::OTHER = "other";
+
+namespace
+{
+	const char* const SIDE_NAMES[Telemetry::SIDE_COUNT] = { "client", "origin" };
+}
+
+bool Telemetry::sample(Side side, const std::string& key, Socket socket, TcpInfo& info, boost::uint64_t& sampled, bool force)
+{
+	const boost::uint64_t now = Clock::now();
+	if(!socket.valid() || (!force && sampled != 0 && now - sampled < SAMPLE_INTERVAL))
+	{
+		return false;
+	}
+
+	TcpInfo current;
+	if(!socket.get_tcp_info(current) || current.rtt == 0)
+	{
+		return false;
+	}
+
+	info = current;
+	sampled = now;
+
+	SeriesPtr entry = this->find(side, key);
+	entry->rtt.record(current.rtt);
+	entry->rtt_var.record(current.rtt_var);
+	if(current.segments_out > 0)
+	{
+		entry->retransmitted.record((boost::uint64_t)current.retransmits * 1000 / current.segments_out);
+	}
+	if(current.delivery_rate > 0)
+	{
+		entry->delivery_rate.record(current.delivery_rate);
+	}
+
+	return true;
+}
+
+std::string Telemetry::subnet(const std::string& address)
+{
+	if(address.find(':') == std::string::npos)
+	{
+		const size_t dot = address.rfind('.');
+		return dot == std::string::npos ? address : address.substr(0, dot) + ".0/24";
+	}
+
+	// the first three groups, unless "::" cuts them short
+	std::string prefix;
+	size_t start = 0;
+	for(int group = 0; group < 3; group++)
+	{
+		const size_t colon = address.find(':', start);
+		if(colon == std::string::npos || colon == start)
+		{
+			break; // "::" within the first 48 bits, the rest is zero
+		}
+		prefix += address.substr(start, colon - start) + ':';
+		start = colon + 1;
+	}
+	return (prefix.empty() ? "::" : prefix + ':') + "/48";
+}
+
+void Telemetry::report(std::ostream& out) const
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	for(int side = 0; side < SIDE_COUNT; side++)
+	{
+		const std::string name = SIDE_NAMES[side];
+		for(SeriesMap::const_iterator it = this->series[side].begin(); it != this->series[side].end(); ++it)
+		{
+			const Series& entry = *it->second;
+			out << name << "_rtt_p50_us " << it->first << ' ' << entry.rtt.percentile(50.0) << '\n'
+			    << name << "_rtt_p99_us " << it->first << ' ' << entry.rtt.percentile(99.0) << '\n'
+			    << name << "_rttvar_p50_us " << it->first << ' ' << entry.rtt_var.percentile(50.0) << '\n'
+			    << name << "_retransmitted_p99_permille " << it->first << ' ' << entry.retransmitted.percentile(99.0) << '\n'
+			    << name << "_delivery_rate_p50_bytes_per_s " << it->first << ' ' << entry.delivery_rate.percentile(50.0) << '\n';
+		}
+	}
+}
+
+Telemetry::SeriesPtr Telemetry::find(Side side, const std::string& key)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	SeriesMap& map = this->series[side];
+	SeriesMap::iterator it = map.find(key);
+	if(it != map.end())
+	{
+		return it->second;
+	}
+
+	// keep the status page and memory bounded with many clients
+	const std::string name = map.size() < MAX_KEYS ? key : std::string(OTHER);
+	SeriesPtr& entry = map[name];
+	if(!entry)
+	{
+		entry.reset(new Series);
+	}
+	return entry;
+}
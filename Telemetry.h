@@ -0,0 +1,61 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <ostream>
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include "Socket.h"
+#include "Histogram.h"
+
+// Network conditions as the kernel sees them (TCP_INFO), aggregated per client
+// subnet and per origin, so slow networks can be told apart from a slow proxy
+class Telemetry
+{
+public:
+
+	enum Side
+	{
+		CLIENT,
+		ORIGIN,
+		SIDE_COUNT
+	};
+
+	static const boost::uint64_t SAMPLE_INTERVAL = 1000000U; // microseconds between samples of a connection
+	static const size_t MAX_KEYS = 128U; // per side, later keys are counted as OTHER
+	static const char* const OTHER;
+
+	// samples the connection unless its last sample (Clock::now() in sampled) is recent
+	// and force isn't set, info holds the latest sample either way
+	bool sample(Side side, const std::string& key, Socket socket, TcpInfo& info, boost::uint64_t& sampled, bool force = false);
+
+	// "a.b.c.0/24" for IPv4 addresses, the first 48 bits for IPv6
+	static std::string subnet(const std::string& address);
+
+	// percentiles per key, for the status page
+	void report(std::ostream& out) const;
+
+private:
+
+	struct Series
+	{
+		Histogram rtt;           // microseconds
+		Histogram rtt_var;       // microseconds
+		Histogram retransmitted; // per mille of the segments sent
+		Histogram delivery_rate; // bytes per second
+	};
+
+	typedef boost::shared_ptr<Series> SeriesPtr;
+	typedef std::map<std::string, SeriesPtr> SeriesMap;
+
+	SeriesMap series[SIDE_COUNT];
+	mutable boost::mutex guard;
+
+	SeriesPtr find(Side side, const std::string& key);
+};
+
+#endif
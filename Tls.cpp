@@ -0,0 +1,364 @@
+#include "Tls.h"
+
+#include "Message.h"
+#include "Stats.h"
+#include "Clock.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <boost/thread/locks.hpp>
+
+namespace
+{
+	std::string last_error()
+	{
+		char buf[256];
+		ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+		return buf;
+	}
+
+	// select() with what is left until the deadline, false once it passed
+	bool wait_socket(const Socket& socket, bool write, boost::uint64_t until)
+	{
+		const boost::uint64_t now = Clock::now();
+		if(now >= until)
+			return false;
+
+		const boost::uint64_t remaining = until - now;
+		const long seconds = (long)(remaining / 1000000);
+		const long microseconds = (long)(remaining % 1000000);
+		return write ? socket.select_write(seconds, microseconds) : socket.select_read(seconds, microseconds);
+	}
+
+	// the socket is non-blocking, the SSL object is shared by the threads using the connection
+	// (an HTTP/2 reader and its writers), so every call into it is serialized
+	class TlsLayer : public SocketLayer
+	{
+	public:
+
+		TlsLayer(SSL* ssl, Socket socket, const std::string& key)
+		{
+			this->ssl = ssl;
+			this->socket = socket;
+			this->key = key;
+			this->closed = false;
+		}
+
+		~TlsLayer()
+		{
+			SSL_free(this->ssl);
+		}
+
+		const std::string& get_key() const { return this->key; }
+
+		virtual int read(char* buf, size_t size, bool peek)
+		{
+			while(true)
+			{
+				int error;
+				{
+					boost::unique_lock<boost::mutex> lock(this->guard);
+					if(this->closed)
+						return 0;
+
+					ERR_clear_error();
+					const int result = peek ? SSL_peek(this->ssl, buf, (int)size) : SSL_read(this->ssl, buf, (int)size);
+					if(result > 0)
+						return result;
+					error = SSL_get_error(this->ssl, result);
+				}
+
+				if(error == SSL_ERROR_ZERO_RETURN)
+					return 0;
+				if(!this->wait(error))
+					return -1;
+			}
+		}
+
+		virtual int write(const char* buf, size_t size)
+		{
+			while(true)
+			{
+				int error;
+				{
+					boost::unique_lock<boost::mutex> lock(this->guard);
+					if(this->closed)
+						return -1;
+
+					ERR_clear_error();
+					const int result = SSL_write(this->ssl, buf, (int)size);
+					if(result > 0)
+						return result;
+					error = SSL_get_error(this->ssl, result);
+				}
+
+				if(!this->wait(error))
+					return -1;
+			}
+		}
+
+		virtual bool pending()
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+			return !this->closed && SSL_has_pending(this->ssl);
+		}
+
+		virtual void close()
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+			if(!this->closed)
+			{
+				SSL_shutdown(this->ssl); // close_notify, we don't wait for the peer's
+				this->closed = true;
+			}
+		}
+
+	private:
+
+		// how long a blocked call sleeps before it looks again, another thread may have
+		// pulled the record it waits for into the SSL buffers meanwhile
+		static const long RECHECK_MS = 100;
+
+		SSL* ssl;
+		Socket socket; // plain copy, without this layer
+		std::string key;
+		bool closed;
+		boost::mutex guard;
+
+		bool wait(int error)
+		{
+			if(error == SSL_ERROR_WANT_READ)
+			{
+				this->socket.select_read(0, RECHECK_MS * 1000);
+				return true;
+			}
+			if(error == SSL_ERROR_WANT_WRITE)
+			{
+				this->socket.select_write(0, RECHECK_MS * 1000);
+				return true;
+			}
+			return false;
+		}
+	};
+}
+#endif
+
+bool TlsClient::available()
+{
+#ifdef HAVE_OPENSSL
+	return true;
+#else
+	return false;
+#endif
+}
+
+TlsClient::TlsClient()
+{
+#ifdef HAVE_OPENSSL
+	this->context = NULL;
+#endif
+}
+
+TlsClient::~TlsClient()
+{
+#ifdef HAVE_OPENSSL
+	for(std::map<std::string, SSL_SESSION*>::iterator it = this->sessions.begin(); it != this->sessions.end(); ++it)
+	{
+		SSL_SESSION_free(it->second);
+	}
+
+	if(this->context)
+	{
+		SSL_CTX_free(this->context);
+	}
+#endif
+}
+
+bool TlsClient::init(const TlsSettings& settings)
+{
+#ifdef HAVE_OPENSSL
+	this->context = SSL_CTX_new(TLS_client_method());
+	if(!this->context)
+	{
+		Message::error() << "TLS: " << last_error() << '\n';
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(this->context, TLS1_2_VERSION);
+	SSL_CTX_set_mode(this->context, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	long options = 0;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	options |= SSL_OP_IGNORE_UNEXPECTED_EOF; // plenty of servers just close
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	if(settings.ktls)
+		options |= SSL_OP_ENABLE_KTLS;
+#else
+	if(settings.ktls)
+		Message::warning() << "TLS: this OpenSSL can't do kTLS" << '\n';
+#endif
+	SSL_CTX_set_options(this->context, options);
+
+	if(settings.verify)
+	{
+		const bool loaded = settings.ca_file.empty() ?
+			SSL_CTX_set_default_verify_paths(this->context) == 1 :
+			SSL_CTX_load_verify_locations(this->context, settings.ca_file.c_str(), NULL) == 1;
+		if(!loaded)
+		{
+			Message::error() << "TLS: can't load CA certificates: " << last_error() << '\n';
+			return false;
+		}
+	}
+	SSL_CTX_set_verify(this->context, settings.verify ? SSL_VERIFY_PEER : SSL_VERIFY_NONE, NULL);
+
+	// we keep the sessions ourselves, by origin rather than by the server's session ID
+	SSL_CTX_set_session_cache_mode(this->context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(this->context, &TlsClient::new_session);
+	SSL_CTX_set_app_data(this->context, this);
+
+	return true;
+#else
+	(void)settings;
+	Message::error() << "built without OpenSSL" << '\n';
+	return false;
+#endif
+}
+
+bool TlsClient::connect(Socket& socket, const std::string& key, const std::string& name, const std::vector<std::string>& alpn, std::string& negotiated, long seconds)
+{
+#ifdef HAVE_OPENSSL
+	if(!this->context)
+		return false;
+
+	SSL* ssl = SSL_new(this->context);
+	if(!ssl)
+		return false;
+
+	// owns ssl from here on
+	boost::shared_ptr<TlsLayer> layer(new TlsLayer(ssl, socket, key));
+	SSL_set_app_data(ssl, layer.get());
+	SSL_set_fd(ssl, (int)socket.get());
+
+	SSL_set_tlsext_host_name(ssl, name.c_str());
+	SSL_set1_host(ssl, name.c_str()); // only checked with verification on
+
+	if(!alpn.empty())
+	{
+		std::string protocols;
+		for(size_t i = 0; i < alpn.size(); i++)
+		{
+			protocols += (char)alpn[i].size();
+			protocols += alpn[i];
+		}
+		SSL_set_alpn_protos(ssl, (const unsigned char*)protocols.data(), (unsigned int)protocols.size());
+	}
+
+	SSL_SESSION* session = this->find_session(key);
+	if(session)
+	{
+		SSL_set_session(ssl, session);
+		SSL_SESSION_free(session);
+	}
+
+	socket.set_nonblocking(true);
+
+	const boost::uint64_t until = Clock::now() + (boost::uint64_t)seconds * 1000000;
+	while(true)
+	{
+		ERR_clear_error();
+		const int result = SSL_connect(ssl);
+		if(result == 1)
+			break;
+
+		const int error = SSL_get_error(ssl, result);
+		if((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) ||
+		   !wait_socket(socket, error == SSL_ERROR_WANT_WRITE, until))
+		{
+			const long verify = SSL_get_verify_result(ssl);
+			Message::error() << "TLS handshake with " << name << " failed: "
+			                 << (verify != X509_V_OK ? X509_verify_cert_error_string(verify) : last_error().c_str()) << '\n';
+			Stats::increment(Stats::TLS_FAILURES);
+			return false;
+		}
+	}
+
+	Stats::increment(Stats::TLS_HANDSHAKES);
+	if(SSL_session_reused(ssl))
+	{
+		Stats::increment(Stats::TLS_RESUMED);
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl)))
+	{
+		Stats::increment(Stats::KTLS_CONNECTIONS);
+	}
+#endif
+
+	const unsigned char* selected = NULL;
+	unsigned int selected_size = 0;
+	SSL_get0_alpn_selected(ssl, &selected, &selected_size);
+	negotiated.assign((const char*)selected, selected_size);
+
+	socket.set_layer(layer);
+	return true;
+#else
+	(void)socket;
+	(void)key;
+	(void)name;
+	(void)alpn;
+	(void)negotiated;
+	(void)seconds;
+	return false;
+#endif
+}
+
+#ifdef HAVE_OPENSSL
+int TlsClient::new_session(SSL* ssl, SSL_SESSION* session)
+{
+	TlsLayer* layer = static_cast<TlsLayer*>(SSL_get_app_data(ssl));
+	TlsClient* client = static_cast<TlsClient*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+	if(!layer || !client)
+		return 0;
+
+	// TLS 1.3 tickets arrive after the handshake, the newest one wins
+	client->store_session(layer->get_key(), session);
+	return 1; // the reference is ours now
+}
+
+void TlsClient::store_session(const std::string& key, SSL_SESSION* session)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	std::map<std::string, SSL_SESSION*>::iterator it = this->sessions.find(key);
+	if(it != this->sessions.end())
+	{
+		SSL_SESSION_free(it->second);
+		it->second = session;
+		return;
+	}
+
+	if(this->sessions.size() >= MAX_SESSIONS)
+	{
+		SSL_SESSION_free(this->sessions.begin()->second);
+		this->sessions.erase(this->sessions.begin());
+	}
+
+	this->sessions[key] = session;
+}
+
+SSL_SESSION* TlsClient::find_session(const std::string& key)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	std::map<std::string, SSL_SESSION*>::iterator it = this->sessions.find(key);
+	if(it == this->sessions.end() || !SSL_SESSION_is_resumable(it->second))
+		return NULL;
+
+	// the caller gets its own reference, the cached one may be replaced meanwhile
+	SSL_SESSION_up_ref(it->second);
+	return it->second;
+}
+#endif
@@ -0,0 +1,59 @@
+#ifndef TLS_H
+#define TLS_H
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <boost/thread/mutex.hpp>
+#include "Socket.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+
+struct TlsSettings
+{
+	TlsSettings() : verify(true), ktls(false) { }
+
+	std::string ca_file; // PEM bundle, the system's store if empty
+	bool verify;         // certificate chain and host name
+	bool ktls;           // hand the record layer to the kernel where supported
+};
+
+// TLS client for upstream connections (OpenSSL, only with HAVE_OPENSSL)
+// Sessions (IDs and tickets alike) are cached per origin, reconnecting
+// resumes them instead of paying for a full handshake.
+class TlsClient
+{
+public:
+
+	static bool available();
+
+	TlsClient();
+	~TlsClient();
+
+	bool init(const TlsSettings& settings);
+
+	// handshake on a connected socket, installs the TLS layer on it
+	// key identifies the origin for the session cache, name is used for SNI and verification
+	// alpn lists the protocols to offer, negotiated receives the server's choice
+	bool connect(Socket& socket, const std::string& key, const std::string& name, const std::vector<std::string>& alpn, std::string& negotiated, long seconds);
+
+private:
+
+	static const size_t MAX_SESSIONS = 1024;
+
+#ifdef HAVE_OPENSSL
+	SSL_CTX* context;
+	std::map<std::string, SSL_SESSION*> sessions;
+	boost::mutex guard;
+
+	static int new_session(SSL* ssl, SSL_SESSION* session);
+	void store_session(const std::string& key, SSL_SESSION* session);
+	SSL_SESSION* find_session(const std::string& key);
+#endif
+};
+
+#endif
@@ -0,0 +1,359 @@
+#include "Trace.h"
+
+#include <cstring>
+#include <cctype>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+	const char MAGIC[8] = { 'H', 'P', 'X', 'T', 'R', 'A', 'C', 'E' };
+
+	// file header offsets
+	const size_t VERSION_AT = 8;
+	const size_t START_AT = 16;
+	const size_t USED_AT = 24;
+
+	template<class T>
+	void put(char* at, T value)
+	{
+		std::memcpy(at, &value, sizeof(value));
+	}
+
+	template<class T>
+	T get(const char* at)
+	{
+		T value;
+		std::memcpy(&value, at, sizeof(value));
+		return value;
+	}
+
+	size_t padded(size_t size)
+	{
+		return (size + 7) & ~(size_t)7;
+	}
+
+	boost::uint64_t unix_time()
+	{
+#ifdef _WIN32
+		FILETIME now;
+		GetSystemTimeAsFileTime(&now);
+		const boost::uint64_t ticks = ((boost::uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime; // 100ns since 1601
+		return ticks / 10 - 11644473600000000ULL;
+#else
+		timeval now;
+		gettimeofday(&now, NULL);
+		return (boost::uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+	}
+
+	bool blanked(const std::string& name)
+	{
+		const char* const NAMES[] = { "authorization", "proxy-authorization", "cookie" };
+		for(size_t i = 0; i < sizeof(NAMES) / sizeof(NAMES[0]); i++)
+		{
+			if(name.size() == std::strlen(NAMES[i]))
+			{
+				size_t c = 0;
+				while(c < name.size() && std::tolower((unsigned char)name[c]) == NAMES[i][c])
+					c++;
+				if(c == name.size())
+					return true;
+			}
+		}
+		return false;
+	}
+}
+
+TraceFile::TraceFile() : data(NULL), size(0), writable(false), used(0)
+{
+#ifdef _WIN32
+	this->file = INVALID_HANDLE_VALUE;
+	this->mapping = NULL;
+#else
+	this->file = -1;
+#endif
+}
+
+TraceFile::~TraceFile()
+{
+	this->close();
+}
+
+bool TraceFile::create(const std::string& path, size_t capacity)
+{
+	this->close();
+
+	if(capacity < FILE_HEADER + RECORD_HEADER || !this->map(path, capacity, true))
+	{
+		return false;
+	}
+
+	std::memcpy(this->data, MAGIC, sizeof(MAGIC));
+	put<boost::uint32_t>(this->data + VERSION_AT, VERSION);
+	put<boost::uint64_t>(this->data + START_AT, unix_time());
+	put<boost::uint64_t>(this->data + USED_AT, 0);
+
+	this->writable = true;
+	this->used.store(0);
+	return true;
+}
+
+bool TraceFile::open(const std::string& path)
+{
+	this->close();
+
+	if(!this->map(path, 0, false))
+	{
+		return false;
+	}
+
+	if(this->size < FILE_HEADER || std::memcmp(this->data, MAGIC, sizeof(MAGIC)) != 0 ||
+	   get<boost::uint32_t>(this->data + VERSION_AT) != VERSION)
+	{
+		this->unmap();
+		return false;
+	}
+
+	this->writable = false;
+	this->used.store((size_t)get<boost::uint64_t>(this->data + USED_AT));
+	return true;
+}
+
+void TraceFile::close()
+{
+	if(!this->data)
+		return;
+
+	size_t length = 0;
+	if(this->writable)
+	{
+		size_t end = this->used.load();
+		if(end > this->size - FILE_HEADER)
+		{
+			end = this->size - FILE_HEADER; // the record that didn't fit
+		}
+		put<boost::uint64_t>(this->data + USED_AT, end);
+		length = FILE_HEADER + end;
+	}
+
+	this->unmap(length);
+}
+
+bool TraceFile::append(const TraceRecord& record)
+{
+	if(!this->writable)
+		return false;
+
+	const size_t total = padded(RECORD_HEADER + record.request_header.size());
+	const size_t offset = this->used.fetch_add(total, boost::memory_order_relaxed);
+	if(offset + total > this->size - FILE_HEADER)
+	{
+		return false; // full, and stays that way
+	}
+
+	char* at = this->data + FILE_HEADER + offset;
+	put<boost::uint16_t>(at + 4, record.status);
+	put<boost::uint16_t>(at + 6, record.flags);
+	put<boost::uint32_t>(at + 8, (boost::uint32_t)record.request_header.size());
+	put<boost::uint32_t>(at + 12, record.response_header);
+	put<boost::uint32_t>(at + 16, record.ttfb);
+	put<boost::uint32_t>(at + 20, record.duration);
+	put<boost::uint64_t>(at + 24, record.time);
+	put<boost::uint64_t>(at + 32, record.connection);
+	put<boost::uint64_t>(at + 40, record.request_body);
+	put<boost::uint64_t>(at + 48, record.response_body);
+	std::memcpy(at + RECORD_HEADER, record.request_header.data(), record.request_header.size());
+
+	// readers of a live trace stop at a record without its size
+	boost::atomic_thread_fence(boost::memory_order_release);
+	put<boost::uint32_t>(at, (boost::uint32_t)total);
+	return true;
+}
+
+bool TraceFile::read(size_t& offset, TraceRecord& record) const
+{
+	// a capture that wasn't closed has no size in the header, the records end with a 0 size then
+	size_t end = this->used.load();
+	if(end == 0 || end > this->size - FILE_HEADER)
+	{
+		end = this->size - FILE_HEADER;
+	}
+
+	if(!this->data || offset + RECORD_HEADER > end)
+		return false;
+
+	const char* at = this->data + FILE_HEADER + offset;
+	const boost::uint32_t total = get<boost::uint32_t>(at);
+	const boost::uint32_t header = get<boost::uint32_t>(at + 8);
+	if(total < RECORD_HEADER || offset + total > end || RECORD_HEADER + header > total)
+		return false;
+
+	record.status = get<boost::uint16_t>(at + 4);
+	record.flags = get<boost::uint16_t>(at + 6);
+	record.response_header = get<boost::uint32_t>(at + 12);
+	record.ttfb = get<boost::uint32_t>(at + 16);
+	record.duration = get<boost::uint32_t>(at + 20);
+	record.time = get<boost::uint64_t>(at + 24);
+	record.connection = get<boost::uint64_t>(at + 32);
+	record.request_body = get<boost::uint64_t>(at + 40);
+	record.response_body = get<boost::uint64_t>(at + 48);
+	record.request_header.assign(at + RECORD_HEADER, header);
+
+	offset += total;
+	return true;
+}
+
+boost::uint64_t TraceFile::get_start() const
+{
+	return this->data ? get<boost::uint64_t>(this->data + START_AT) : 0;
+}
+
+std::string TraceFile::sanitize(const std::string& header)
+{
+	std::string clean = header;
+
+	// query strings carry session ids and the like, keep only their shape
+	const size_t line_end = clean.find("\r\n");
+	const size_t query = clean.find('?');
+	if(query != std::string::npos && query < line_end)
+	{
+		const size_t url_end = clean.find(' ', query);
+		for(size_t i = query + 1; i < url_end && i < line_end; i++)
+		{
+			if(clean[i] != '&' && clean[i] != '=')
+				clean[i] = 'x';
+		}
+	}
+
+	for(size_t line = line_end; line != std::string::npos && line + 2 < clean.size(); line = clean.find("\r\n", line + 2))
+	{
+		const size_t start = line + 2;
+		const size_t colon = clean.find(':', start);
+		const size_t end = clean.find("\r\n", start);
+		if(colon == std::string::npos || colon > end)
+			continue;
+
+		if(blanked(clean.substr(start, colon - start)))
+		{
+			for(size_t i = colon + 1; i < end; i++)
+			{
+				if(clean[i] != ' ')
+					clean[i] = 'x';
+			}
+		}
+	}
+
+	return clean;
+}
+
+bool TraceFile::map(const std::string& path, size_t capacity, bool create)
+{
+#ifdef _WIN32
+	this->file = CreateFileA(path.c_str(), create ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+	                         create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(this->file == INVALID_HANDLE_VALUE)
+		return false;
+
+	if(!create)
+	{
+		LARGE_INTEGER length;
+		if(!GetFileSizeEx(this->file, &length) || length.QuadPart == 0)
+		{
+			this->unmap();
+			return false;
+		}
+		capacity = (size_t)length.QuadPart;
+	}
+
+	// a writable mapping grows the file to its size
+	const boost::uint64_t size = capacity;
+	this->mapping = CreateFileMappingA(this->file, NULL, create ? PAGE_READWRITE : PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, NULL);
+	if(this->mapping != NULL)
+	{
+		this->data = (char*)MapViewOfFile(this->mapping, create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, capacity);
+	}
+#else
+	this->file = ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+	if(this->file < 0)
+		return false;
+
+	if(create)
+	{
+		if(::ftruncate(this->file, capacity) != 0)
+		{
+			this->unmap();
+			return false;
+		}
+	}
+	else
+	{
+		struct stat info;
+		if(::fstat(this->file, &info) != 0 || info.st_size == 0)
+		{
+			this->unmap();
+			return false;
+		}
+		capacity = (size_t)info.st_size;
+	}
+
+	void* mapped = ::mmap(NULL, capacity, create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, this->file, 0);
+	this->data = mapped != MAP_FAILED ? (char*)mapped : NULL;
+#endif
+
+	if(!this->data)
+	{
+		this->unmap();
+		return false;
+	}
+
+	this->size = capacity;
+	return true;
+}
+
+void TraceFile::unmap(size_t length)
+{
+#ifdef _WIN32
+	if(this->data)
+		UnmapViewOfFile(this->data);
+	if(this->mapping != NULL)
+		CloseHandle(this->mapping);
+	if(this->file != INVALID_HANDLE_VALUE)
+	{
+		if(length > 0)
+		{
+			LARGE_INTEGER end;
+			end.QuadPart = length;
+			SetFilePointerEx(this->file, end, NULL, FILE_BEGIN);
+			SetEndOfFile(this->file);
+		}
+		CloseHandle(this->file);
+	}
+	this->file = INVALID_HANDLE_VALUE;
+	this->mapping = NULL;
+#else
+	if(this->data)
+		::munmap(this->data, this->size);
+	if(this->file >= 0)
+	{
+		if(length > 0 && ::ftruncate(this->file, length) != 0)
+		{
+			// keeps the unused tail, readers stop at the first empty record anyway
+		}
+		::close(this->file);
+	}
+	this->file = -1;
+#endif
+
+	this->data = NULL;
+	this->size = 0;
+	this->writable = false;
+}
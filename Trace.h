@@ -0,0 +1,90 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#pragma once
+
+#include <string>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+
+// One answered request as captured for replay
+struct TraceRecord
+{
+	enum Flag
+	{
+		KEEP_ALIVE = 1 << 0, // the client kept the connection open afterwards
+		CACHED     = 1 << 1, // answered from the cache, no origin involved
+		HEAD       = 1 << 2  // response without a body
+	};
+
+	TraceRecord() :
+		time(0), connection(0), ttfb(0), duration(0), request_body(0), response_body(0),
+		response_header(0), status(0), flags(0) { }
+
+	boost::uint64_t time;            // request header in, microseconds since the capture started
+	boost::uint64_t connection;      // client connection id
+	boost::uint32_t ttfb;            // request sent upstream to response header, microseconds
+	boost::uint32_t duration;        // request header in to response relayed, microseconds
+	boost::uint64_t request_body;    // decoded bytes
+	boost::uint64_t response_body;   // decoded bytes, as the origin sent them
+	boost::uint32_t response_header; // bytes
+	boost::uint16_t status;
+	boost::uint16_t flags;
+	std::string request_header;      // sanitized, see TraceFile::sanitize()
+};
+
+// Memory mapped file holding a trace, records are appended lock free
+// The file is sized to the capacity up front and truncated to what was used on close.
+// Layout, host byte order: a 32 byte file header ("HPXTRACE", version, start time,
+// bytes used), then records of a 56 byte fixed part followed by the request header,
+// each padded to 8 bytes. A record's size is written last, 0 ends the trace.
+class TraceFile
+{
+public:
+
+	static const boost::uint32_t VERSION = 1U;
+
+	TraceFile();
+	~TraceFile();
+
+	// capacity in bytes, an existing file is replaced
+	bool create(const std::string& path, size_t capacity);
+	bool open(const std::string& path);
+	void close();
+
+	bool is_open() const { return this->data != NULL; }
+
+	// false once the file is full, safe to call from any thread
+	bool append(const TraceRecord& record);
+	// reads the record at offset (0 for the first one) and moves offset past it
+	bool read(size_t& offset, TraceRecord& record) const;
+
+	// unix time (microseconds) when the capture started
+	boost::uint64_t get_start() const;
+
+	// blanks credentials, cookies and query strings, keeping their size
+	static std::string sanitize(const std::string& header);
+
+private:
+
+	static const size_t FILE_HEADER = 32U;
+	static const size_t RECORD_HEADER = 56U;
+
+	char* data;
+	size_t size;
+	bool writable;
+	boost::atomic<size_t> used; // by records, writers reserve space here
+
+#ifdef _WIN32
+	void* file;
+	void* mapping;
+#else
+	int file;
+#endif
+
+	bool map(const std::string& path, size_t capacity, bool create);
+	// length > 0 truncates the file to it
+	void unmap(size_t length = 0);
+};
+
+#endif
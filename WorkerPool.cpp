@@ -0,0 +1,70 @@
+#include "WorkerPool.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread/locks.hpp>
+#include "Message.h"
+
+WorkerPool::WorkerPool(unsigned int threads, size_t max_queued)
+{
+	this->max_queued = max_queued;
+	this->stopping = false;
+
+	for(unsigned int i = 0; i < threads; i++)
+	{
+		this->threads.create_thread(boost::bind(&WorkerPool::run, this));
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	{
+		boost::unique_lock<boost::mutex> lock(this->guard);
+		this->stopping = true;
+		this->available.notify_all();
+	}
+
+	this->threads.join_all();
+}
+
+bool WorkerPool::submit(const Job& job)
+{
+	boost::unique_lock<boost::mutex> lock(this->guard);
+
+	if(this->stopping || this->jobs.size() >= this->max_queued)
+		return false;
+
+	this->jobs.push(job);
+	this->available.notify_one();
+	return true;
+}
+
+void WorkerPool::run()
+{
+	while(true)
+	{
+		Job job;
+
+		{
+			boost::unique_lock<boost::mutex> lock(this->guard);
+			while(!this->stopping && this->jobs.empty())
+			{
+				this->available.wait(lock);
+			}
+
+			if(this->stopping)
+				break;
+
+			job = this->jobs.front();
+			this->jobs.pop();
+		}
+
+		try
+		{
+			job();
+		}
+		catch(const std::exception& e)
+		{
+			Message::error() << "background job failed: " << e.what() << '\n';
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#pragma once
+
+#include <queue>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+// Fixed number of threads working off a bounded job queue, for background
+// work that should never hold up a client
+class WorkerPool
+{
+public:
+
+	typedef boost::function<void()> Job;
+
+	WorkerPool(unsigned int threads, size_t max_queued);
+	~WorkerPool(); // drops queued jobs, waits for running ones
+
+	// false if the queue is full, the job is dropped then
+	bool submit(const Job& job);
+
+private:
+
+	std::queue<Job> jobs;
+	size_t max_queued;
+	bool stopping;
+
+	boost::mutex guard;
+	boost::condition_variable available;
+
+	boost::thread_group threads;
+
+	void run();
+};
+
+#endif
@@ -13,6 +13,8 @@ int main(int argc, char* argv[])
 	std::cout << LOGO << '\n' << '\n';
 
 	const SocketAddress::port_t PROXY_PORT = 6666;
+	const size_t CACHE_SIZE = 64 * 1024 * 1024; // bytes
+	const long CACHE_GRACE = 10; // seconds stale objects may still be served
 
 	if(!Socket::startup())
 	{
@@ -24,6 +26,26 @@ int main(int argc, char* argv[])
 	auth.push_back(Authentication("test-user", "test-password"));
 
 	Proxy proxy(PROXY_PORT, auth);
+	proxy.enable_cache(CACHE_SIZE, CACHE_GRACE);
+	proxy.enable_compression(); // needs HAVE_ZLIB
+	//proxy.enable_access_log("access.log");
+	//proxy.enable_capture("traffic.trace"); // for tools/replay
+	//proxy.enable_slicing(); // Range requests from cached slices
+	//proxy.enable_prefetch(); // after enable_cache
+	//proxy.load_acl("blocklist.txt");
+	//proxy.set_memory_budget(512 * 1024 * 1024);
+	//proxy.enable_status(); // counters at /roxy-status, add the proxy's own "host:port" in reverse proxy mode
+	//proxy.set_workers(4); // prefork, shares the cache and counters
+
+	// reverse proxy mode
+	//std::vector<std::string> backends;
+	//backends.push_back("10.0.0.1:8080");
+	//backends.push_back("10.0.0.2:8080");
+	//proxy.add_backend_pool("web", backends);
+	//proxy.add_route("/", "web");
+	//proxy.add_http2_origin("10.0.0.1:8080"); // h2c backend
+	//proxy.enable_tls(); // needs HAVE_OPENSSL
+	//proxy.add_tls_origin("10.0.0.3:443");
 
 	if(!proxy.listen())
 	{
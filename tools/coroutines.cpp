@@ -0,0 +1,243 @@
+// Compares coroutines on one Reactor with a thread per connection
+//
+//   coroutines [connections] [round trips] [port]
+//
+// Every connection is a loopback TCP pair bouncing a small message back and
+// forth, once with both ends as coroutines on a single Reactor and once with
+// a blocking thread per end. Reports round trips per second, the time per
+// suspend/resume and the memory each coroutine took.
+//
+// Build: g++ -std=c++20 -DHAVE_COROUTINES -I. tools/coroutines.cpp Async.cpp Socket.cpp Clock.cpp Message.cpp -lboost_thread -lboost_system
+
+#include <iostream>
+#include <vector>
+#include <new>
+#include <cstdlib>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include "Async.h"
+#include "Socket.h"
+#include "Clock.h"
+
+#ifndef HAVE_COROUTINES
+#error needs C++20 and HAVE_COROUTINES, see the build line on top
+#endif
+
+namespace
+{
+	const size_t MESSAGE = 64; // bytes
+
+	// what spawning allocates, coroutine frames and the reactor's bookkeeping
+	size_t allocated = 0;
+	bool counting = false;
+
+	SocketAddress loopback(SocketAddress::port_t port)
+	{
+		return SocketAddress(SocketAddress::INET, Address::fromPresentation("127.0.0.1"), port);
+	}
+
+	// connected socket pairs over a listener on port
+	bool make_pairs(SocketAddress::port_t port, size_t count, std::vector<std::pair<Socket, Socket> >& pairs)
+	{
+		Socket listener(Socket::INET, Socket::STREAM);
+		SocketTuning tuning;
+		tuning.reuse_address = true;
+		listener.tune(tuning, true);
+		if(!listener.bind(loopback(port)) || !listener.listen(128))
+		{
+			std::cerr << "can't listen on port " << port << std::endl;
+			return false;
+		}
+
+		for(size_t i = 0; i < count; i++)
+		{
+			Socket client(Socket::INET, Socket::STREAM);
+			if(!client.connect(loopback(port)))
+				return false;
+			Socket server = listener.accept();
+			if(!server.valid())
+				return false;
+			SocketTuning pair_tuning;
+			pair_tuning.no_delay = true;
+			client.tune(pair_tuning);
+			server.tune(pair_tuning);
+			pairs.push_back(std::make_pair(client, server));
+		}
+
+		listener.close();
+		return true;
+	}
+
+	void close_pairs(std::vector<std::pair<Socket, Socket> >& pairs)
+	{
+		for(size_t i = 0; i < pairs.size(); i++)
+		{
+			pairs[i].first.close();
+			pairs[i].second.close();
+		}
+		pairs.clear();
+	}
+
+	Task<bool> read_message(AsyncSocket& socket, char* buf)
+	{
+		size_t total = 0;
+		while(total < MESSAGE)
+		{
+			const int read = co_await socket.recv(buf + total, MESSAGE - total);
+			if(read <= 0)
+				co_return false;
+			total += read;
+		}
+		co_return true;
+	}
+
+	Task<void> ping(Reactor& reactor, Socket socket, size_t trips, boost::atomic<size_t>& done)
+	{
+		AsyncSocket async(reactor, socket);
+		char buf[MESSAGE] = { 0 };
+		for(size_t i = 0; i < trips; i++)
+		{
+			if(co_await async.send(buf, MESSAGE) != MESSAGE || !co_await read_message(async, buf))
+				co_return;
+			done++;
+		}
+	}
+
+	Task<void> pong(Reactor& reactor, Socket socket, size_t trips)
+	{
+		AsyncSocket async(reactor, socket);
+		char buf[MESSAGE];
+		for(size_t i = 0; i < trips; i++)
+		{
+			if(!co_await read_message(async, buf) || co_await async.send(buf, MESSAGE) != MESSAGE)
+				co_return;
+		}
+	}
+
+	bool read_blocking(Socket socket, char* buf)
+	{
+		size_t total = 0;
+		while(total < MESSAGE)
+		{
+			const int read = socket.recv(buf + total, MESSAGE - total);
+			if(read <= 0)
+				return false;
+			total += read;
+		}
+		return true;
+	}
+
+	void ping_thread(Socket socket, size_t trips, boost::atomic<size_t>* done)
+	{
+		char buf[MESSAGE] = { 0 };
+		for(size_t i = 0; i < trips; i++)
+		{
+			if(socket.send(buf, MESSAGE) != MESSAGE || !read_blocking(socket, buf))
+				return;
+			(*done)++;
+		}
+	}
+
+	void pong_thread(Socket socket, size_t trips)
+	{
+		char buf[MESSAGE];
+		for(size_t i = 0; i < trips; i++)
+		{
+			if(!read_blocking(socket, buf) || socket.send(buf, MESSAGE) != MESSAGE)
+				return;
+		}
+	}
+
+	void report(const char* name, size_t trips, boost::uint64_t elapsed)
+	{
+		const double seconds = elapsed / 1e6;
+		std::cout << name << ": " << trips << " round trips in " << seconds << " s, "
+			<< (size_t)(trips / seconds) << "/s" << std::endl;
+	}
+}
+
+void* operator new(size_t size)
+{
+	if(counting)
+		allocated += size;
+	void* p = std::malloc(size ? size : 1);
+	if(!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+int main(int argc, char* argv[])
+{
+	const size_t connections = argc > 1 ? std::atoi(argv[1]) : 100;
+	const size_t trips = argc > 2 ? std::atoi(argv[2]) : 1000;
+	const SocketAddress::port_t port = argc > 3 ? (SocketAddress::port_t)std::atoi(argv[3]) : 8097;
+
+	if(!Socket::startup())
+		return 1;
+
+	std::vector<std::pair<Socket, Socket> > pairs;
+	if(!make_pairs(port, connections, pairs))
+		return 1;
+
+	// coroutines, both ends of every pair on this thread
+	{
+		Reactor reactor;
+		if(!reactor.valid())
+			return 1;
+		boost::atomic<size_t> done(0);
+
+		const boost::uint64_t start = Clock::now();
+		counting = true;
+		for(size_t i = 0; i < pairs.size(); i++)
+		{
+			// pong waits for the first message, ping's first send goes straight out
+			reactor.spawn(pong(reactor, pairs[i].second, trips));
+			reactor.spawn(ping(reactor, pairs[i].first, trips, done));
+		}
+		counting = false;
+		reactor.run();
+		const boost::uint64_t elapsed = Clock::now() - start;
+
+		report("coroutines", done, elapsed);
+		// every round trip suspends and resumes both ends once
+		std::cout << "  " << (elapsed * 1000.0 / (2.0 * done)) << " ns per suspend/resume incl. syscalls, "
+			<< allocated / (2 * connections) << " bytes per coroutine" << std::endl;
+	}
+
+	close_pairs(pairs);
+	if(!make_pairs(port, connections, pairs))
+		return 1;
+
+	// a blocking thread per end
+	{
+		boost::atomic<size_t> done(0);
+		boost::thread_group threads;
+
+		const boost::uint64_t start = Clock::now();
+		for(size_t i = 0; i < pairs.size(); i++)
+		{
+			threads.create_thread(boost::bind(&pong_thread, pairs[i].second, trips));
+			threads.create_thread(boost::bind(&ping_thread, pairs[i].first, trips, &done));
+		}
+		threads.join_all();
+		const boost::uint64_t elapsed = Clock::now() - start;
+
+		report("threads", done, elapsed);
+		std::cout << "  " << (elapsed * 1000.0 / (2.0 * done)) << " ns per block/wake incl. syscalls, "
+			<< 2 * connections << " threads" << std::endl;
+	}
+
+	close_pairs(pairs);
+	return 0;
+}
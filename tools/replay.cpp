@@ -0,0 +1,445 @@
+// Replays a trace captured with Proxy::enable_capture() through a running proxy
+//
+//   replay <trace> <proxy host:port> [speed] [origin port] [user:password]
+//
+// Requests go out on as many connections as were recorded, each one at its
+// recorded time (divided by speed), with its recorded header and body size.
+// Their URLs point at a synthetic origin on 127.0.0.1 which answers with the
+// recorded status, header and body size after the recorded time to first byte.
+// Nothing leaves the machine. The proxy has to run in forward proxy mode.
+//
+// Build: g++ -I. tools/replay.cpp Trace.cpp Socket.cpp Histogram.cpp Clock.cpp base64.cpp -lboost_thread -lboost_system
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include "Trace.h"
+#include "Socket.h"
+#include "Histogram.h"
+#include "Clock.h"
+#include "base64.h"
+
+namespace
+{
+	const long TIMEOUT = 30; // seconds
+	const char* const ID_HEADER = "X-Replay-Id";
+
+	std::vector<TraceRecord> records;
+	double speed = 1.0;
+	SocketAddress::port_t origin_port = 8099;
+	SocketAddress proxy_address;
+	std::string credentials; // "Basic ..." or empty
+
+	boost::uint64_t started; // Clock::now()
+	Histogram latency;       // request sent to response read, microseconds
+	boost::atomic<unsigned int> completed(0);
+	boost::atomic<unsigned int> failed(0);
+
+	void wait_until(boost::uint64_t when)
+	{
+		const boost::uint64_t now = Clock::now();
+		if(when > now)
+		{
+			boost::this_thread::sleep(boost::posix_time::microseconds(when - now));
+		}
+	}
+
+	bool send_all(Socket socket, const std::string& data)
+	{
+		return socket.send(data.data(), data.size()) == data.size();
+	}
+
+	// the header up to and including the empty line, body bytes behind it stay in rest
+	bool read_header(Socket socket, std::string& rest, std::string& header)
+	{
+		char buf[4096];
+		size_t end;
+		while((end = rest.find("\r\n\r\n")) == std::string::npos)
+		{
+			if(!socket.select_read(TIMEOUT))
+				return false;
+			int read = socket.recv(buf, sizeof(buf));
+			if(read <= 0)
+				return false;
+			rest.append(buf, read);
+		}
+
+		header = rest.substr(0, end + 4);
+		rest.erase(0, end + 4);
+		return true;
+	}
+
+	bool read_some(Socket socket, std::string& rest)
+	{
+		char buf[16384];
+		if(!socket.select_read(TIMEOUT))
+			return false;
+		int read = socket.recv(buf, sizeof(buf));
+		if(read <= 0)
+			return false;
+		rest.append(buf, read);
+		return true;
+	}
+
+	bool skip_body(Socket socket, std::string& rest, boost::uint64_t size)
+	{
+		while(rest.size() < size)
+		{
+			size -= rest.size();
+			rest.clear();
+			if(!read_some(socket, rest))
+				return false;
+		}
+		rest.erase(0, (size_t)size);
+		return true;
+	}
+
+	bool skip_chunked(Socket socket, std::string& rest)
+	{
+		while(true)
+		{
+			size_t line;
+			while((line = rest.find("\r\n")) == std::string::npos)
+			{
+				if(!read_some(socket, rest))
+					return false;
+			}
+
+			const boost::uint64_t size = std::strtoul(rest.c_str(), NULL, 16);
+			rest.erase(0, line + 2);
+			if(!skip_body(socket, rest, size + 2)) // the data and its CRLF
+				return false;
+			if(size == 0)
+				return true; // no trailers from the proxy
+		}
+	}
+
+	// value of a header field, matched case insensitively, empty if missing
+	std::string field(const std::string& header, const std::string& name)
+	{
+		size_t line = header.find("\r\n");
+		while(line != std::string::npos && line + 2 < header.size())
+		{
+			const size_t start = line + 2;
+			const size_t end = header.find("\r\n", start);
+			const size_t colon = header.find(':', start);
+			if(colon < end && colon - start == name.size())
+			{
+				size_t c = 0;
+				while(c < name.size() && std::tolower((unsigned char)header[start + c]) == std::tolower((unsigned char)name[c]))
+					c++;
+				if(c == name.size())
+				{
+					size_t value = colon + 1;
+					while(value < end && header[value] == ' ')
+						value++;
+					return header.substr(value, end - value);
+				}
+			}
+			line = end;
+		}
+		return std::string();
+	}
+
+	// the recorded request, aimed at our origin
+	std::string rewrite(const TraceRecord& record, size_t index)
+	{
+		const std::string& header = record.request_header;
+		const size_t line_end = header.find("\r\n");
+		const size_t method_end = header.find(' ');
+		const size_t url_end = header.find(' ', method_end + 1);
+		if(line_end == std::string::npos || method_end > line_end || url_end > line_end)
+			return std::string();
+
+		// absolute URLs in forward proxy mode, the path is all we keep
+		std::string path = header.substr(method_end + 1, url_end - method_end - 1);
+		const size_t scheme = path.find("://");
+		if(scheme != std::string::npos)
+		{
+			const size_t slash = path.find('/', scheme + 3);
+			path = slash == std::string::npos ? "/" : path.substr(slash);
+		}
+
+		std::ostringstream origin;
+		origin << "127.0.0.1:" << origin_port;
+
+		std::ostringstream request;
+		request << header.substr(0, method_end) << " http://" << origin.str() << path << header.substr(url_end, line_end - url_end) << "\r\n";
+
+		// replaced below, the rest goes out as recorded (sanitized values included)
+		const char* const DROPPED[] = { "host", "proxy-authorization", "content-length", "transfer-encoding", "expect" };
+		size_t line = line_end;
+		while(line + 2 < header.size())
+		{
+			const size_t start = line + 2;
+			const size_t end = header.find("\r\n", start);
+			if(end == std::string::npos || end == start)
+				break;
+
+			const size_t colon = header.find(':', start);
+			std::string name = header.substr(start, colon < end ? colon - start : 0);
+			for(size_t c = 0; c < name.size(); c++)
+				name[c] = (char)std::tolower((unsigned char)name[c]);
+
+			bool dropped = false;
+			for(size_t i = 0; i < sizeof(DROPPED) / sizeof(DROPPED[0]); i++)
+				dropped = dropped || name == DROPPED[i];
+			if(!dropped)
+				request << header.substr(start, end - start) << "\r\n";
+
+			line = end;
+		}
+
+		request << "Host: " << origin.str() << "\r\n"
+		        << ID_HEADER << ": " << index << "\r\n";
+		if(!credentials.empty())
+			request << "Proxy-Authorization: " << credentials << "\r\n";
+		if(record.request_body > 0)
+			request << "Content-Length: " << record.request_body << "\r\n";
+		request << "\r\n";
+
+		return request.str();
+	}
+
+	bool bodiless(int status)
+	{
+		return (status >= 100 && status < 200) || status == 204 || status == 304;
+	}
+
+	bool read_response(Socket socket, std::string& rest, bool head, bool& keep_alive)
+	{
+		std::string header;
+		if(!read_header(socket, rest, header))
+			return false;
+
+		const int status = header.size() > 9 ? std::atoi(header.c_str() + 9) : 0;
+		const std::string connection = field(header, "Connection");
+		keep_alive = header.compare(0, 8, "HTTP/1.1") == 0 ? connection != "close" : connection == "keep-alive";
+
+		if(head || bodiless(status))
+			return true;
+
+		if(field(header, "Transfer-Encoding") == "chunked")
+			return skip_chunked(socket, rest);
+
+		const std::string length = field(header, "Content-Length");
+		if(!length.empty())
+			return skip_body(socket, rest, std::strtoull(length.c_str(), NULL, 10));
+
+		// delimited by the close
+		keep_alive = false;
+		while(read_some(socket, rest))
+			rest.clear();
+		return true;
+	}
+
+	// one recorded client connection, reconnecting where the client did
+	void replay_connection(const std::vector<size_t>& indices)
+	{
+		Socket socket;
+		std::string rest;
+
+		for(size_t i = 0; i < indices.size(); i++)
+		{
+			const TraceRecord& record = records[indices[i]];
+			wait_until(started + (boost::uint64_t)(record.time / speed));
+
+			const std::string request = rewrite(record, indices[i]);
+			if(request.empty())
+			{
+				failed++;
+				continue;
+			}
+
+			if(!socket.valid())
+			{
+				socket = Socket(Socket::INET, Socket::STREAM);
+				if(socket.connect(proxy_address, TIMEOUT) != Socket::CONNECTED)
+				{
+					socket.close();
+					failed++;
+					continue;
+				}
+				socket.set_no_delay(true); // header and body go out separately
+				rest.clear();
+			}
+
+			const boost::uint64_t sent = Clock::now();
+			bool keep_alive = false;
+			bool ok = send_all(socket, request);
+			if(ok && record.request_body > 0)
+			{
+				const std::string body((size_t)record.request_body, 'r');
+				ok = send_all(socket, body);
+			}
+			ok = ok && read_response(socket, rest, (record.flags & TraceRecord::HEAD) != 0, keep_alive);
+
+			if(ok)
+			{
+				latency.record(Clock::now() - sent);
+				completed++;
+			}
+			else
+			{
+				failed++;
+			}
+
+			if(!ok || !keep_alive || !(record.flags & TraceRecord::KEEP_ALIVE))
+			{
+				socket.close();
+			}
+		}
+
+		socket.close();
+	}
+
+	// answers one proxy connection to the origin with whatever the requests recorded
+	void serve_origin(Socket socket)
+	{
+		std::string rest;
+		std::string header;
+		while(read_header(socket, rest, header))
+		{
+			const size_t index = std::strtoul(field(header, ID_HEADER).c_str(), NULL, 10);
+			if(index >= records.size())
+				break;
+			const TraceRecord& record = records[index];
+
+			const std::string length = field(header, "Content-Length");
+			if(!length.empty() && !skip_body(socket, rest, std::strtoull(length.c_str(), NULL, 10)))
+				break;
+			if(length.empty() && field(header, "Transfer-Encoding") == "chunked" && !skip_chunked(socket, rest))
+				break;
+
+			boost::this_thread::sleep(boost::posix_time::microseconds((boost::int64_t)(record.ttfb / speed)));
+
+			const bool head = header.compare(0, 5, "HEAD ") == 0;
+			const boost::uint64_t body = bodiless(record.status) ? 0 : record.response_body;
+
+			std::ostringstream response;
+			response << "HTTP/1.1 " << record.status << " Replayed\r\n"
+			         << "Content-Type: application/octet-stream\r\n";
+			if(!bodiless(record.status))
+				response << "Content-Length: " << body << "\r\n";
+
+			// padded to the recorded header size
+			std::string head_part = response.str();
+			const size_t PAD_FIELD = 9; // "X-Pad: " and CRLF
+			if(record.response_header > head_part.size() + PAD_FIELD + 2)
+			{
+				head_part += "X-Pad: " + std::string(record.response_header - head_part.size() - PAD_FIELD - 2, 'p') + "\r\n";
+			}
+			head_part += "\r\n";
+
+			if(!send_all(socket, head_part))
+				break;
+			if(!head && body > 0 && !send_all(socket, std::string((size_t)body, 'b')))
+				break;
+		}
+
+		socket.close();
+	}
+
+	void run_origin(Socket listener)
+	{
+		while(true)
+		{
+			Socket accepted = listener.accept();
+			if(!accepted.valid())
+				break;
+			accepted.set_no_delay(true);
+			boost::thread(boost::bind(&serve_origin, accepted)).detach();
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 3)
+	{
+		std::cerr << "usage: " << argv[0] << " <trace> <proxy host:port> [speed] [origin port] [user:password]" << '\n';
+		return EXIT_FAILURE;
+	}
+
+	if(!Socket::startup())
+	{
+		std::cerr << "init failed" << '\n';
+		return EXIT_FAILURE;
+	}
+
+	TraceFile trace;
+	if(!trace.open(argv[1]))
+	{
+		std::cerr << "can't read trace " << argv[1] << '\n';
+		return EXIT_FAILURE;
+	}
+
+	TraceRecord record;
+	for(size_t offset = 0; trace.read(offset, record); )
+	{
+		records.push_back(record);
+	}
+
+	const std::string proxy = argv[2];
+	const size_t colon = proxy.rfind(':');
+	if(colon == std::string::npos)
+	{
+		std::cerr << "proxy has to be host:port" << '\n';
+		return EXIT_FAILURE;
+	}
+	proxy_address = SocketAddress(SocketAddress::INET, Address::fromHost(proxy.substr(0, colon)),
+	                              (SocketAddress::port_t)std::atoi(proxy.c_str() + colon + 1));
+
+	if(argc > 3)
+		speed = std::atof(argv[3]) > 0.0 ? std::atof(argv[3]) : 1.0;
+	if(argc > 4)
+		origin_port = (SocketAddress::port_t)std::atoi(argv[4]);
+	if(argc > 5)
+		credentials = "Basic " + base64_encode((const unsigned char*)argv[5], std::strlen(argv[5]));
+
+	Socket listener(Socket::INET, Socket::STREAM);
+	listener.set_reuse_address(true);
+	if(!listener.bind(SocketAddress(SocketAddress::INET, Address::fromPresentation("127.0.0.1"), origin_port)) || !listener.listen(128))
+	{
+		std::cerr << "can't listen on origin port " << origin_port << '\n';
+		return EXIT_FAILURE;
+	}
+	boost::thread(boost::bind(&run_origin, listener)).detach();
+
+	// one thread per recorded client connection, requests in recorded order
+	std::map<boost::uint64_t, std::vector<size_t> > connections;
+	for(size_t i = 0; i < records.size(); i++)
+	{
+		connections[records[i].connection].push_back(i);
+	}
+
+	std::cout << records.size() << " requests on " << connections.size() << " connections at " << speed << "x" << '\n';
+
+	started = Clock::now();
+	boost::thread_group clients;
+	for(std::map<boost::uint64_t, std::vector<size_t> >::const_iterator it = connections.begin(); it != connections.end(); ++it)
+	{
+		clients.create_thread(boost::bind(&replay_connection, boost::cref(it->second)));
+	}
+	clients.join_all();
+
+	const double seconds = (Clock::now() - started) / 1000000.0;
+	std::cout << "completed " << completed << '\n'
+	          << "failed " << failed << '\n'
+	          << "seconds " << seconds << '\n'
+	          << "latency_p50_us " << latency.percentile(50.0) << '\n'
+	          << "latency_p90_us " << latency.percentile(90.0) << '\n'
+	          << "latency_p99_us " << latency.percentile(99.0) << '\n';
+
+	listener.close();
+	Socket::unload();
+	return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}